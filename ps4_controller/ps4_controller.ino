@@ -1,9 +1,58 @@
 #include <Bluepad32.h>
+#include <driver/uart.h>
 
 #define RXD2 16
 #define TXD2 17
 #define X_BUTTON 0x0001
 #define O_BUTTON 0x0002
+#define TRIANGLE_BUTTON 0x0008
+
+// Motion program commands, see src/macro/macro.h on the KL25Z
+#define COMMAND_MACRO_BEGIN 16
+#define COMMAND_MACRO_DUTY 17
+#define COMMAND_MACRO_TIME 18
+#define COMMAND_MACRO_RUN 19
+
+// Link latency probe, see src/ping/ping.h on the KL25Z
+#define COMMAND_PING 32
+#define COMMAND_PING_REPORT 33
+#define PING_INTERVAL_MS 500
+#define PING_WINDOW 64       // histogram over the last 64 round trips
+#define PING_PRINT_EVERY 20  // round trips between histogram printouts
+#define LOOP_PERIOD_MS 50
+
+// Flow control from the KL25Z, see src/flow/flow.h
+#define COMMAND_CREDIT 34
+#define CREDIT_SETTLE_MS 30     // quiet time after which nothing can still be in flight
+#define CREDIT_TIMEOUT_MS 1000  // no credit for this long: the KL25Z does not send them, write blindly
+#define CREDIT_WAIT_MS 200      // longest a non-joystick packet waits for credit
+#define INITIAL_CREDIT 21       // free space assumed before the first credit; the KL25Z queues 8 packets, 24 bytes
+
+// Battery report from the KL25Z, see src/battery/battery.h
+#define COMMAND_BATTERY 35
+
+// Runtime settings on the KL25Z, see src/config/config.h
+#define COMMAND_CONFIG 36
+#define CONFIG_QUERY 0x80
+#define CONFIG_REJECTED 0xFF
+
+// Deadline misses on the KL25Z, see src/health/health.h
+#define COMMAND_HEALTH 37
+
+// Multidrop bus, see src/uart/uart.h on the KL25Z. With BUS_MULTIDROP set, robots share UART2 and controller i
+// drives the robot at address i + 1, set beforehand on each robot with "set address" on its console
+#define BUS_MULTIDROP 0
+#define BUS_UART UART_NUM_2      // Serial2
+#define BUS_GRANT 6              // UART_BUS_GRANT: bytes a robot may answer with after each packet sent to it
+#define BUS_SILENCE_CHARS 3      // character times of quiet after which the robot's turn to answer is over
+#define LINK_BAUD 9600
+#define COMMAND_QUEUE_SIZE 16    // packets that must not be dropped, per robot; a program upload is 10
+
+#if BUS_MULTIDROP
+#define ROBOT_COUNT BP32_MAX_GAMEPADS
+#else
+#define ROBOT_COUNT 1
+#endif
 
 typedef struct {
   unsigned char x;
@@ -11,8 +60,367 @@ typedef struct {
   unsigned char command;
 } packet_t;
 
+typedef struct {
+  int8_t left;   // -100 to 100
+  int8_t right;  // -100 to 100
+  uint16_t durationMs;
+  bool ramp;  // ramp from the previous step's duties instead of jumping
+} macro_step_t;
+
+// Demo program played by the KL25Z when triangle is pressed
+const macro_step_t demoMacro[] = {
+  { 60, 60, 500, true },
+  { 60, 60, 1000, false },
+  { 60, -60, 750, false },
+  { 0, 0, 500, true },
+};
+
 ControllerPtr myControllers[BP32_MAX_GAMEPADS];
 
+// Everything the bridge keeps per robot; robot i is driven by controller i on a bus
+typedef struct {
+  uint8_t address;  // bus address, 0 on a point-to-point link
+  bool active;      // has a controller; always on a point-to-point link
+  bool trianglePressed;
+
+  // Ping state, indexed by sequence number
+  unsigned long pingSentAt[256];  // micros()
+  uint8_t pingStamp[256];         // low byte of millis() sent in the ping
+  bool pingOutstanding[256];
+  uint8_t pingSeq;
+
+  uint16_t rttWindow[PING_WINDOW];  // 0.1ms units
+  int rttCount;
+  int rttNext;
+  uint32_t rttReported;
+  bool reportPending;
+  uint16_t reportRtt;
+
+  // Credit state: bytes may be sent while sentBytes stays creditSpace ahead of creditReceived
+  bool creditsSeen;
+  uint8_t creditReceived;
+  uint8_t creditSpace;
+  uint8_t sentBytes;
+  unsigned long lastSendMs;
+  unsigned long lastCreditMs;
+
+  // Newest joystick packet not yet sent for lack of credit or of a turn on the bus
+  packet_t pendingDrive;
+  bool drivePending;
+  uint32_t coalesced;
+
+  // Packets that must not be dropped, oldest first
+  packet_t commands[COMMAND_QUEUE_SIZE];
+  unsigned long commandQueuedMs[COMMAND_QUEUE_SIZE];
+  int commandHead;
+  int commandCount;
+} robot_t;
+
+robot_t robots[ROBOT_COUNT];
+unsigned long lastPingMs = 0;
+
+// Round robin over the robots, one packet each per turn
+int nextRobot = 0;
+
+// Robot whose reply window is open; on a point-to-point link the only one
+robot_t* granted = nullptr;
+int grantReceived = 0;
+unsigned long lastBusByteUs = 0;
+uint32_t strayBytes = 0;  // received outside any reply window
+
+// Packets from the KL25Z; the stream is resynchronised on gaps between packets, and on a bus at each window
+uint8_t rxBuffer[sizeof(packet_t)];
+int rxLength = 0;
+unsigned long rxLastByteMs = 0;
+
+void serviceBus();
+
+void initRobot(robot_t* robot, uint8_t address) {
+  memset(robot, 0, sizeof(*robot));
+  robot->address = address;
+  robot->active = !BUS_MULTIDROP;
+  robot->creditsSeen = true;  // start with the KL25Z's receive ring empty
+  robot->creditSpace = INITIAL_CREDIT;
+  robot->lastCreditMs = millis();
+}
+
+int creditAvailable(const robot_t* robot) {
+  if (!robot->creditsSeen) {
+    return sizeof(packet_t);
+  }
+  uint8_t inFlight = robot->sentBytes - robot->creditReceived;
+  return (int)robot->creditSpace - inFlight;
+}
+
+// The ESP32 UART has no ninth data bit, so it is sent as the parity bit, switched per character
+void writeWithNinthBit(uint8_t data, bool ninth) {
+  Serial2.flush();  // the parity applies to the character still being shifted out
+  uart_set_parity(BUS_UART, (__builtin_parity(data) == ninth) ? UART_PARITY_EVEN : UART_PARITY_ODD);
+  Serial2.write(data);
+}
+
+void writePacket(robot_t* robot, const packet_t* packet) {
+  if (BUS_MULTIDROP) {
+    // The address character wakes every robot; only the addressed one listens to the rest
+    writeWithNinthBit(robot->address, true);
+    const uint8_t* bytes = (const uint8_t*)packet;
+    for (size_t i = 0; i < sizeof(*packet); i++) {
+      writeWithNinthBit(bytes[i], false);
+    }
+    Serial2.flush();
+    uart_set_parity(BUS_UART, UART_PARITY_EVEN);  // the robots send their ninth bit as even parity
+
+    // The addressed robot may now answer with up to BUS_GRANT bytes
+    granted = robot;
+    grantReceived = 0;
+    rxLength = 0;
+    lastBusByteUs = micros();
+  } else {
+    Serial2.write((const uint8_t*)packet, sizeof(*packet));
+  }
+  robot->sentBytes += sizeof(*packet);
+  robot->lastSendMs = millis();
+}
+
+// Queues a packet that must not be dropped; it waits a bounded time for credit once it is at the front
+void sendPacket(robot_t* robot, unsigned char x, unsigned char y, unsigned char command) {
+  while (robot->commandCount == COMMAND_QUEUE_SIZE) {
+    serviceBus();
+    delay(1);
+  }
+  int slot = (robot->commandHead + robot->commandCount) % COMMAND_QUEUE_SIZE;
+  robot->commands[slot] = { x, y, command };
+  robot->commandQueuedMs[slot] = millis();
+  robot->commandCount++;
+  serviceBus();
+}
+
+// Sends joystick state; while there is no credit or no turn only the newest state is kept
+void sendDrive(robot_t* robot, const packet_t* packet) {
+  if (robot->drivePending) {
+    robot->coalesced++;
+  }
+  robot->pendingDrive = *packet;
+  robot->drivePending = true;
+  serviceBus();
+}
+
+// The robot's next packet: commands first, then the newest joystick state, then a ping report
+bool nextPacket(robot_t* robot, packet_t* packet) {
+  bool credit = creditAvailable(robot) >= (int)sizeof(packet_t);
+
+  if (robot->commandCount > 0
+      && (credit || millis() - robot->commandQueuedMs[robot->commandHead] >= CREDIT_WAIT_MS)) {
+    *packet = robot->commands[robot->commandHead];
+    robot->commandHead = (robot->commandHead + 1) % COMMAND_QUEUE_SIZE;
+    robot->commandCount--;
+    return true;
+  }
+  if (!credit) {
+    return false;
+  }
+  if (robot->drivePending) {
+    *packet = robot->pendingDrive;
+    robot->drivePending = false;
+    return true;
+  }
+  if (robot->reportPending) {
+    *packet = { (unsigned char)(robot->reportRtt & 0xFF), (unsigned char)(robot->reportRtt >> 8), COMMAND_PING_REPORT };
+    robot->reportPending = false;
+    return true;
+  }
+  return false;
+}
+
+void handleCredit(robot_t* robot, const packet_t* packet) {
+  robot->creditReceived = packet->x;
+  robot->creditSpace = packet->y;
+  robot->creditsSeen = true;
+  robot->lastCreditMs = millis();
+  if (millis() - robot->lastSendMs > CREDIT_SETTLE_MS) {
+    robot->sentBytes = robot->creditReceived;  // realign after bytes lost on the wire
+  }
+}
+
+// x is the battery voltage in 50mV steps, y the motor duty compensation factor in 1/128 steps
+void handleBattery(robot_t* robot, const packet_t* packet) {
+  Serial.printf("Robot %d: battery %u mV, duty x%.2f\n", (int)(robot - robots) + 1, packet->x * 50, packet->y / 128.0);
+}
+
+// Answer to a COMMAND_CONFIG: x is the field and y its value now, or x is CONFIG_REJECTED and y the field
+void handleConfig(robot_t* robot, const packet_t* packet) {
+  if (packet->x == CONFIG_REJECTED) {
+    Serial.printf("Robot %d: config field %u rejected\n", (int)(robot - robots) + 1, packet->y);
+  } else {
+    Serial.printf("Robot %d: config field %u = %u\n", (int)(robot - robots) + 1, packet->x, packet->y);
+  }
+}
+
+// A thread on the KL25Z missed its deadline: x is the task (0 packet, 1 motor, 2 timer), y the overrun in 10ms steps
+void handleHealth(robot_t* robot, const packet_t* packet) {
+  Serial.printf("Robot %d: task %u overran its deadline by %u ms\n", (int)(robot - robots) + 1, packet->x, packet->y * 10);
+}
+
+// Uploads a program into a slot on the KL25Z and starts it
+void uploadMacro(robot_t* robot, uint8_t slot, const macro_step_t* steps, uint8_t count) {
+  sendPacket(robot, slot, count, COMMAND_MACRO_BEGIN);
+  for (int i = 0; i < count; i++) {
+    sendPacket(robot, (uint8_t)steps[i].left, (uint8_t)steps[i].right, COMMAND_MACRO_DUTY);
+    sendPacket(robot, steps[i].durationMs & 0xFF, ((steps[i].durationMs >> 8) & 0x7F) | (steps[i].ramp ? 0x80 : 0), COMMAND_MACRO_TIME);
+  }
+  sendPacket(robot, slot, 0, COMMAND_MACRO_RUN);
+}
+
+void sendPing(robot_t* robot) {
+  uint8_t seq = ++robot->pingSeq;
+  robot->pingStamp[seq] = millis() & 0xFF;
+  robot->pingOutstanding[seq] = true;
+  robot->pingSentAt[seq] = micros();
+  sendPacket(robot, seq, robot->pingStamp[seq], COMMAND_PING);
+}
+
+void printPingHistogram(const robot_t* robot) {
+  static const uint16_t edges[] = { 50, 75, 100, 150, 200, 300, 500, 1000, 2000 };  // 0.1ms, as on the KL25Z
+  const int bucketCount = sizeof(edges) / sizeof(edges[0]) + 1;
+  uint32_t buckets[bucketCount] = {};
+  uint16_t sorted[PING_WINDOW];
+  int rttCount = robot->rttCount;
+
+  for (int i = 0; i < rttCount; i++) {
+    int b = 0;
+    while (b < bucketCount - 1 && robot->rttWindow[i] >= edges[b]) {
+      b++;
+    }
+    buckets[b]++;
+
+    // insertion sort for the percentiles
+    int j = i;
+    while (j > 0 && sorted[j - 1] > robot->rttWindow[i]) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = robot->rttWindow[i];
+  }
+
+  Serial.printf("Robot %d: coalesced joystick packets: %lu\n", (int)(robot - robots) + 1, (unsigned long)robot->coalesced);
+  Serial.printf("RTT over last %d: min %.1f ms, p50 %.1f ms, p95 %.1f ms, max %.1f ms\n", rttCount,
+                sorted[0] / 10.0, sorted[rttCount / 2] / 10.0, sorted[rttCount * 95 / 100] / 10.0,
+                sorted[rttCount - 1] / 10.0);
+  for (int b = 0; b < bucketCount; b++) {
+    if (b < bucketCount - 1) {
+      Serial.printf("  < %6.1f ms %lu\n", edges[b] / 10.0, (unsigned long)buckets[b]);
+    } else {
+      Serial.printf("  >=%6.1f ms %lu\n", edges[b - 1] / 10.0, (unsigned long)buckets[b]);
+    }
+  }
+}
+
+void handleEcho(robot_t* robot, const packet_t* packet) {
+  uint8_t seq = packet->x;
+  if (!robot->pingOutstanding[seq] || robot->pingStamp[seq] != packet->y) {
+    return;  // corrupted, or an echo of a ping whose slot was reused
+  }
+  robot->pingOutstanding[seq] = false;
+
+  unsigned long rtt = (micros() - robot->pingSentAt[seq]) / 100;
+  if (rtt > UINT16_MAX) {
+    rtt = UINT16_MAX;
+  }
+  robot->rttWindow[robot->rttNext] = rtt;
+  robot->rttNext = (robot->rttNext + 1) % PING_WINDOW;
+  if (robot->rttCount < PING_WINDOW) {
+    robot->rttCount++;
+  }
+
+  robot->reportRtt = rtt;
+  robot->reportPending = true;
+  if (++robot->rttReported % PING_PRINT_EVERY == 0) {
+    printPingHistogram(robot);
+  }
+}
+
+void receiveFromRobots() {
+  while (Serial2.available()) {
+    uint8_t data = Serial2.read();
+    if (BUS_MULTIDROP) {
+      // Only the granted robot may be talking
+      if (granted == nullptr) {
+        strayBytes++;
+        continue;
+      }
+      grantReceived++;
+      lastBusByteUs = micros();
+    } else if (rxLength > 0 && millis() - rxLastByteMs > 20) {
+      // a partial packet followed by a gap is the tail of a corrupted one
+      rxLength = 0;
+    }
+    rxBuffer[rxLength++] = data;
+    rxLastByteMs = millis();
+
+    if (rxLength == sizeof(packet_t)) {
+      rxLength = 0;
+      packet_t packet;
+      memcpy(&packet, rxBuffer, sizeof(packet));
+      robot_t* robot = granted;
+      if (packet.command == COMMAND_PING) {
+        handleEcho(robot, &packet);
+      } else if (packet.command == COMMAND_CREDIT) {
+        handleCredit(robot, &packet);
+      } else if (packet.command == COMMAND_BATTERY) {
+        handleBattery(robot, &packet);
+      } else if (packet.command == COMMAND_CONFIG) {
+        handleConfig(robot, &packet);
+      } else if (packet.command == COMMAND_HEALTH) {
+        handleHealth(robot, &packet);
+      }
+    }
+  }
+
+  for (int i = 0; i < ROBOT_COUNT; i++) {
+    robot_t* robot = &robots[i];
+    if (robot->creditsSeen && millis() - robot->lastCreditMs > CREDIT_TIMEOUT_MS) {
+      robot->creditsSeen = false;
+      Serial.printf("Robot %d: no credit from the KL25Z, flow control off\n", i + 1);
+    }
+  }
+}
+
+// On a bus, the granted robot's window stays open until it has used its grant or gone quiet
+bool replyWindowOpen() {
+  if (!BUS_MULTIDROP || granted == nullptr) {
+    return false;
+  }
+  unsigned long silenceUs = BUS_SILENCE_CHARS * 11 * 1000000UL / LINK_BAUD;
+  if (grantReceived < BUS_GRANT && micros() - lastBusByteUs < silenceUs) {
+    return true;
+  }
+  granted = nullptr;
+  return false;
+}
+
+// Receives, then sends what the robots have waiting: one packet per robot per turn, round robin
+void serviceBus() {
+  receiveFromRobots();
+  if (replyWindowOpen()) {
+    return;
+  }
+
+  bool sent;
+  do {
+    sent = false;
+    for (int n = 0; n < ROBOT_COUNT && !sent; n++) {
+      int i = (nextRobot + n) % ROBOT_COUNT;
+      packet_t packet;
+      if (robots[i].active && nextPacket(&robots[i], &packet)) {
+        writePacket(&robots[i], &packet);
+        nextRobot = (i + 1) % ROBOT_COUNT;
+        sent = true;
+      }
+    }
+    // On a point-to-point link everything with credit goes straight away
+  } while (sent && !BUS_MULTIDROP);
+}
+
 // This callback gets called any time a new gamepad is connected.
 // Up to 4 gamepads can be connected at the same time.
 void onConnectedController(ControllerPtr ctl) {
@@ -25,6 +433,9 @@ void onConnectedController(ControllerPtr ctl) {
       ControllerProperties properties = ctl->getProperties();
       Serial.printf("Controller model: %s, VID=0x%04x, PID=0x%04x\n", ctl->getModelName().c_str(), properties.vendor_id, properties.product_id);
       myControllers[i] = ctl;
+      if (BUS_MULTIDROP) {
+        robots[i].active = true;
+      }
       foundEmptySlot = true;
       break;
     }
@@ -42,6 +453,9 @@ void onDisconnectedController(ControllerPtr ctl) {
     if (myControllers[i] == ctl) {
       Serial.printf("CALLBACK: Controller disconnected from index=%d\n", i);
       myControllers[i] = nullptr;
+      if (BUS_MULTIDROP) {
+        robots[i].active = false;
+      }
       foundController = true;
       break;
     }
@@ -79,7 +493,9 @@ void dumpGamepad(ControllerPtr ctl) {
 
 // ========= GAME CONTROLLER ACTIONS SECTION ========= //
 
-void processGamepad(ControllerPtr ctl) {
+void processGamepad(ControllerPtr ctl, robot_t* robot) {
+  bool triangleWasPressed = robot->trianglePressed;
+  robot->trianglePressed = ctl->buttons() == TRIANGLE_BUTTON;
   // There are different ways to query whether a button is pressed.
   // By query each button individually:
   //  a(), b(), x(), y(), l1(), etc...
@@ -90,13 +506,17 @@ void processGamepad(ControllerPtr ctl) {
   //== PS4 X button = 0x0001 ==//
   if (ctl->buttons() == X_BUTTON) {
     // code for when X button is pushed
-    packet.command = 2;
     Serial.println("X pressed");
-    Serial2.write((uint8_t*)&packet, sizeof(packet));
+    sendPacket(robot, 0, 0, 2);
   } else if (ctl->buttons() == O_BUTTON) {
-    packet.command = 3;
     Serial.println("O pressed");
-    Serial2.write((uint8_t*)&packet, sizeof(packet));
+    sendPacket(robot, 0, 0, 3);
+  } else if (ctl->buttons() == TRIANGLE_BUTTON) {
+    // Upload once per press; moving the joystick afterwards aborts the program
+    if (!triangleWasPressed) {
+      Serial.println("Triangle pressed, uploading demo program");
+      uploadMacro(robot, 0, demoMacro, sizeof(demoMacro) / sizeof(demoMacro[0]));
+    }
   } else {
     //== LEFT JOYSTICK DEADZONE ==//
     if (ctl->axisY() > -60 && ctl->axisY() < 60 && ctl->axisRX() > -60 && ctl->axisRX() < 60) {
@@ -118,16 +538,18 @@ void processGamepad(ControllerPtr ctl) {
     packet.x = sendX;
     packet.y = sendY;
 
-    Serial2.write((uint8_t*)&packet, sizeof(packet));
+    sendDrive(robot, &packet);
     // dumpGamepad(ctl); // uncomment for any hardware debugging
   }
 }
 
 void processControllers() {
-  for (auto myController : myControllers) {
+  for (int i = 0; i < BP32_MAX_GAMEPADS; i++) {
+    ControllerPtr myController = myControllers[i];
     if (myController && myController->isConnected() && myController->hasData()) {
       if (myController->isGamepad()) {
-        processGamepad(myController);
+        // Every controller drives the one robot on a point-to-point link
+        processGamepad(myController, &robots[BUS_MULTIDROP ? i : 0]);
       } else {
         Serial.println("Unsupported controller");
       }
@@ -138,7 +560,7 @@ void processControllers() {
 // Arduino setup function. Runs in CPU 1
 void setup() {
   Serial.begin(115200);
-  Serial2.begin(9600, SERIAL_8N1, RXD2, TXD2);
+  Serial2.begin(LINK_BAUD, BUS_MULTIDROP ? SERIAL_8E1 : SERIAL_8N1, RXD2, TXD2);
   Serial.printf("Firmware: %s\n", BP32.firmwareVersion());
   const uint8_t* addr = BP32.localBdAddress();
   Serial.printf("BD Addr: %2X:%2X:%2X:%2X:%2X:%2X\n", addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
@@ -159,10 +581,19 @@ void setup() {
   // - Second one, which is a "virtual device", is a mouse.
   // By default, it is disabled.
   BP32.enableVirtualDevice(false);
+
+  for (int i = 0; i < ROBOT_COUNT; i++) {
+    initRobot(&robots[i], BUS_MULTIDROP ? i + 1 : 0);
+  }
+  if (!BUS_MULTIDROP) {
+    granted = &robots[0];
+  }
 }
 
 // Arduino loop function. Runs in CPU 1.
 void loop() {
+  unsigned long loopStart = millis();
+
   // This call fetches all the controllers' data.
   // Call this function in your main loop.
   bool dataUpdated = BP32.update();
@@ -170,7 +601,20 @@ void loop() {
     processControllers();
   } else {
     packet_t packet = {0, 0, 0};
-    Serial2.write((uint8_t*)&packet, sizeof(packet));
+    for (int i = 0; i < ROBOT_COUNT; i++) {
+      if (robots[i].active) {
+        sendDrive(&robots[i], &packet);
+      }
+    }
+  }
+
+  if (millis() - lastPingMs >= PING_INTERVAL_MS) {
+    lastPingMs = millis();
+    for (int i = 0; i < ROBOT_COUNT; i++) {
+      if (robots[i].active) {
+        sendPing(&robots[i]);
+      }
+    }
   }
 
   // The main loop must have some kind of "yield to lower priority task" event.
@@ -180,5 +624,9 @@ void loop() {
   // https://stackoverflow.com/questions/66278271/task-watchdog-got-triggered-the-tasks-did-not-reset-the-watchdog-in-time
 
   // vTaskDelay(1);
-  delay(50);
-}
\ No newline at end of file
+  // Poll for echoes and serve the robots in turn while waiting, so round trips are timed to about 1ms
+  while (millis() - loopStart < LOOP_PERIOD_MS) {
+    serviceBus();
+    delay(1);
+  }
+}
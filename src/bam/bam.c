@@ -0,0 +1,182 @@
+#include "bam/bam.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Masks to write at the start of each plane; compare and next are only set on the first plane of a run
+typedef struct bam_plane_t
+{
+    uint32_t setE, clearE;
+    uint32_t setC, clearC;
+    uint16_t compare; // LPTMR compare value for the whole run
+    uint8_t next;     // first plane of the next run, 0 after the last one
+} bam_plane_t;
+
+static PortPin bamLeds[BAM_MAX_LEDS];
+static uint8_t bamCount;
+static uint8_t levels[BAM_MAX_LEDS];
+
+static bam_plane_t planeBuffers[2][BAM_PLANES];
+static bam_plane_t *volatile shown = planeBuffers[0];
+static bam_plane_t *volatile pending = NULL;
+
+// Plane being shown
+static uint8_t plane;
+
+static bam_stats_t bamStats;
+
+void initBam(const PortPin *leds, uint8_t count)
+{
+    bamCount = (count < BAM_MAX_LEDS) ? count : BAM_MAX_LEDS;
+    memcpy(bamLeds, leds, bamCount * sizeof(PortPin));
+    memset(levels, 0, sizeof(levels));
+    // Taken up by the first frame
+    bamCommit();
+
+    // MCGIRCLK from the 4MHz fast IRC, undivided
+    MCG_SC &= ~MCG_SC_FCRDIV_MASK;
+    MCG_C2 |= MCG_C2_IRCS_MASK;
+    MCG_C1 |= MCG_C1_IRCLKEN_MASK;
+
+    LPTMR0_CSR = 0;
+    // MCGIRCLK divided by 2
+    LPTMR0_PSR = LPTMR_PSR_PCS(0) | LPTMR_PSR_PRESCALE(0);
+
+    // Start in the last plane of the blank buffer, so the first interrupt swaps in the committed frame
+    plane = BAM_PLANES - 1;
+    shown[plane].compare = (BAM_UNIT_COUNTS << plane) - 1;
+    shown[plane].next = 0;
+    LPTMR0_CMR = shown[plane].compare;
+    bamClearStats();
+
+    NVIC_SetPriority(LPTimer_IRQn, BAM_INT_PRIO);
+    NVIC_ClearPendingIRQ(LPTimer_IRQn);
+    NVIC_EnableIRQ(LPTimer_IRQn);
+
+    // Time counter mode, reset on compare
+    LPTMR0_CSR = LPTMR_CSR_TCF_MASK | LPTMR_CSR_TIE_MASK | LPTMR_CSR_TEN_MASK;
+}
+
+void bamSet(uint8_t led, uint8_t level)
+{
+    if (led < bamCount)
+    {
+        levels[led] = level;
+    }
+}
+
+static bool sameMasks(const bam_plane_t *a, const bam_plane_t *b)
+{
+    return a->setE == b->setE && a->clearE == b->clearE && a->setC == b->setC && a->clearC == b->clearC;
+}
+
+void bamCommit(void)
+{
+    // Withdraw a commit not taken up yet, so the interrupt cannot swap buffers while this one is filled
+    pending = NULL;
+    bam_plane_t *buffer = (shown == planeBuffers[0]) ? planeBuffers[1] : planeBuffers[0];
+    for (int k = 0; k < BAM_PLANES; k++)
+    {
+        bam_plane_t *p = &buffer[k];
+        memset(p, 0, sizeof(*p));
+        for (int i = 0; i < bamCount; i++)
+        {
+            uint32_t mask = MASK(bamLeds[i].pin);
+            bool on = levels[i] & (1 << k);
+            if (bamLeds[i].port == PRTE)
+            {
+                *(on ? &p->setE : &p->clearE) |= mask;
+            }
+            else
+            {
+                *(on ? &p->setC : &p->clearC) |= mask;
+            }
+        }
+    }
+
+    for (int k = 0; k < BAM_PLANES;)
+    {
+        uint32_t counts = BAM_UNIT_COUNTS << k;
+        int end = k + 1;
+        while (end < BAM_PLANES && sameMasks(&buffer[end], &buffer[k]))
+        {
+            counts += BAM_UNIT_COUNTS << end;
+            end++;
+        }
+        buffer[k].compare = (uint16_t)(counts - 1);
+        buffer[k].next = (uint8_t)(end % BAM_PLANES);
+        k = end;
+    }
+    pending = buffer;
+}
+
+void LPTimer_IRQHandler(void)
+{
+    uint32_t start = osKernelGetSysTimerCount();
+
+    NVIC_ClearPendingIRQ(LPTimer_IRQn);
+    bamStats.counts += shown[plane].compare + 1u; // the run that just ended
+
+    plane = shown[plane].next;
+    if (plane == 0)
+    {
+        if (pending != NULL)
+        {
+            shown = pending;
+            pending = NULL;
+        }
+    }
+
+    const bam_plane_t *p = &shown[plane];
+    PTE->PSOR = p->setE;
+    PTE->PCOR = p->clearE;
+    PTC->PSOR = p->setC;
+    PTC->PCOR = p->clearC;
+
+    // CMR may only change while the compare flag is set; the counter restarted at the compare
+    LPTMR0_CMR = p->compare;
+    LPTMR0_CSR |= LPTMR_CSR_TCF_MASK;
+
+    uint32_t cycles = osKernelGetSysTimerCount() - start;
+    bamStats.planes++;
+    bamStats.cyclesTotal += cycles;
+    if (cycles > bamStats.cyclesMax)
+    {
+        bamStats.cyclesMax = cycles;
+    }
+}
+
+void bamClearStats(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(&bamStats, 0, sizeof(bamStats));
+    __set_PRIMASK(primask);
+}
+
+void bamPrintStats(void (*print)(const char *str))
+{
+    char line[96];
+    bam_stats_t stats;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stats = bamStats;
+    __set_PRIMASK(primask);
+
+    if (stats.planes == 0 || stats.counts == 0)
+    {
+        print("no bit-planes shown\r\n");
+        return;
+    }
+    // In SysTimer cycles
+    uint64_t elapsed = stats.counts * (osKernelGetSysTimerFreq() / BAM_LPTMR_HZ);
+    // Hundredths of a percent of the CPU
+    uint32_t load = (uint32_t)(stats.cyclesTotal * 10000 / elapsed);
+    sprintf(line, "%lu interrupts/s, %lu cycles avg, %lu max, CPU %lu.%02lu%%\r\n",
+            (unsigned long)((uint64_t)stats.planes * BAM_LPTMR_HZ / stats.counts),
+            (unsigned long)(stats.cyclesTotal / stats.planes), (unsigned long)stats.cyclesMax,
+            (unsigned long)(load / 100), (unsigned long)(load % 100));
+    print(line);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file bam.h
+ * @brief 8-bit brightness for the status LEDs by bit-angle modulation on the LPTMR.
+ *
+ * Each frame is split into 8 bit-planes, plane k lasting BAM_UNIT_COUNTS << k
+ * LPTMR counts. An LED is lit during plane k if bit k of its level is set, so
+ * it is lit for level/255 of the frame. LPTimer_IRQHandler runs once per plane
+ * and only writes the precomputed PSOR and PCOR masks of the next plane to
+ * PORTE and PORTC, then loads the plane's length; there is no per-LED work in
+ * the interrupt. Consecutive planes with the same masks are shown as one
+ * longer plane, so LEDs that are all fully on or off cost one interrupt per
+ * frame instead of eight.
+ *
+ * The LPTMR counts MCGIRCLK (the 4MHz fast internal reference, unused
+ * otherwise) divided by 2. With BAM_UNIT_COUNTS 32 a frame is 4.08ms, a
+ * refresh of 245Hz, for 245 to 1960 interrupts per second.
+ *
+ * bamSet() stores levels; bamCommit() turns them into masks in a back buffer
+ * that the interrupt takes up at the start of the next frame, so a frame never
+ * mixes old and new levels. The "bam" console command prints the measured cost
+ * of the interrupt.
+ */
+#ifndef BAM_H
+#define BAM_H
+
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+#include "lights/lights.h"
+
+#define BAM_MAX_LEDS 16
+#define BAM_PLANES 8
+#define BAM_LPTMR_HZ 2000000
+#define BAM_UNIT_COUNTS 32 // length of the shortest plane in LPTMR counts: 16us
+#define BAM_INT_PRIO 128   // a late plane only stretches one LED pulse slightly
+
+typedef struct bam_stats_t
+{
+    uint32_t planes;    // interrupts, one per run of planes with the same masks
+    uint32_t cyclesMax; // SysTimer cycles spent in one interrupt
+    uint64_t cyclesTotal;
+    uint64_t counts; // LPTMR counts of the planes shown; unlike the SysTimer, this does not wrap every 89s
+} bam_stats_t;
+
+/**
+ * @brief Takes over the given LED pins (PORTE or PORTC, already GPIO outputs) and starts the LPTMR.
+ *
+ * LED i is the i-th entry of leds. All start off.
+ */
+void initBam(const PortPin *leds, uint8_t count);
+
+/**
+ * @brief Sets the brightness of LED led (0 off, 255 fully on) from the next bamCommit().
+ */
+void bamSet(uint8_t led, uint8_t level);
+
+/**
+ * @brief Publishes the levels set so far; they are shown from the start of the next frame.
+ *
+ * Does not block, so timer callbacks can call it, but only one context may call it at a time.
+ */
+void bamCommit(void);
+
+void bamPrintStats(void (*print)(const char *str));
+
+void bamClearStats(void);
+
+#endif
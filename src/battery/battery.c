@@ -0,0 +1,220 @@
+#include "battery/battery.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "timer/timer.h"
+
+#define BATTERY_RING_BYTES (BATTERY_RING_SAMPLES * sizeof(uint16_t))
+#define BATTERY_DMOD 2 // 32-byte destination modulo, matching BATTERY_RING_BYTES
+#define BATTERY_BCR 0xFFFFE // largest byte count that is a whole number of samples
+#define BATTERY_FILTER_FRAC 8
+
+// The DMA modulo wraps on address bits, so the ring must be aligned to its size
+static volatile uint16_t ring[BATTERY_RING_SAMPLES] __attribute__((aligned(BATTERY_RING_BYTES)));
+
+static sw_timer_t filterTimer;
+static bool primed;
+static bool compensate = true;
+static volatile uint16_t compensation = BATTERY_COMP_ONE;
+
+static battery_stats_t batteryStats;
+
+// Runs the ADC's self-calibration, which needs the ADC idle, software triggered and averaging 32 samples
+static bool calibrate(void)
+{
+    ADC0->SC2 &= ~ADC_SC2_ADTRG_MASK;
+    ADC0->SC3 = ADC_SC3_CAL_MASK | ADC_SC3_AVGE_MASK | ADC_SC3_AVGS(3);
+    while (ADC0->SC3 & ADC_SC3_CAL_MASK)
+        ;
+    if (ADC0->SC3 & ADC_SC3_CALF_MASK)
+    {
+        return false;
+    }
+
+    uint16_t plus = ADC0->CLP0 + ADC0->CLP1 + ADC0->CLP2 + ADC0->CLP3 + ADC0->CLP4 + ADC0->CLPS;
+    ADC0->PG = (plus >> 1) | 0x8000;
+    uint16_t minus = ADC0->CLM0 + ADC0->CLM1 + ADC0->CLM2 + ADC0->CLM3 + ADC0->CLM4 + ADC0->CLMS;
+    ADC0->MG = (minus >> 1) | 0x8000;
+    return true;
+}
+
+static void initBatteryAdc(void)
+{
+    // initPins() gates ADC0 and leaves PTB2 at MUX 0, the analog function
+    // Bus clock / 8 = 3MHz, within the 4MHz calibration limit; 16-bit, long sample time for the divider's impedance
+    ADC0->CFG1 = ADC_CFG1_ADIV(3) | ADC_CFG1_ADLSMP_MASK | ADC_CFG1_MODE(3) | ADC_CFG1_ADICLK(0);
+    ADC0->CFG2 = 0;
+    calibrate();
+
+    // Each result is the mean of 16 conversions, about 250us; DMA request instead of an interrupt
+    ADC0->SC3 = ADC_SC3_AVGE_MASK | ADC_SC3_AVGS(2);
+    ADC0->SC2 = ADC_SC2_ADTRG_MASK | ADC_SC2_DMAEN_MASK;
+
+    // Hardware trigger from PIT channel 0 instead of the TPMs
+    SIM_SOPT7 = SIM_SOPT7_ADC0ALTTRGEN_MASK | SIM_SOPT7_ADC0TRGSEL(BATTERY_TRGSEL_PIT0);
+    ADC0->SC1[0] = ADC_SC1_ADCH(BATTERY_ADC_CHANNEL);
+}
+
+static void initBatteryDma(void)
+{
+    DMAMUX0->CHCFG[BATTERY_DMA_CHANNEL] = 0;
+
+    DMA0->DMA[BATTERY_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
+    DMA0->DMA[BATTERY_DMA_CHANNEL].SAR = (uint32_t)&ADC0->R[0];
+    DMA0->DMA[BATTERY_DMA_CHANNEL].DAR = (uint32_t)ring;
+    DMA0->DMA[BATTERY_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_BCR(BATTERY_BCR);
+    // One 16-bit transfer per request into the ring; the request stays enabled when the count runs out
+    DMA0->DMA[BATTERY_DMA_CHANNEL].DCR = DMA_DCR_EINT_MASK | DMA_DCR_ERQ_MASK | DMA_DCR_CS_MASK | DMA_DCR_SSIZE(2) |
+                                         DMA_DCR_DINC_MASK | DMA_DCR_DSIZE(2) | DMA_DCR_DMOD(BATTERY_DMOD);
+
+    NVIC_SetPriority(DMA0_IRQn, BATTERY_INT_PRIO);
+    NVIC_ClearPendingIRQ(DMA0_IRQn);
+    NVIC_EnableIRQ(DMA0_IRQn);
+
+    DMAMUX0->CHCFG[BATTERY_DMA_CHANNEL] = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(BATTERY_DMAMUX_ADC0);
+}
+
+// Mean of the ring, low-pass filter, voltage and compensation factor
+static void filterCallback(void *arg)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < BATTERY_RING_SAMPLES; i++)
+    {
+        sum += ring[i];
+    }
+    uint16_t raw = sum / BATTERY_RING_SAMPLES;
+    uint32_t sample = (uint32_t)raw << BATTERY_FILTER_FRAC;
+
+    if (!primed)
+    {
+        batteryStats.filtered = sample;
+        primed = true;
+    }
+    else
+    {
+        int32_t error = (int32_t)sample - (int32_t)batteryStats.filtered;
+        batteryStats.filtered += error >> BATTERY_FILTER_SHIFT;
+    }
+
+    uint32_t mv = (uint32_t)((uint64_t)batteryStats.filtered * BATTERY_VREF_MV * BATTERY_DIVIDER_NUM /
+                             ((uint64_t)BATTERY_DIVIDER_DEN << (16 + BATTERY_FILTER_FRAC)));
+    uint32_t comp = BATTERY_COMP_ONE;
+    if (mv >= BATTERY_MIN_MV)
+    {
+        comp = ((uint32_t)BATTERY_NOMINAL_MV << BATTERY_COMP_SHIFT) / mv;
+        if (comp < BATTERY_COMP_MIN)
+        {
+            comp = BATTERY_COMP_MIN;
+        }
+        else if (comp > BATTERY_COMP_MAX)
+        {
+            comp = BATTERY_COMP_MAX;
+        }
+    }
+
+    batteryStats.raw = raw;
+    batteryStats.mv = mv;
+    batteryStats.comp = comp;
+    compensation = compensate ? comp : BATTERY_COMP_ONE;
+}
+
+void initBattery(void)
+{
+    memset(&batteryStats, 0, sizeof(batteryStats));
+    batteryStats.comp = BATTERY_COMP_ONE;
+
+    initBatteryAdc();
+    initBatteryDma();
+
+    // PIT channel 0 only triggers the ADC; its interrupt stays off, PIT_IRQHandler belongs to the timers
+    PIT_TCTRL0 = 0;
+    PIT_LDVAL0 = DEFAULT_SYSTEM_CLOCK / 2 / BATTERY_SAMPLE_HZ - 1;
+    PIT_TCTRL0 = PIT_TCTRL_TEN_MASK;
+
+    timerSetup(&filterTimer, filterCallback, NULL);
+    // The first filter run waits for a full ring
+    timerStart(&filterTimer, BATTERY_FILTER_MS * 1000, BATTERY_FILTER_MS * 1000);
+}
+
+void DMA0_IRQHandler(void)
+{
+    NVIC_ClearPendingIRQ(DMA0_IRQn);
+
+    uint32_t status = DMA0->DMA[BATTERY_DMA_CHANNEL].DSR_BCR;
+    if (status & (DMA_DSR_BCR_CE_MASK | DMA_DSR_BCR_BES_MASK | DMA_DSR_BCR_BED_MASK))
+    {
+        batteryStats.errors++;
+    }
+    else
+    {
+        batteryStats.reloads++;
+    }
+
+    // Clearing DONE clears the error flags too; the destination address kept its place in the ring
+    DMA0->DMA[BATTERY_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
+    DMA0->DMA[BATTERY_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_BCR(BATTERY_BCR);
+}
+
+uint32_t batteryGetMillivolts(void) { return batteryStats.mv; }
+
+uint16_t batteryGetCompensation(void) { return compensation; }
+
+void batterySetCompensationEnabled(bool enabled)
+{
+    compensate = enabled;
+    compensation = enabled ? batteryStats.comp : BATTERY_COMP_ONE;
+}
+
+bool batteryIsCompensationEnabled(void) { return compensate; }
+
+bool batteryReport(packet_t *packet)
+{
+    static uint32_t lastReport;
+
+    // Nothing to report until the first filter run, which may be a while after boot with the fast start
+    if (!primed)
+    {
+        return false;
+    }
+
+    uint32_t now = osKernelGetTickCount();
+    if (now - lastReport < BATTERY_REPORT_MS)
+    {
+        return false;
+    }
+    lastReport = now;
+
+    uint32_t mv = batteryGetMillivolts();
+    uint32_t steps = (mv + 25) / 50;
+    packet->x = (steps > 0xFF) ? 0xFF : steps;
+    packet->y = batteryGetCompensation() >> (BATTERY_COMP_SHIFT - 7);
+    packet->command = COMMAND_BATTERY;
+    return true;
+}
+
+void batteryPrintStats(void (*print)(const char *str))
+{
+    char line[96];
+    battery_stats_t stats;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stats = batteryStats;
+    __set_PRIMASK(primask);
+
+    if (stats.mv < BATTERY_MIN_MV)
+    {
+        sprintf(line, "no battery on PTB2 (%lu mV, raw %u)\r\n", (unsigned long)stats.mv, stats.raw);
+        print(line);
+        return;
+    }
+    // Factors in thousandths
+    uint32_t factor = ((uint32_t)stats.comp * 1000) >> BATTERY_COMP_SHIFT;
+    sprintf(line, "%lu.%03lu V (raw %u), factor %lu.%03lu, compensation %s\r\n", (unsigned long)(stats.mv / 1000),
+            (unsigned long)(stats.mv % 1000), stats.raw, (unsigned long)(factor / 1000),
+            (unsigned long)(factor % 1000), compensate ? "on" : "off");
+    print(line);
+    sprintf(line, "%lu DMA reloads, %lu errors\r\n", (unsigned long)stats.reloads, (unsigned long)stats.errors);
+    print(line);
+}
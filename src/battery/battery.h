@@ -0,0 +1,105 @@
+/**
+ * @file battery.h
+ * @brief Battery voltage sampled in the background by ADC0 and DMA, and the motor duty compensation derived from it.
+ *
+ * The battery reaches PTB2 (ADC0_SE12) through a resistor divider of
+ * BATTERY_DIVIDER_NUM/BATTERY_DIVIDER_DEN. PIT channel 0 runs free at
+ * BATTERY_SAMPLE_HZ and triggers a conversion through SIM_SOPT7; each result
+ * raises a DMA request, and DMA channel 0 copies it into a ring of
+ * BATTERY_RING_SAMPLES kept by the DMA's destination modulo. No interrupt runs
+ * per sample: DMA0_IRQHandler only reloads the byte count once every nine
+ * minutes or so.
+ *
+ * A periodic software timer averages the ring every BATTERY_FILTER_MS and
+ * feeds the mean through a first-order low-pass filter in fixed point, so motor
+ * current spikes do not show up in the reading. From the filtered voltage it
+ * derives a compensation factor, BATTERY_NOMINAL_MV over the voltage, that the
+ * motor driver scales every duty by, so a given speed gives the same average
+ * motor voltage from a full pack as from a flat one. Duty cannot exceed 100%,
+ * so full speed still slows as the pack runs down.
+ *
+ * Readings below BATTERY_MIN_MV mean the sense wire is not connected, and the
+ * factor stays at 1. The "battery" console command prints the reading and the
+ * factor, and the KL25Z sends both to the ESP32 in a COMMAND_BATTERY packet
+ * every BATTERY_REPORT_MS.
+ */
+#ifndef BATTERY_H
+#define BATTERY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+#include "packet/packet.h"
+#include "pinmap/pinmap.h"
+
+#define BATTERY_SENSE_PIN PIN_BATTERY_SENSE // PortB 2; ADC0_SE12
+#define BATTERY_ADC_CHANNEL 12
+#define BATTERY_DMA_CHANNEL 0
+#define BATTERY_DMAMUX_ADC0 40
+#define BATTERY_TRGSEL_PIT0 4
+
+#define BATTERY_SAMPLE_HZ 1000
+#define BATTERY_RING_SAMPLES 16 // power of two; the DMA modulo covers 2 * BATTERY_RING_SAMPLES bytes
+#define BATTERY_FILTER_MS 20
+#define BATTERY_FILTER_SHIFT 3 // the filter settles to 63% in 2^BATTERY_FILTER_SHIFT updates (160ms)
+#define BATTERY_REPORT_MS 1000
+
+// 20k over 10k divider into the 3.3V reference
+#define BATTERY_VREF_MV 3300
+#define BATTERY_DIVIDER_NUM 3
+#define BATTERY_DIVIDER_DEN 1
+
+#define BATTERY_NOMINAL_MV 7000 // 2S pack under load; duty is exact at this voltage
+#define BATTERY_MIN_MV 3000     // below this the sense wire is taken as disconnected
+
+#define BATTERY_COMP_SHIFT 12 // compensation factors are Q4.12
+#define BATTERY_COMP_ONE (1 << BATTERY_COMP_SHIFT)
+#define BATTERY_COMP_MIN (BATTERY_COMP_ONE / 2)
+#define BATTERY_COMP_MAX (BATTERY_COMP_ONE * 3 / 2)
+
+#define BATTERY_INT_PRIO 192
+
+typedef struct battery_stats_t
+{
+    uint16_t raw;      // mean of the last ring, 16-bit ADC counts
+    uint32_t filtered; // low-pass filtered counts, Q24.8
+    uint32_t mv;       // battery voltage from the filtered counts
+    uint16_t comp;     // factor applied to the motor duty, Q4.12
+    uint32_t reloads;  // DMA byte count reloads
+    uint32_t errors;   // DMA bus or configuration errors
+} battery_stats_t;
+
+/**
+ * @brief Calibrates ADC0 and starts PIT channel 0, ADC0 and DMA channel 0 sampling the battery.
+ *
+ * Call after initTimer(), which enables the PIT and owns its interrupt.
+ */
+void initBattery(void);
+
+/**
+ * @brief Filtered battery voltage in millivolts.
+ */
+uint32_t batteryGetMillivolts(void);
+
+/**
+ * @brief Factor the motor duty is scaled by, Q4.12; BATTERY_COMP_ONE when compensation is off.
+ */
+uint16_t batteryGetCompensation(void);
+
+void batterySetCompensationEnabled(bool enabled);
+
+bool batteryIsCompensationEnabled(void);
+
+/**
+ * @brief Fills packet with a COMMAND_BATTERY report and returns true once every BATTERY_REPORT_MS.
+ *
+ * x is the voltage in 50mV steps, y the compensation factor in 1/128 steps.
+ */
+bool batteryReport(packet_t *packet);
+
+void batteryPrintStats(void (*print)(const char *str));
+
+#endif
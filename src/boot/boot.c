@@ -0,0 +1,150 @@
+#include "boot/boot.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// In the NoInit IRAM2 region, so the startup code neither loads nor clears it
+static boot_record_t record __attribute__((at(BOOT_RECORD_ADDRESS), zero_init));
+static boot_record_t previous;
+static bool havePrevious;
+
+// SysTick wraps every 2^24 cycles (350ms); wraps are counted when the clock is read, so reads must be closer than that
+static uint32_t wraps;
+static uint32_t kernelBase;
+static volatile bool kernelStarted;
+
+static const char *const phaseNames[BOOT_PHASE_COUNT] = {
+    "pins", "timer", "link", "motors", "kernel", "ready", "first drive", "lazy start",
+};
+
+typedef struct reset_cause_t
+{
+    uint32_t mask;
+    const char *name;
+} reset_cause_t;
+
+static const reset_cause_t resetCauses[] = {
+    {RCM_SRS0_POR_MASK, "power-on"},
+    {RCM_SRS0_PIN_MASK, "pin"},
+    {RCM_SRS0_WDOG_MASK, "watchdog"},
+    {RCM_SRS0_LVD_MASK, "low voltage"},
+    {RCM_SRS0_LOC_MASK, "clock loss"},
+    {RCM_SRS0_LOL_MASK, "lock loss"},
+    {(uint32_t)RCM_SRS1_SW_MASK << 8, "software"},
+    {(uint32_t)RCM_SRS1_LOCKUP_MASK << 8, "lockup"},
+    {(uint32_t)RCM_SRS1_MDM_AP_MASK << 8, "debugger"},
+    {(uint32_t)RCM_SRS1_SACKERR_MASK << 8, "stop ack"},
+};
+
+void bootStart(void)
+{
+    SysTick->CTRL = 0;
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
+    uint32_t cause = ((uint32_t)RCM_SRS1 << 8) | RCM_SRS0;
+    uint32_t boots = 0;
+
+    // RAM holds garbage after power-on, whatever it happens to look like
+    if (record.magic == BOOT_MAGIC && !(cause & RCM_SRS0_POR_MASK))
+    {
+        previous = record;
+        havePrevious = true;
+        boots = record.boots;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.magic = BOOT_MAGIC;
+    record.boots = boots + 1;
+    record.resetCause = cause;
+    record.fastStart = BOOT_FAST_START;
+}
+
+uint32_t bootNow(void)
+{
+    if (kernelStarted)
+    {
+        return kernelBase + osKernelGetSysTimerCount();
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t count = SysTick->VAL;
+    // COUNTFLAG clears when read; if it was set, count may predate the wrap
+    if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)
+    {
+        wraps++;
+        count = SysTick->VAL;
+    }
+    uint32_t now = (wraps << 24) + (SysTick_LOAD_RELOAD_Msk - count);
+    __set_PRIMASK(primask);
+    return now;
+}
+
+void bootMark(boot_phase_t phase)
+{
+    if (record.stamps[phase] != 0)
+    {
+        return;
+    }
+
+    uint32_t now = bootNow();
+    if (phase == BOOT_KERNEL)
+    {
+        // The kernel restarts SysTick and its SysTimer count from zero
+        kernelBase = now;
+        kernelStarted = true;
+    }
+    record.stamps[phase] = (now != 0) ? now : 1;
+}
+
+static void printCause(uint32_t cause, char *line)
+{
+    for (size_t i = 0; i < sizeof(resetCauses) / sizeof(resetCauses[0]); i++)
+    {
+        if (cause & resetCauses[i].mask)
+        {
+            strcat(line, " ");
+            strcat(line, resetCauses[i].name);
+        }
+    }
+}
+
+static void printRecord(const char *title, const boot_record_t *r, void (*print)(const char *str))
+{
+    char line[128];
+    uint32_t cyclesPerUs = SystemCoreClock / 1000000;
+
+    sprintf(line, "%s: boot %lu, %s order, reset", title, (unsigned long)r->boots, r->fastStart ? "fast" : "full");
+    printCause(r->resetCause, line);
+    strcat(line, "\r\n");
+    print(line);
+
+    for (int phase = 0; phase < BOOT_PHASE_COUNT; phase++)
+    {
+        if (r->stamps[phase] == 0)
+        {
+            sprintf(line, "  %-12s        -\r\n", phaseNames[phase]);
+        }
+        else
+        {
+            sprintf(line, "  %-12s %8lu us\r\n", phaseNames[phase], (unsigned long)(r->stamps[phase] / cyclesPerUs));
+        }
+        print(line);
+    }
+}
+
+void bootPrint(void (*print)(const char *str))
+{
+    // Taken under the lock so a phase marked meanwhile does not tear the copy
+    int32_t lock = osKernelLock();
+    boot_record_t current = record;
+    osKernelRestoreLock(lock);
+
+    printRecord("this boot", &current, print);
+    if (havePrevious)
+    {
+        printRecord("previous boot", &previous, print);
+    }
+}
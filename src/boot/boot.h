@@ -0,0 +1,85 @@
+/**
+ * @file boot.h
+ * @brief Boot-phase timestamps kept in retained RAM, and the order the firmware starts up in.
+ *
+ * bootStart(), first thing in main(), runs SysTick free at the core clock
+ * until the kernel takes it over; from then on stamps come from
+ * osKernelGetSysTimerCount(), offset by the time the kernel was started at.
+ * bootMark() records the first time each boot_phase_t is reached, in cycles
+ * since main() was entered. The time from reset to main(), the clock setup in
+ * SystemInit() and the C library's data initialisation, is not included.
+ *
+ * The record lives at BOOT_RECORD_ADDRESS, in the IRAM2 region the project
+ * reserves at the top of RAM with NoInit set, so it is not cleared by the
+ * startup code and survives any reset short of losing power. bootStart()
+ * keeps the previous boot's record, counts boots and stores the reset cause
+ * from the RCM, so after an unexpected reset the "boot" console command still
+ * shows how far the last boot got. Both records are printed over UART0 once
+ * the firmware is fully up.
+ *
+ * With BOOT_FAST_START set, main() brings up only what the drive path needs
+ * (pins, the timer wheel, UART1, UART0, the motors and motion programs) before
+ * starting the kernel, and the packet and motor threads are created first. A
+ * low-priority thread then starts the battery sampling (whose ADC calibration
+ * busy-waits), the RGB LED, music, lights, console and recorder while the
+ * robot already accepts commands. Clearing it restores the original order,
+ * everything before the kernel, so the two can be compared on BOOT_READY.
+ */
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+
+#define BOOT_FAST_START 1
+
+#define BOOT_RECORD_ADDRESS 0x20002FC0 // IRAM2, 0x40 bytes, NoInit
+#define BOOT_MAGIC 0xB0075EC5
+
+typedef enum
+{
+    BOOT_PINS,        // initPins() done
+    BOOT_TIMER,       // timer wheel running
+    BOOT_LINK,        // UART0 and UART1 configured
+    BOOT_MOTORS,      // motors, encoders and motion programs configured
+    BOOT_KERNEL,      // about to call osKernelStart()
+    BOOT_READY,       // packet thread waiting on UART1
+    BOOT_FIRST_DRIVE, // first drive command handled
+    BOOT_LAZY,        // battery, lights, music, console and recorder up
+    BOOT_PHASE_COUNT
+} boot_phase_t;
+
+typedef struct boot_record_t
+{
+    uint32_t magic;
+    uint32_t boots;      // since power-on
+    uint32_t resetCause; // RCM_SRS1 << 8 | RCM_SRS0
+    uint32_t fastStart;  // BOOT_FAST_START of the image that wrote the record
+    uint32_t stamps[BOOT_PHASE_COUNT]; // cycles since main(), 0 if not reached
+} boot_record_t;
+
+/**
+ * @brief Starts the boot clock and the record for this boot. Call first in main().
+ */
+void bootStart(void);
+
+/**
+ * @brief Cycles since main() was entered.
+ */
+uint32_t bootNow(void);
+
+/**
+ * @brief Records that phase was reached, unless it already was this boot. Safe from any context.
+ */
+void bootMark(boot_phase_t phase);
+
+/**
+ * @brief Prints this boot's and the previous boot's phases through print.
+ */
+void bootPrint(void (*print)(const char *str));
+
+#endif
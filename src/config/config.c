@@ -0,0 +1,371 @@
+#include "config/config.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boot/boot.h"
+#include "serialize/serialize.h"
+#include "state/state.h"
+#include "uart/uart.h"
+
+#define CONFIG_FLAG_SAVE 0x0001
+#define CONFIG_FLAG_MOVING 0x0002 // STATE_MOVING changed
+
+typedef struct field_info_t
+{
+    const char *name;
+    int32_t min;
+    int32_t max;
+    int32_t scale; // units of the byte sent over UART1
+} field_info_t;
+
+#define FIELD_INFO(ID, member, name, def, min, max, scale) [CONFIG_##ID] = {name, min, max, scale},
+static const field_info_t fields[CONFIG_FIELD_COUNT] = {CONFIG_FIELDS(FIELD_INFO)};
+
+#define FIELD_DEFAULT(ID, member, name, def, min, max, scale) .member = (def),
+static const config_t defaults = {CONFIG_FIELDS(FIELD_DEFAULT)};
+
+static const config_record_t *const slots = (const config_record_t *)FLASH_CONFIG_START;
+
+static config_t config;
+static config_stats_t stats;
+static uint32_t nextSequence = 1;
+static uint32_t writeSlot;
+static volatile bool dirty;
+static osThreadId_t configThreadId;
+
+// The fields are all int32_t, in field order
+static int32_t *fieldOf(config_t *c, config_field_t field) { return (int32_t *)c + field; }
+
+// CRC-32 (IEEE 802.3), a nibble at a time to keep the table small
+static uint32_t crc32(const void *data, size_t length)
+{
+    static const uint32_t table[16] = {0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+                                       0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+                                       0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+    const uint8_t *bytes = data;
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (length-- > 0)
+    {
+        crc ^= *bytes++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+static uint32_t crcOf(const config_record_t *record) { return crc32(record, offsetof(config_record_t, crc)); }
+
+// Slot holding the newest record older than limit, by its header alone, or -1
+static int newestBelow(uint32_t limit)
+{
+    int newest = -1;
+
+    for (int i = 0; i < CONFIG_SLOTS; i++)
+    {
+        if (slots[i].magic == CONFIG_MAGIC && slots[i].sequence < limit &&
+            (newest < 0 || slots[i].sequence > slots[newest].sequence))
+        {
+            newest = i;
+        }
+    }
+    return newest;
+}
+
+static bool isErased(uint32_t slot)
+{
+    const uint32_t *words = (const uint32_t *)&slots[slot];
+
+    for (int i = 0; i < CONFIG_RECORD_SIZE / 4; i++)
+    {
+        if (words[i] != 0xFFFFFFFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+const config_t *configLoad(void)
+{
+    uint32_t start = bootNow();
+
+    config = defaults;
+
+    int newest = newestBelow(UINT32_MAX);
+    if (newest >= 0)
+    {
+        nextSequence = slots[newest].sequence + 1;
+        writeSlot = (newest + 1) % CONFIG_SLOTS;
+    }
+
+    // Normally the newest record is intact; a torn write falls back to the one before
+    for (int i = newest; i >= 0; i = newestBelow(slots[i].sequence))
+    {
+        const config_record_t *record = &slots[i];
+        // Another version laid the fields out differently
+        if (record->crc != crcOf(record) || record->version != CONFIG_VERSION)
+        {
+            continue;
+        }
+
+        if (record->fields >= CONFIG_FIELD_COUNT)
+        {
+            config = record->config;
+        }
+        else
+        {
+            // Written before the later fields existed
+            memcpy(&config, &record->config, record->fields * sizeof(int32_t));
+        }
+        stats.sequence = record->sequence;
+        break;
+    }
+
+    // Another version may have had other limits
+    for (int field = 0; field < CONFIG_FIELD_COUNT; field++)
+    {
+        int32_t value = *fieldOf(&config, field);
+        if (value < fields[field].min || value > fields[field].max)
+        {
+            *fieldOf(&config, field) = *fieldOf((config_t *)&defaults, field);
+        }
+    }
+
+    stats.loadCycles = bootNow() - start;
+    return &config;
+}
+
+static void applyField(config_field_t field)
+{
+    switch (field)
+    {
+    case CONFIG_CONSOLE_BAUD:
+        uartSetBaudRate(UART_PORT0, config.consoleBaud);
+        break;
+
+    case CONFIG_LINK_BAUD:
+        uartSetBaudRate(UART_PORT1, config.linkBaud);
+        break;
+
+    case CONFIG_PWM_PROFILE:
+        if (motorGetPwmProfile() != &motorPwmProfiles[config.pwmProfile])
+        {
+            motorSetPwmProfile(motorPwmProfiles[config.pwmProfile].name);
+        }
+        break;
+
+    case CONFIG_DEADZONE:
+    case CONFIG_EXPO:
+    case CONFIG_TRIM:
+        motorSetStickShaping(config.deadzone, config.expo, config.trim);
+        break;
+
+    case CONFIG_SONG:
+        stateSetMary(config.song == 0);
+        break;
+
+    case CONFIG_BUS_ADDRESS:
+        uartSetAddress(UART_PORT1, config.busAddress);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void configApply(void)
+{
+    for (int field = 0; field < CONFIG_FIELD_COUNT; field++)
+    {
+        applyField(field);
+    }
+}
+
+static void requestSave(void)
+{
+    dirty = true;
+    if (configThreadId != NULL)
+    {
+        osThreadFlagsSet(configThreadId, CONFIG_FLAG_SAVE);
+    }
+}
+
+bool configSet(config_field_t field, int32_t value)
+{
+    if (field >= CONFIG_FIELD_COUNT || value < fields[field].min || value > fields[field].max)
+    {
+        return false;
+    }
+
+    *fieldOf(&config, field) = value;
+    applyField(field);
+    requestSave();
+    return true;
+}
+
+config_field_t configFind(const char *name)
+{
+    for (int field = 0; field < CONFIG_FIELD_COUNT; field++)
+    {
+        if (strcmp(fields[field].name, name) == 0)
+        {
+            return field;
+        }
+    }
+    return CONFIG_FIELD_COUNT;
+}
+
+void configReset(void)
+{
+    for (int field = 0; field < CONFIG_FIELD_COUNT; field++)
+    {
+        *fieldOf(&config, field) = *fieldOf((config_t *)&defaults, field);
+    }
+    configApply();
+    requestSave();
+}
+
+// Either would cut the link the packet came in on, and keep it cut after a reboot
+static bool setFromConsoleOnly(config_field_t field)
+{
+    return field == CONFIG_LINK_BAUD || field == CONFIG_BUS_ADDRESS;
+}
+
+bool configHandlePacket(const packet_t *packet)
+{
+    if (packet->command != COMMAND_CONFIG)
+    {
+        return false;
+    }
+
+    config_field_t field = packet->x & ~CONFIG_QUERY;
+    packet_t reply = {.x = CONFIG_REJECTED, .y = field, .command = COMMAND_CONFIG};
+
+    if (field < CONFIG_FIELD_COUNT)
+    {
+        const field_info_t *info = &fields[field];
+        int32_t value = (info->min < 0) ? (int8_t)packet->y : packet->y;
+        if ((packet->x & CONFIG_QUERY) || (!setFromConsoleOnly(field) && configSet(field, value * info->scale)))
+        {
+            reply.x = field;
+            reply.y = (uint8_t)(*fieldOf(&config, field) / info->scale);
+        }
+    }
+
+    char buffer[PACKET_SIZE];
+    serialize(buffer, &reply, PACKET_SIZE);
+    uartWrite(UART_PORT1, buffer, PACKET_SIZE);
+    return true;
+}
+
+// Appends a record of the current settings, erasing the next sector first when the writes have reached it
+static void save(void)
+{
+    config_record_t record;
+
+    int32_t lock = osKernelLock();
+    record.config = config;
+    osKernelRestoreLock(lock);
+
+    record.magic = CONFIG_MAGIC;
+    record.version = CONFIG_VERSION;
+    record.fields = CONFIG_FIELD_COUNT;
+    record.sequence = nextSequence++;
+    record.crc = crcOf(&record);
+
+    if (!isErased(writeSlot))
+    {
+        // Never erase the sector the newest record is in, even if a slot after it was left dirty
+        if (writeSlot % CONFIG_SLOTS_PER_SECTOR != 0)
+        {
+            writeSlot = (writeSlot / CONFIG_SLOTS_PER_SECTOR + 1) * CONFIG_SLOTS_PER_SECTOR % CONFIG_SLOTS;
+        }
+        if (!isErased(writeSlot))
+        {
+            // An erase masks interrupts for 14ms or more
+            osThreadFlagsClear(CONFIG_FLAG_MOVING);
+            while (stateMoving())
+            {
+                osThreadFlagsWait(CONFIG_FLAG_MOVING, osFlagsWaitAny, osWaitForever);
+            }
+            if (flashEraseSector(FLASH_CONFIG_START + writeSlot * CONFIG_RECORD_SIZE) != FLASH_OK)
+            {
+                stats.errors++;
+                return;
+            }
+            stats.erases++;
+        }
+    }
+
+    // The first longword holds the magic, so a torn write still occupies its slot
+    uint32_t slot = writeSlot;
+    uint32_t address = FLASH_CONFIG_START + slot * CONFIG_RECORD_SIZE;
+    const uint32_t *words = (const uint32_t *)&record;
+    writeSlot = (slot + 1) % CONFIG_SLOTS;
+    for (int i = 0; i < CONFIG_RECORD_SIZE / 4; i++)
+    {
+        if (flashProgramLongword(address + i * 4, words[i]) != FLASH_OK)
+        {
+            break;
+        }
+    }
+
+    if (memcmp(&slots[slot], &record, sizeof(record)) != 0)
+    {
+        stats.errors++;
+        return;
+    }
+    stats.saves++;
+    stats.sequence = record.sequence;
+}
+
+static void config_thread(void *argument)
+{
+    for (;;)
+    {
+        osThreadFlagsWait(CONFIG_FLAG_SAVE, osFlagsWaitAny, osWaitForever);
+        // Changes arriving meanwhile go into the same record
+        while (!(osThreadFlagsWait(CONFIG_FLAG_SAVE, osFlagsWaitAny, CONFIG_SAVE_DELAY_MS) & osFlagsError))
+            ;
+        dirty = false;
+        save();
+    }
+}
+
+void configPrint(void (*print)(const char *str))
+{
+    char line[96];
+
+    for (int field = 0; field < CONFIG_FIELD_COUNT; field++)
+    {
+        sprintf(line, "%-13s %ld\r\n", fields[field].name, (long)*fieldOf(&config, field));
+        print(line);
+    }
+
+    config_stats_t copy = stats;
+    sprintf(line, "record %lu%s, %lu saves, %lu erases, %lu errors, loaded in %lu us\r\n",
+            (unsigned long)copy.sequence, dirty ? " (unsaved changes)" : "", (unsigned long)copy.saves,
+            (unsigned long)copy.erases, (unsigned long)copy.errors,
+            (unsigned long)(copy.loadCycles / (SystemCoreClock / 1000000)));
+    print(line);
+}
+
+static void movingChanged(uint32_t changed, void *arg) { osThreadFlagsSet(configThreadId, CONFIG_FLAG_MOVING); }
+
+void initConfigRTOS(void)
+{
+    // Below the real-time threads, as the flash writes mask interrupts
+    const osThreadAttr_t attributes = {.name = "config", .priority = osPriorityBelowNormal};
+    configThreadId = osThreadNew(config_thread, NULL, &attributes);
+    stateSubscribe(STATE_CHANGED(MOVING), movingChanged, NULL);
+
+    // Changed before the thread existed
+    if (dirty)
+    {
+        osThreadFlagsSet(configThreadId, CONFIG_FLAG_SAVE);
+    }
+}
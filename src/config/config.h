@@ -0,0 +1,156 @@
+/**
+ * @file config.h
+ * @brief Runtime settings kept in flash and applied live.
+ *
+ * CONFIG_FIELDS lists the settings as X(ID, member, name, default, min, max,
+ * scale). Each is an int32_t in config_t; a few spare words are kept so fields
+ * can be added without changing the record size.
+ *
+ * The store is the two sectors at FLASH_CONFIG_START. Each save appends a
+ * CONFIG_RECORD_SIZE record: a header with CONFIG_MAGIC, the CONFIG_VERSION
+ * and field count of the image that wrote it, and a sequence number, then the
+ * config_t exactly as it is in RAM, then a CRC-32 of all of it. Records fill
+ * one sector and then the other, which is only erased when the writes reach
+ * it. Each sector is erased once every 2 * CONFIG_SLOTS_PER_SECTOR saves.
+ * The newest record always stays in the sector that is not being erased.
+ *
+ * configLoad() reads the flash in place: one pass over the record headers
+ * finds the highest sequence number, and its CRC is checked. If a write was
+ * torn, it falls back to the next one. The config_t is then copied out with
+ * a plain structure assignment. A record from an image with fewer fields
+ * fills the fields it has and leaves the rest at their defaults. Fields are
+ * only ever added at the end; any other change to the layout must bump
+ * CONFIG_VERSION, and records with another version are skipped.
+ *
+ * configSet() validates a value, applies it straight away (baud rates, PWM
+ * profile, stick shaping, song, bus address) and wakes config_thread. That
+ * thread saves once no change has come in for CONFIG_SAVE_DELAY_MS, so a burst
+ * of tuning costs one record. An erase masks interrupts for 14ms or more, so
+ * it waits until STATE_MOVING clears. Settings are changed with "set <name>
+ * <value>" on the console, or with COMMAND_CONFIG on UART1:
+ *
+ *   x: field ID; | CONFIG_QUERY to read it without changing it
+ *   y: value / scale, as a signed byte for fields that can be negative
+ *
+ * The KL25Z answers with the field ID and the value now in force. If the
+ * field or value was rejected, it answers x = CONFIG_REJECTED, y = field ID.
+ * link-baud and address can be read this way but only set from the console:
+ * the answer would already go out at the new rate or address, and one bad
+ * packet would cut the link for good once it was saved.
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+#include "flash/flash.h"
+#include "motors/motor_driver.h"
+#include "packet/packet.h"
+#include "uart/uart.h"
+
+#define CONFIG_DEFAULT_BAUD 9600
+
+#define CONFIG_FIELDS(X)                                                                                               \
+    X(CONSOLE_BAUD, consoleBaud, "console-baud", CONFIG_DEFAULT_BAUD, 1200, 115200, 1200)                              \
+    X(LINK_BAUD, linkBaud, "link-baud", CONFIG_DEFAULT_BAUD, 1200, 115200, 1200)                                       \
+    X(PWM_PROFILE, pwmProfile, "pwm", MOTOR_PWM_PROFILE, 0, MOTOR_PWM_PROFILE_COUNT - 1, 1)                            \
+    X(DEADZONE, deadzone, "deadzone", 0, 0, MOTOR_DEADZONE_MAX, 1)                                                     \
+    X(EXPO, expo, "expo", 0, 0, 100, 1)                                                                                \
+    X(TRIM, trim, "trim", 0, -MOTOR_TRIM_MAX, MOTOR_TRIM_MAX, 1)                                                       \
+    X(SONG, song, "song", 0, 0, 1, 1) /* 0: Mary Had a Little Lamb, 1: Happy Birthday */                              \
+    X(BUS_ADDRESS, busAddress, "address", 0, 0, UART_ADDRESS_MAX, 1) /* UART1 multidrop address, 0: point-to-point */
+
+#define CONFIG_VERSION 1
+#define CONFIG_MAGIC 0xC0F6
+#define CONFIG_WORDS 13 // fields and spares
+#define CONFIG_RECORD_SIZE 64
+#define CONFIG_SLOTS_PER_SECTOR (FLASH_SECTOR_SIZE / CONFIG_RECORD_SIZE)
+#define CONFIG_SLOTS (FLASH_CONFIG_SIZE / CONFIG_RECORD_SIZE)
+#define CONFIG_SAVE_DELAY_MS 500
+
+#define CONFIG_QUERY 0x80
+#define CONFIG_REJECTED 0xFF
+
+#define CONFIG_ID(ID, member, name, def, min, max, scale) CONFIG_##ID,
+typedef enum
+{
+    CONFIG_FIELDS(CONFIG_ID) CONFIG_FIELD_COUNT
+} config_field_t;
+#undef CONFIG_ID
+
+#define CONFIG_MEMBER(ID, member, name, def, min, max, scale) int32_t member;
+typedef struct config_t
+{
+    CONFIG_FIELDS(CONFIG_MEMBER)
+    int32_t spare[CONFIG_WORDS - CONFIG_FIELD_COUNT];
+} config_t;
+#undef CONFIG_MEMBER
+
+typedef struct config_record_t
+{
+    uint16_t magic;    // CONFIG_MAGIC; erased flash reads 0xFFFF
+    uint8_t version;   // CONFIG_VERSION of the image that wrote it
+    uint8_t fields;    // CONFIG_FIELD_COUNT of that image
+    uint32_t sequence; // higher is newer
+    config_t config;
+    uint32_t crc; // CRC-32 of everything before it
+} config_record_t;
+
+typedef struct config_stats_t
+{
+    uint32_t sequence; // of the record in force, 0 for the defaults
+    uint32_t saves;
+    uint32_t erases;
+    uint32_t errors; // flash commands that failed, or records that did not read back
+    uint32_t loadCycles;
+} config_stats_t;
+
+/**
+ * @brief Reads the newest valid record from flash, or the defaults. Call once at boot, before the UARTs.
+ */
+const config_t *configLoad(void);
+
+/**
+ * @brief Applies every setting to the modules. Call once they are initialised.
+ */
+void configApply(void);
+
+/**
+ * @brief Sets, applies and schedules saving of one field. Returns false if value is out of range.
+ *
+ * Switching PWM profile waits for a switch in progress, so call it from a thread.
+ */
+bool configSet(config_field_t field, int32_t value);
+
+/**
+ * @brief Looks up a field by its console name. Returns CONFIG_FIELD_COUNT if there is none.
+ */
+config_field_t configFind(const char *name);
+
+/**
+ * @brief Restores and saves the defaults.
+ */
+void configReset(void);
+
+/**
+ * @brief Handles a COMMAND_CONFIG packet and answers it on UART1. Returns false for any other packet.
+ *
+ * Called from receive_packet_thread.
+ */
+bool configHandlePacket(const packet_t *packet);
+
+/**
+ * @brief Prints the settings and the store's state through print.
+ */
+void configPrint(void (*print)(const char *str));
+
+/**
+ * @brief Starts config_thread, which saves changes to flash.
+ */
+void initConfigRTOS(void);
+
+#endif
@@ -0,0 +1,283 @@
+#include "console/console.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bam/bam.h"
+#include "battery/battery.h"
+#include "boot/boot.h"
+#include "config/config.h"
+#include "health/health.h"
+#include "motors/motor_driver.h"
+#include "ping/ping.h"
+#include "pinmap/pinmap.h"
+#include "recorder/recorder.h"
+#include "timer/timer.h"
+#include "trace/trace.h"
+#include "uart/uart.h"
+
+static osSemaphoreId_t consoleSemaphore;
+
+void consolePrint(const char *str) { uartWrite(UART_PORT0, str, strlen(str)); }
+
+static void handleCommand(const char *line)
+{
+    if (strcmp(line, "trace") == 0)
+    {
+#if TRACE_ENABLED
+        traceDump(consolePrint);
+#else
+        consolePrint("trace disabled, rebuild with TRACE_ENABLED=1\r\n");
+#endif
+    }
+    else if (strcmp(line, "stats") == 0)
+    {
+        uartPrintStats(consolePrint);
+    }
+    else if (strcmp(line, "stats clear") == 0)
+    {
+        for (int port = 0; port < UART_PORT_COUNT; port++)
+        {
+            uartClearStats((uart_port_t)port);
+        }
+    }
+    else if (strcmp(line, "rec") == 0)
+    {
+        recorderPrintStats(consolePrint);
+    }
+    else if (strcmp(line, "rec start") == 0)
+    {
+        consolePrint(recorderStartRecording() ? "recording\r\n" : "recorder busy or robot moving\r\n");
+    }
+    else if (strcmp(line, "rec stop") == 0)
+    {
+        recorderStopRecording();
+    }
+    else if (strcmp(line, "replay") == 0)
+    {
+        consolePrint(recorderStartReplay() ? "replaying\r\n" : "recorder busy or empty\r\n");
+    }
+    else if (strcmp(line, "replay stop") == 0)
+    {
+        recorderStopReplay();
+    }
+    else if (strcmp(line, "ping") == 0)
+    {
+        pingPrintStats(consolePrint);
+    }
+    else if (strcmp(line, "ping clear") == 0)
+    {
+        pingClearStats();
+    }
+    else if (strcmp(line, "age") == 0)
+    {
+        motorPrintStats(consolePrint);
+    }
+    else if (strcmp(line, "age clear") == 0)
+    {
+        motorClearStats();
+    }
+    else if (strncmp(line, "age ", 4) == 0)
+    {
+        // age <ms>: new budget, 0 to apply commands however old they are
+        char *end;
+        unsigned long ms = strtoul(line + 4, &end, 10);
+        if (end == line + 4 || *end != '\0' || ms > MOTOR_AGE_BUDGET_MAX_MS)
+        {
+            consolePrint("usage: age [clear|<ms>], <ms> up to 10000\r\n");
+        }
+        else
+        {
+            motorSetAgeBudget(ms);
+        }
+    }
+    else if (strcmp(line, "pwm") == 0)
+    {
+        motorPrintPwmStats(consolePrint);
+    }
+    else if (strcmp(line, "pwm clear") == 0)
+    {
+        motorClearPwmStats();
+    }
+    else if (strncmp(line, "pwm ", 4) == 0)
+    {
+        if (!motorSetPwmProfile(line + 4))
+        {
+            consolePrint("profiles:");
+            for (int i = 0; i < MOTOR_PWM_PROFILE_COUNT; i++)
+            {
+                consolePrint(" ");
+                consolePrint(motorPwmProfiles[i].name);
+            }
+            consolePrint("\r\n");
+        }
+    }
+    else if (strcmp(line, "bam") == 0)
+    {
+        bamPrintStats(consolePrint);
+    }
+    else if (strcmp(line, "bam clear") == 0)
+    {
+        bamClearStats();
+    }
+    else if (strcmp(line, "battery") == 0)
+    {
+        batteryPrintStats(consolePrint);
+    }
+    else if (strcmp(line, "battery on") == 0)
+    {
+        batterySetCompensationEnabled(true);
+    }
+    else if (strcmp(line, "battery off") == 0)
+    {
+        batterySetCompensationEnabled(false);
+    }
+    else if (strcmp(line, "speed") == 0)
+    {
+        motorPrintSpeedStats(consolePrint);
+    }
+    else if (strcmp(line, "speed on") == 0)
+    {
+        motorSetSpeedControl(true);
+    }
+    else if (strcmp(line, "speed off") == 0)
+    {
+        motorSetSpeedControl(false);
+    }
+    else if (strcmp(line, "speed clear") == 0)
+    {
+        motorClearSpeedStats();
+    }
+    else if (strcmp(line, "fast") == 0)
+    {
+        motorPrintLatency(consolePrint);
+    }
+    else if (strcmp(line, "fast on") == 0)
+    {
+        motorSetFastPath(true);
+    }
+    else if (strcmp(line, "fast off") == 0)
+    {
+        motorSetFastPath(false);
+    }
+    else if (strcmp(line, "fast clear") == 0)
+    {
+        motorClearLatency();
+    }
+    else if (strcmp(line, "health") == 0)
+    {
+        healthPrintStats(consolePrint);
+    }
+    else if (strcmp(line, "health clear") == 0)
+    {
+        healthClearStats();
+    }
+    else if (strcmp(line, "boot") == 0)
+    {
+        bootPrint(consolePrint);
+    }
+    else if (strcmp(line, "config") == 0)
+    {
+        configPrint(consolePrint);
+    }
+    else if (strcmp(line, "config defaults") == 0)
+    {
+        configReset();
+    }
+    else if (strncmp(line, "set ", 4) == 0)
+    {
+        char name[16] = {0};
+        const char *value = strchr(line + 4, ' ');
+        size_t length = (value != NULL) ? (size_t)(value - (line + 4)) : 0;
+        if (length > 0 && length < sizeof(name))
+        {
+            memcpy(name, line + 4, length);
+        }
+
+        config_field_t field = configFind(name);
+        if (value == NULL || field == CONFIG_FIELD_COUNT || !configSet(field, strtol(value + 1, NULL, 10)))
+        {
+            consolePrint("usage: set <field> <value>, see config\r\n");
+        }
+    }
+    else if (strcmp(line, "pins") == 0)
+    {
+        pinmapPrint(consolePrint);
+    }
+    else if (strcmp(line, "timer") == 0)
+    {
+        timerPrintStats(consolePrint);
+    }
+    else if (strcmp(line, "timer clear") == 0)
+    {
+        timerClearStats();
+    }
+    else if (strcmp(line, "timer bench") == 0)
+    {
+        timerBenchmark(consolePrint);
+    }
+    else if (strcmp(line, "interp") == 0)
+    {
+        static const char *const modes[] = {"step", "linear", "predict"};
+        consolePrint("interp ");
+        consolePrint(modes[motorGetInterpMode()]);
+        consolePrint("\r\n");
+    }
+    else if (strcmp(line, "interp step") == 0)
+    {
+        motorSetInterpMode(INTERP_STEP);
+    }
+    else if (strcmp(line, "interp linear") == 0)
+    {
+        motorSetInterpMode(INTERP_LINEAR);
+    }
+    else if (strcmp(line, "interp predict") == 0)
+    {
+        motorSetInterpMode(INTERP_EXTRAPOLATE);
+    }
+    else if (line[0] != '\0')
+    {
+        consolePrint("commands: trace, stats [clear], rec [start|stop], replay [stop], ping [clear], age [clear|<ms>],\r\n"
+                     "          interp [step|linear|predict], pwm [clear|<profile>], timer [clear|bench],\r\n"
+                     "          bam [clear], battery [on|off], speed [on|off|clear], pins, boot,\r\n"
+                     "          config [defaults], set <field> <value>, fast [on|off|clear],\r\n"
+                     "          health [clear]\r\n");
+    }
+}
+
+void console_thread(void *argument)
+{
+    char line[CONSOLE_LINE_SIZE];
+    int length = 0;
+
+    for (;;)
+    {
+        osSemaphoreAcquire(consoleSemaphore, osWaitForever);
+
+        char c;
+        while (uartRead(UART_PORT0, &c, 1, NULL) == 1)
+        {
+            if (c == '\r' || c == '\n')
+            {
+                line[length] = '\0';
+                consolePrint("\r\n");
+                handleCommand(line);
+                length = 0;
+            }
+            else if (length < CONSOLE_LINE_SIZE - 1)
+            {
+                char echo[2] = {c, '\0'};
+                consolePrint(echo);
+                line[length++] = c;
+            }
+        }
+    }
+}
+
+void initConsoleRTOS(void)
+{
+    // Semaphore is released by the UART0 ISR for every received character
+    consoleSemaphore = osSemaphoreNew(Q_SIZE, 0, NULL);
+    uartSetReceiveSemaphore(UART_PORT0, consoleSemaphore, 1);
+    osThreadNew(console_thread, NULL, NULL);
+}
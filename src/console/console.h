@@ -0,0 +1,26 @@
+/**
+ * @file console.h
+ * @brief Line-based debug console on UART0.
+ *
+ * Characters are echoed back and a command is run once carriage return or
+ * newline is received. Type an unknown command to list the available ones.
+ */
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+
+#define CONSOLE_LINE_SIZE 32
+
+/**
+ * @brief Writes a string to the console. Blocks while the transmit ring is full.
+ */
+void consolePrint(const char *str);
+
+void console_thread(void *argument);
+
+void initConsoleRTOS(void);
+
+#endif
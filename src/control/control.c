@@ -0,0 +1,90 @@
+#include "control/control.h"
+
+void speedInit(speed_est_t *est, uint32_t freq, uint32_t timeout)
+{
+    est->edges = 0;
+    est->stamp = 0;
+    est->speed = 0;
+    est->freq = freq;
+    est->timeout = timeout;
+    est->moving = false;
+    est->fresh = false;
+}
+
+uint32_t speedUpdate(speed_est_t *est, uint32_t edges, uint32_t stamp, uint32_t now)
+{
+    uint32_t scaled = est->freq << CONTROL_SPEED_SHIFT;
+
+    if (edges != est->edges)
+    {
+        uint32_t count = edges - est->edges;
+        uint32_t elapsed = stamp - est->stamp;
+        // The first edge after a stop has no start to measure from; it becomes the start
+        if (est->moving && elapsed > 0)
+        {
+            est->speed = scaled / elapsed * count;
+        }
+        est->fresh = est->moving;
+        est->edges = edges;
+        est->stamp = stamp;
+        est->moving = true;
+        return est->speed;
+    }
+
+    // Without new edges the speed is only known to be below one pulse over the quiet time
+    uint32_t quiet = now - est->stamp;
+    est->fresh = false;
+    if (quiet > est->timeout)
+    {
+        est->moving = false;
+        est->speed = 0;
+        est->fresh = true;
+    }
+    else if (est->moving && quiet > 0 && scaled / quiet < est->speed)
+    {
+        // Slowing down: the next edge is later than the last interval predicts
+        est->speed = scaled / quiet;
+        est->fresh = true;
+    }
+    return est->speed;
+}
+
+void piInit(pi_t *pi, int32_t kp, int32_t ki, int32_t low, int32_t high)
+{
+    pi->kp = kp;
+    pi->ki = ki;
+    pi->low = low;
+    pi->high = high;
+    piReset(pi);
+}
+
+void piReset(pi_t *pi) { pi->integral = 0; }
+
+int32_t piStep(pi_t *pi, int32_t setpoint, int32_t measured, int32_t feedForward, bool integrate)
+{
+    int32_t error = setpoint - measured;
+    int32_t integral = integrate ? pi->integral + pi->ki * error : pi->integral;
+    int32_t output = feedForward + ((pi->kp * error + integral) >> CONTROL_GAIN_SHIFT);
+
+    // Keep the previous integral when it would only push further into saturation
+    if (output > pi->high)
+    {
+        output = pi->high;
+        if (error > 0)
+        {
+            integral = pi->integral;
+        }
+    }
+    else if (output < pi->low)
+    {
+        output = pi->low;
+        if (error < 0)
+        {
+            integral = pi->integral;
+        }
+    }
+    // The correction never needs more than half the range, and a stalled wheel must not wind it up further
+    int32_t bound = (pi->high - pi->low) << (CONTROL_GAIN_SHIFT - 1);
+    pi->integral = (integral > bound) ? bound : (integral < -bound) ? -bound : integral;
+    return output;
+}
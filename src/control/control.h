@@ -0,0 +1,79 @@
+/**
+ * @file control.h
+ * @brief Wheel speed measured from encoder edges, and the PI loop that holds it.
+ *
+ * speedUpdate() takes the running edge count of one encoder and the time of
+ * its latest edge, and returns pulses per second in Q28.4. When edges arrived
+ * since the last call, the speed is their number over the time between the
+ * first and last of them, which is exact however few pulses a control period
+ * spans. When none did, it can only be lower than one pulse over the time since
+ * the last edge, so it is capped at that and drops to zero after the stall
+ * timeout.
+ *
+ * piStep() runs a proportional-integral controller on top of a feed-forward
+ * term, the open-loop output for the setpoint, so the loop only has to correct
+ * the difference load and battery make. Gains are Q16.16 output units per
+ * Q28.4 pulse per second. The integral only accumulates on a real measurement
+ * (speed_est_t.fresh), not on a speed held over from an earlier edge, stops
+ * while the output is saturated in the direction of the error, and is capped
+ * at half the output range.
+ *
+ * Nothing here divides by 64 bits or touches hardware, so both run in the TPM1
+ * overflow interrupt and in tools/motor_sim.c on the host.
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CONTROL_SPEED_SHIFT 4 // speeds are pulses per second in Q28.4
+#define CONTROL_GAIN_SHIFT 16 // gains are Q16.16
+
+// Tuning for the robot's geared motors with 20-slot encoder discs, checked with tools/motor_sim.c
+#define CONTROL_HZ 100
+#define CONTROL_FULL_PPS 70  // pulses per second at full duty from the nominal battery, unloaded
+#define CONTROL_STALL_MS 200 // no edge for this long reads as stopped, so below 5 pulses per second
+#define CONTROL_KP 4096      // 1 speed step per pulse per second of error
+#define CONTROL_KI 4096      // 1 speed step per pulse per second of error per measured period
+
+typedef struct speed_est_t
+{
+    uint32_t edges;   // edge count at the last edge used
+    uint32_t stamp;   // time of that edge, clock cycles
+    uint32_t speed;   // pulses per second, Q28.4
+    uint32_t freq;    // clock cycles per second, at most 268MHz
+    uint32_t timeout; // clock cycles without an edge after which the wheel counts as stopped
+    bool moving;      // stamp is the end of a run of edges, not the first edge after a stop
+    bool fresh;       // the last update measured new edges rather than bounding or holding the speed
+} speed_est_t;
+
+typedef struct pi_t
+{
+    int32_t kp, ki;    // Q16.16
+    int32_t integral;  // Q16.16 output units
+    int32_t low, high; // output bounds
+} pi_t;
+
+void speedInit(speed_est_t *est, uint32_t freq, uint32_t timeout);
+
+/**
+ * @brief Returns the speed given the running edge count and the time of the last edge, both read at now.
+ */
+uint32_t speedUpdate(speed_est_t *est, uint32_t edges, uint32_t stamp, uint32_t now);
+
+void piInit(pi_t *pi, int32_t kp, int32_t ki, int32_t low, int32_t high);
+
+/**
+ * @brief Clears the integral, for a new setpoint direction or a stop.
+ */
+void piReset(pi_t *pi);
+
+/**
+ * @brief Advances by one control period and returns the output, feedForward plus the PI correction, within the bounds.
+ *
+ * integrate is false when measured carries no new information, so the integral holds.
+ */
+int32_t piStep(pi_t *pi, int32_t setpoint, int32_t measured, int32_t feedForward, bool integrate);
+
+#endif
@@ -0,0 +1,46 @@
+#include "encoder/encoder.h"
+
+#include "utils/utils.h"
+
+static const uint8_t encoderPins[ENCODER_COUNT] = {ENCODER_LEFT_PIN, ENCODER_RIGHT_PIN};
+
+static volatile uint32_t encoderEdges[ENCODER_COUNT];
+static volatile uint32_t encoderStamps[ENCODER_COUNT];
+
+void initEncoders(void)
+{
+    // initPins() configured the pins; drop any edge latched since
+    PORTA->ISFR = MASK(ENCODER_LEFT_PIN) | MASK(ENCODER_RIGHT_PIN);
+
+    NVIC_SetPriority(PORTA_IRQn, ENCODER_INT_PRIO);
+    NVIC_ClearPendingIRQ(PORTA_IRQn);
+    NVIC_EnableIRQ(PORTA_IRQn);
+}
+
+void PORTA_IRQHandler(void)
+{
+    uint32_t now = osKernelGetSysTimerCount();
+    uint32_t flags = PORTA->ISFR;
+
+    // Clear only the flags read, so an edge in between interrupts again
+    PORTA->ISFR = flags;
+    NVIC_ClearPendingIRQ(PORTA_IRQn);
+
+    for (int side = 0; side < ENCODER_COUNT; side++)
+    {
+        if (flags & MASK(encoderPins[side]))
+        {
+            encoderEdges[side]++;
+            encoderStamps[side] = now;
+        }
+    }
+}
+
+void encoderRead(encoder_side_t side, uint32_t *edges, uint32_t *stamp)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    *edges = encoderEdges[side];
+    *stamp = encoderStamps[side];
+    __set_PRIMASK(primask);
+}
@@ -0,0 +1,48 @@
+/**
+ * @file encoder.h
+ * @brief Wheel encoder edges counted and timestamped on PORTA pin interrupts.
+ *
+ * Each side has a slotted disc and an optical interrupter whose output reaches
+ * PTA12 (left) or PTA13 (right). TPM1 and TPM2 drive the motors and the music
+ * retunes TPM0's period, so no TPM is left with a fixed period to capture
+ * against. Instead PORTA_IRQHandler counts the rising edges and stamps the
+ * latest with osKernelGetSysTimerCount(), a free-running 48MHz count, which
+ * gives the same resolution as an input capture at the core clock. It runs at
+ * the highest priority so the stamp is taken within a few cycles of the edge.
+ *
+ * The encoders have one channel, so they give speed but not direction; the
+ * speed control in motor_driver.c takes the direction from the setpoint.
+ */
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+
+#include "pinmap/pinmap.h"
+
+#define ENCODER_LEFT_PIN PIN_ENCODER_LEFT   // PortA 12
+#define ENCODER_RIGHT_PIN PIN_ENCODER_RIGHT // PortA 13
+#define ENCODER_INT_PRIO 0
+
+typedef enum
+{
+    ENCODER_LEFT,
+    ENCODER_RIGHT,
+    ENCODER_COUNT
+} encoder_side_t;
+
+/**
+ * @brief Enables the PORTA interrupt for the encoder edges. Call after initPins().
+ */
+void initEncoders(void);
+
+/**
+ * @brief Reads the running edge count of side and the SysTimer count at its latest edge, consistently.
+ */
+void encoderRead(encoder_side_t side, uint32_t *edges, uint32_t *stamp);
+
+#endif
@@ -0,0 +1,96 @@
+#include "flash/flash.h"
+
+#include "cmsis_os2.h"
+
+#define FTFA_CMD_PROGRAM_LONGWORD 0x06
+#define FTFA_CMD_ERASE_SECTOR 0x09
+
+/*
+ * Launches the command loaded in FCCOB and waits for it to complete. Lives in RAM
+ * (initialised data) because flash cannot be read while it is being modified.
+ * r0 = &FTFA->FSTAT
+ *     movs r1, #0x80      ; CCIF
+ *     strb r1, [r0]       ; write 1 to CCIF to launch the command
+ * 1:  ldrb r1, [r0]
+ *     lsls r1, r1, #24    ; CCIF into the sign bit
+ *     bpl  1b             ; wait until CCIF is set again
+ *     bx   lr
+ */
+static uint16_t flashLaunchCode[] = {0x2180, 0x7001, 0x7801, 0x0609, 0xD5FC, 0x4770};
+
+typedef void (*flash_launch_t)(volatile uint8_t *fstat);
+
+static uint32_t maxBlockedCycles = 0;
+
+static flash_result_t runCommand(void)
+{
+    flash_launch_t launch = (flash_launch_t)((uintptr_t)flashLaunchCode | 1); // Thumb bit
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t start = osKernelGetSysTimerCount();
+    launch(&FTFA->FSTAT);
+    uint32_t blocked = osKernelGetSysTimerCount() - start;
+    // Drop anything the flash controller cached from the old contents
+    MCM->PLACR |= MCM_PLACR_CFCC_MASK;
+    __set_PRIMASK(primask);
+
+    if (blocked > maxBlockedCycles)
+    {
+        maxBlockedCycles = blocked;
+    }
+
+    uint8_t status = FTFA->FSTAT;
+    if (status & FTFA_FSTAT_ACCERR_MASK)
+    {
+        return FLASH_ACCESS_ERROR;
+    }
+    if (status & FTFA_FSTAT_FPVIOL_MASK)
+    {
+        return FLASH_PROTECTION_ERROR;
+    }
+    if (status & FTFA_FSTAT_MGSTAT0_MASK)
+    {
+        return FLASH_VERIFY_ERROR;
+    }
+    return FLASH_OK;
+}
+
+static void prepareCommand(uint8_t command, uint32_t address)
+{
+    // Wait for any previous command, then clear its error flags
+    while (!(FTFA->FSTAT & FTFA_FSTAT_CCIF_MASK))
+        ;
+    FTFA->FSTAT = FTFA_FSTAT_ACCERR_MASK | FTFA_FSTAT_FPVIOL_MASK;
+
+    FTFA->FCCOB0 = command;
+    FTFA->FCCOB1 = (uint8_t)(address >> 16);
+    FTFA->FCCOB2 = (uint8_t)(address >> 8);
+    FTFA->FCCOB3 = (uint8_t)address;
+}
+
+flash_result_t flashEraseSector(uint32_t address)
+{
+    // The recorder and the config store both program flash; FCCOB holds one command at a time
+    int32_t lock = osKernelLock();
+    prepareCommand(FTFA_CMD_ERASE_SECTOR, address);
+    flash_result_t result = runCommand();
+    osKernelRestoreLock(lock);
+    return result;
+}
+
+flash_result_t flashProgramLongword(uint32_t address, uint32_t data)
+{
+    int32_t lock = osKernelLock();
+    prepareCommand(FTFA_CMD_PROGRAM_LONGWORD, address);
+    // FCCOB4 holds the most significant byte; the longword is stored little-endian
+    FTFA->FCCOB4 = (uint8_t)(data >> 24);
+    FTFA->FCCOB5 = (uint8_t)(data >> 16);
+    FTFA->FCCOB6 = (uint8_t)(data >> 8);
+    FTFA->FCCOB7 = (uint8_t)data;
+    flash_result_t result = runCommand();
+    osKernelRestoreLock(lock);
+    return result;
+}
+
+uint32_t flashMaxBlockedCycles(void) { return maxBlockedCycles; }
@@ -0,0 +1,57 @@
+/**
+ * @file flash.h
+ * @brief Erase and program routines for the KL25Z flash memory module (FTFA).
+ *
+ * The KL25Z has a single flash block, so the CPU cannot fetch code or vectors
+ * from flash while a command runs. The routine that launches a command and waits
+ * for it therefore runs from RAM, and interrupts are masked for the duration of
+ * each command. One longword program masks interrupts for about 65us (145us max),
+ * one sector erase for about 14ms (114ms max), so callers should program in small
+ * batches from a low priority thread and only erase when timing does not matter.
+ *
+ * The top 16KB of flash are kept out of the linker's IROM1 region in the project
+ * options and reserved for data, see the FLASH_*_START definitions below.
+ * Commands hold the scheduler lock, so threads sharing the module do not
+ * interleave their FCCOB writes.
+ */
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+
+#define FLASH_SECTOR_SIZE 1024
+
+// Reserved data regions; everything below FLASH_DATA_START is available to the linker
+#define FLASH_DATA_START 0x1C000
+#define FLASH_RECORDER_START 0x1C000
+#define FLASH_RECORDER_SIZE 0x3800 // 14 sectors
+#define FLASH_CONFIG_START 0x1F800
+#define FLASH_CONFIG_SIZE 0x800 // 2 sectors
+
+typedef enum
+{
+    FLASH_OK = 0,
+    FLASH_ACCESS_ERROR = 1,     // ACCERR: bad address or alignment
+    FLASH_PROTECTION_ERROR = 2, // FPVIOL: region is write-protected
+    FLASH_VERIFY_ERROR = 3      // MGSTAT0: the command completed but failed
+} flash_result_t;
+
+/**
+ * @brief Erases the 1KB sector containing address.
+ */
+flash_result_t flashEraseSector(uint32_t address);
+
+/**
+ * @brief Programs one 4-byte aligned longword. The location must be erased.
+ */
+flash_result_t flashProgramLongword(uint32_t address, uint32_t data);
+
+/**
+ * @brief Longest time interrupts were masked by a flash command, in system timer cycles.
+ */
+uint32_t flashMaxBlockedCycles(void);
+
+#endif
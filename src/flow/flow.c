@@ -0,0 +1,33 @@
+#include "flow/flow.h"
+
+void flowInit(flow_t *flow)
+{
+    flow->started = false;
+    flow->limit = 0;
+    flow->lastMs = 0;
+    flow->credits = 0;
+}
+
+bool flowUpdate(flow_t *flow, uint32_t received, uint32_t space, uint32_t nowMs, packet_t *credit)
+{
+    uint32_t limit = received + space;
+
+    // The limit only moves forward, as bytes are read out of the ring or dropped
+    bool due = !flow->started || limit - flow->limit >= FLOW_BATCH_BYTES || nowMs - flow->lastMs >= FLOW_REFRESH_MS;
+    if (!due)
+    {
+        return false;
+    }
+
+    flow->started = true;
+    flow->limit = limit;
+    flow->lastMs = nowMs;
+    flow->credits++;
+
+    credit->x = (unsigned char)received;
+    credit->y = (unsigned char)space;
+    credit->command = COMMAND_CREDIT;
+    return true;
+}
+
+void flowResend(flow_t *flow) { flow->started = false; }
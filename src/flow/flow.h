@@ -0,0 +1,61 @@
+/**
+ * @file flow.h
+ * @brief Credit-based flow control of the ESP32 -> KL25Z packet stream.
+ *
+ * The KL25Z tells the ESP32 how many more bytes its UART1 receive ring can take
+ * with COMMAND_CREDIT packets on UART1 TX:
+ *
+ *   x: low byte of the number of bytes received so far
+ *   y: free space in the receive ring, in bytes, at that point
+ *
+ * The ESP32 counts the bytes it has sent in the same way, so the bytes still in
+ * flight are (sent - x) modulo 256 and it may send y minus that. Because every
+ * credit is absolute, a lost or corrupted credit packet is repaired by the next
+ * one. If bytes are lost on the wire the two counts drift apart; the ESP32
+ * realigns its count with x whenever it has been quiet long enough for nothing
+ * to be in flight. Without credits, the ESP32 behaves as before.
+ *
+ * Credits are sent once FLOW_BATCH_BYTES of space has been freed since the last
+ * one, and at least every FLOW_REFRESH_MS so a stalled sender always recovers.
+ * The ESP32 coalesces joystick updates while it has no credit, keeping only the
+ * newest, so the ring never overflows and the robot acts on the latest input.
+ * A credit that could not be queued for sending is handed back with
+ * flowResend(), and the next flowUpdate() produces a fresh one.
+ *
+ * The policy has no hardware dependencies so tools/uart_stress.c can run it.
+ */
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "packet/packet.h"
+
+#define FLOW_BATCH_BYTES (2 * PACKET_SIZE)
+#define FLOW_REFRESH_MS 100
+
+typedef struct flow_t
+{
+    bool started;
+    uint32_t limit; // received + space at the last credit: bytes the sender may have sent in total
+    uint32_t lastMs;
+    uint32_t credits; // credit packets produced
+} flow_t;
+
+void flowInit(flow_t *flow);
+
+/**
+ * @brief Decides whether a credit is due. If so, fills in credit and returns true.
+ *
+ * received and space come from the receiver (uartGetReceiveSpace() on the
+ * target), nowMs is any millisecond clock.
+ */
+bool flowUpdate(flow_t *flow, uint32_t received, uint32_t space, uint32_t nowMs, packet_t *credit);
+
+/**
+ * @brief The credit from the last flowUpdate() was not sent: makes the next call produce one.
+ */
+void flowResend(flow_t *flow);
+
+#endif
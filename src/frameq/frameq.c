@@ -0,0 +1,51 @@
+#include "frameq/frameq.h"
+
+void frameqInit(frameq_t *q)
+{
+    q->head = 0;
+    q->size = 0;
+}
+
+bool frameqPush(frameq_t *q, const packet_t *packet, uint32_t stamp)
+{
+    bool kept = true;
+
+    if (q->size == FRAMEQ_SIZE)
+    {
+        q->head = (q->head + 1) & FRAMEQ_MASK;
+        q->size--;
+        kept = false;
+    }
+
+    frame_t *slot = &q->slots[(q->head + q->size) & FRAMEQ_MASK];
+    slot->packet = *packet;
+    slot->stamp = stamp;
+    q->size++;
+    return kept;
+}
+
+bool frameqPop(frameq_t *q, frame_t *frame)
+{
+    if (q->size == 0)
+    {
+        return false;
+    }
+
+    *frame = q->slots[q->head];
+    q->head = (q->head + 1) & FRAMEQ_MASK;
+    q->size--;
+    return true;
+}
+
+int frameqDrainAll(frameq_t *q, frame_t *frames, int max)
+{
+    int count = (q->size < max) ? q->size : max;
+
+    for (int i = 0; i < count; i++)
+    {
+        frames[i] = q->slots[(q->head + i) & FRAMEQ_MASK];
+    }
+    q->head = (q->head + count) & FRAMEQ_MASK;
+    q->size -= count;
+    return count;
+}
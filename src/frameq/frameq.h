@@ -0,0 +1,60 @@
+/**
+ * @file frameq.h
+ * @brief Queue of whole decoded packets, each with its arrival stamp.
+ *
+ * The byte ring in cirq/cirq.h holds a packet stream one byte at a time, so
+ * whoever reads it has to reassemble packets and cannot drop one without
+ * knowing where it starts. Here each slot holds a packet_t and the stamp of its
+ * last byte, so readers take whole packets and a full queue drops its oldest
+ * packet to make room for the newest in O(1). The ESP32's joystick updates
+ * each supersede the last, so the newest input is the one worth keeping.
+ *
+ * The slot count is a power of 2, so indices wrap with a mask rather than the
+ * division the Cortex-M0+ does not have. One producer, typically an ISR, and
+ * one consumer; the consumer must hold the producer off while it takes frames,
+ * as a push into a full queue moves the head.
+ *
+ * Nothing here touches hardware, so the host tools under tools/ run it too.
+ */
+#ifndef FRAMEQ_H
+#define FRAMEQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "packet/packet.h"
+
+#define FRAMEQ_SIZE 8 // slots, must be a power of 2
+#define FRAMEQ_MASK (FRAMEQ_SIZE - 1)
+
+typedef struct frame_t
+{
+    packet_t packet;
+    uint32_t stamp; // arrival of the last byte, in the producer's clock
+} frame_t;
+
+typedef struct frameq_t
+{
+    frame_t slots[FRAMEQ_SIZE];
+    uint8_t head; // oldest frame
+    uint8_t size;
+} frameq_t;
+
+void frameqInit(frameq_t *q);
+
+/**
+ * @brief Appends a frame. If the queue is full the oldest frame is dropped first and false is returned.
+ */
+bool frameqPush(frameq_t *q, const packet_t *packet, uint32_t stamp);
+
+/**
+ * @brief Takes the oldest frame. Returns false if the queue is empty.
+ */
+bool frameqPop(frameq_t *q, frame_t *frame);
+
+/**
+ * @brief Takes up to max frames, oldest first, into frames. Returns the number taken.
+ */
+int frameqDrainAll(frameq_t *q, frame_t *frames, int max);
+
+#endif
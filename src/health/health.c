@@ -0,0 +1,248 @@
+#include "health/health.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "macro/macro.h"
+#include "motors/motor_driver.h"
+#include "timer/timer.h"
+#include "trace/trace.h"
+
+typedef struct health_info_t
+{
+    const char *name;
+    uint32_t deadlineMs;
+    bool critical;
+} health_info_t;
+
+#define HEALTH_INFO(ID, name, deadline, critical) [HEALTH_##ID] = {name, deadline, critical},
+static const health_info_t tasks[HEALTH_TASK_COUNT] = {HEALTH_TASKS(HEALTH_INFO)};
+
+static volatile uint32_t beats[HEALTH_TASK_COUNT]; // SysTimer stamp of the last heartbeat, 0 before the first
+
+// Only touched by health_thread, apart from the stats under the kernel lock
+static uint32_t missedBeat[HEALTH_TASK_COUNT]; // last heartbeat before the miss in progress, 0 if none
+static health_stats_t stats[HEALTH_TASK_COUNT];
+static uint32_t unhealthySince; // when a critical task first went late, 0 while none is
+static uint32_t services;
+
+static bool copEnabled;
+static volatile uint32_t reportPending; // bit per task with an ended miss to report
+static uint8_t reportOverrun[HEALTH_TASK_COUNT];
+
+static sw_timer_t beatTimer;
+
+static void serviceCop(void)
+{
+    if (copEnabled)
+    {
+        SIM_SRVCOP = 0x55;
+        SIM_SRVCOP = 0xAA;
+    }
+}
+
+void healthInit(void)
+{
+    // Write-once: ignored if the startup code has already disabled the COP
+    SIM_COPC = SIM_COPC_COPT(HEALTH_COP_TIMEOUT);
+    copEnabled = (SIM_COPC & SIM_COPC_COPT_MASK) != 0;
+    serviceCop();
+}
+
+void healthBeat(health_task_t task)
+{
+    uint32_t now = osKernelGetSysTimerCount();
+    beats[task] = (now != 0) ? now : 1;
+}
+
+bool healthReport(packet_t *packet)
+{
+    for (int task = 0; task < HEALTH_TASK_COUNT; task++)
+    {
+        uint32_t bit = 1u << task;
+        if (reportPending & bit)
+        {
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+            reportPending &= ~bit;
+            __set_PRIMASK(primask);
+
+            packet->x = task;
+            packet->y = reportOverrun[task];
+            packet->command = COMMAND_HEALTH;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void missed(health_task_t task, uint32_t beat)
+{
+    missedBeat[task] = beat;
+    TRACE(TRACE_DEADLINE_MISS, task, tasks[task].deadlineMs);
+
+    int32_t lock = osKernelLock();
+    stats[task].misses++;
+    osKernelRestoreLock(lock);
+
+    if (tasks[task].critical)
+    {
+        // Whatever is starving the drive path, the robot must not keep its last duty
+        stop();
+        macroAbort();
+    }
+}
+
+static void recovered(health_task_t task, uint32_t beat, uint32_t deadline)
+{
+    uint32_t overrun = beat - missedBeat[task] - deadline;
+    uint32_t overrunMs = overrun / (osKernelGetSysTimerFreq() / 1000);
+    missedBeat[task] = 0;
+    TRACE(TRACE_DEADLINE_RECOVER, task, (overrunMs > UINT16_MAX) ? UINT16_MAX : overrunMs);
+
+    int32_t lock = osKernelLock();
+    stats[task].overrunTotal += overrun;
+    if (overrun > stats[task].overrunMax)
+    {
+        stats[task].overrunMax = overrun;
+    }
+    osKernelRestoreLock(lock);
+
+    reportOverrun[task] = (overrunMs / 10 > 0xFF) ? 0xFF : overrunMs / 10;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    reportPending |= 1u << task;
+    __set_PRIMASK(primask);
+}
+
+static void check(void)
+{
+    uint32_t now = osKernelGetSysTimerCount();
+    uint32_t cyclesPerMs = osKernelGetSysTimerFreq() / 1000;
+    bool healthy = true;
+
+    for (int task = 0; task < HEALTH_TASK_COUNT; task++)
+    {
+        uint32_t beat = beats[task];
+        uint32_t deadline = tasks[task].deadlineMs * cyclesPerMs;
+        if (beat == 0)
+        {
+            continue;
+        }
+
+        if (missedBeat[task] == 0)
+        {
+            if (now - beat > deadline)
+            {
+                missed(task, beat);
+            }
+        }
+        else if (beat != missedBeat[task])
+        {
+            recovered(task, beat, deadline);
+        }
+
+        if (missedBeat[task] != 0 && tasks[task].critical)
+        {
+            healthy = false;
+        }
+    }
+
+    if (healthy)
+    {
+        unhealthySince = 0;
+        serviceCop();
+        services++;
+        return;
+    }
+
+    if (unhealthySince == 0)
+    {
+        unhealthySince = (now != 0) ? now : 1;
+    }
+    else if (!copEnabled && now - unhealthySince > HEALTH_COP_MS * cyclesPerMs)
+    {
+        stop();
+        macroAbort();
+        NVIC_SystemReset();
+    }
+}
+
+static void health_thread(void *argument)
+{
+    uint32_t next = osKernelGetTickCount();
+
+    for (;;)
+    {
+        next += HEALTH_PERIOD_MS;
+        osDelayUntil(next);
+        check();
+    }
+}
+
+static void timerBeat(void *arg) { healthBeat(HEALTH_TIMER); }
+
+void healthPrintStats(void (*print)(const char *str))
+{
+    char line[96];
+    health_stats_t copy[HEALTH_TASK_COUNT];
+    uint32_t serviced;
+
+    int32_t lock = osKernelLock();
+    memcpy(copy, stats, sizeof(copy));
+    serviced = services;
+    osKernelRestoreLock(lock);
+
+    uint32_t now = osKernelGetSysTimerCount();
+    uint32_t cyclesPerMs = osKernelGetSysTimerFreq() / 1000;
+    print("task     deadline   misses  overrun avg/max   last beat\r\n");
+    for (int task = 0; task < HEALTH_TASK_COUNT; task++)
+    {
+        uint32_t beat = beats[task];
+        uint32_t inProgress = (missedBeat[task] != 0);
+        uint32_t ended = (copy[task].misses > inProgress) ? copy[task].misses - inProgress : 0;
+        sprintf(line, "%-8s %5lu ms %8lu %7lu %7lu ms", tasks[task].name, (unsigned long)tasks[task].deadlineMs,
+                (unsigned long)copy[task].misses,
+                (unsigned long)(ended ? (uint32_t)(copy[task].overrunTotal / ended) / cyclesPerMs : 0),
+                (unsigned long)(copy[task].overrunMax / cyclesPerMs));
+        print(line);
+        if (beat == 0)
+        {
+            print("    not started\r\n");
+        }
+        else
+        {
+            sprintf(line, " %7lu ms ago%s\r\n", (unsigned long)((now - beat) / cyclesPerMs),
+                    (missedBeat[task] != 0) ? ", LATE" : "");
+            print(line);
+        }
+    }
+
+    if (copEnabled)
+    {
+        sprintf(line, "COP watchdog on, %u ms, serviced %lu times\r\n", HEALTH_COP_MS, (unsigned long)serviced);
+    }
+    else
+    {
+        sprintf(line, "COP watchdog disabled by the startup code; software reset after %u ms late\r\n", HEALTH_COP_MS);
+    }
+    print(line);
+}
+
+void healthClearStats(void)
+{
+    int32_t lock = osKernelLock();
+    memset(stats, 0, sizeof(stats));
+    services = 0;
+    osKernelRestoreLock(lock);
+}
+
+void initHealthRTOS(void)
+{
+    timerSetup(&beatTimer, timerBeat, NULL);
+    timerStart(&beatTimer, 0, HEALTH_TIMER_BEAT_MS * 1000);
+
+    // Above every application thread, so it still runs when they are starved
+    const osThreadAttr_t attributes = {.name = "health", .priority = osPriorityRealtime};
+    osThreadNew(health_thread, NULL, &attributes);
+}
@@ -0,0 +1,92 @@
+/**
+ * @file health.h
+ * @brief Deadline monitor for the real-time threads, and the COP watchdog it services.
+ *
+ * HEALTH_TASKS lists what is monitored as X(ID, name, deadline in ms,
+ * critical). Each task posts a heartbeat with healthBeat() at least once per
+ * deadline. receive_packet_thread beats every time it wakes, which is at
+ * least every FLOW_REFRESH_MS. motor_control_thread beats for every command,
+ * and every MOTOR_IDLE_WAIT_MS without one. A periodic software timer beats
+ * for the timer wheel. A task is only watched from its first heartbeat, so
+ * threads started late by the fast start are not reported as late meanwhile.
+ *
+ * health_thread runs at osPriorityRealtime every HEALTH_PERIOD_MS. A task
+ * whose last heartbeat is older than its deadline has missed it. The miss is
+ * counted and traced (TRACE_DEADLINE_MISS). For a critical task, the motors
+ * are also stopped and any motion program aborted on the spot, so the robot
+ * does not carry on at its last duty. Once the task beats again, its overrun
+ * is recorded and traced (TRACE_DEADLINE_RECOVER), and sent to the ESP32 in a
+ * COMMAND_HEALTH packet: x is the task, y the overrun in 10ms steps.
+ *
+ * health_thread services the COP watchdog only while no critical task is
+ * late. If one stays late for the COP timeout, HEALTH_COP_MS, the KL25Z
+ * resets, and the "boot" console command shows a watchdog reset. SIM_COPC can
+ * only be written once after reset. The Keil system_MKL25Z4.c uses that write
+ * to disable the COP unless DISABLE_WDOG is set to 0 in the RTE copy. If
+ * healthInit() finds the COP disabled, health_thread calls
+ * NVIC_SystemReset() itself after the same time, and the reset shows as a
+ * software one. Either way the motors are stopped again first.
+ *
+ * The "health" console command prints each task's deadline, misses and worst
+ * overrun, and the watchdog's state.
+ */
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+#include "packet/packet.h"
+
+#define HEALTH_TASKS(X)                                                                                                \
+    X(PACKET, "packet", 250, true) /* receive_packet_thread */                                                        \
+    X(MOTOR, "motor", 250, true)   /* motor_control_thread */                                                         \
+    X(TIMER, "timer", 250, true)   /* timer wheel, beaten by a timer every HEALTH_TIMER_BEAT_MS */
+
+#define HEALTH_PERIOD_MS 20
+#define HEALTH_TIMER_BEAT_MS 50
+#define HEALTH_COP_TIMEOUT 3 // SIM_COPC COPT: 2^10 cycles of the 1kHz LPO
+#define HEALTH_COP_MS 1024
+
+#define HEALTH_ID(ID, name, deadline, critical) HEALTH_##ID,
+typedef enum
+{
+    HEALTH_TASKS(HEALTH_ID) HEALTH_TASK_COUNT
+} health_task_t;
+#undef HEALTH_ID
+
+typedef struct health_stats_t
+{
+    uint32_t misses;
+    uint32_t overrunMax;   // SysTimer cycles past the deadline
+    uint64_t overrunTotal; // of the misses that have ended
+} health_stats_t;
+
+/**
+ * @brief Configures the COP watchdog, or finds it disabled. Call first thing in main().
+ */
+void healthInit(void);
+
+/**
+ * @brief Posts a heartbeat for task. Safe from any context.
+ */
+void healthBeat(health_task_t task);
+
+/**
+ * @brief Fills packet with a COMMAND_HEALTH report of a deadline miss that has ended, and returns true, if there is one.
+ */
+bool healthReport(packet_t *packet);
+
+void healthPrintStats(void (*print)(const char *str));
+
+void healthClearStats(void);
+
+/**
+ * @brief Starts health_thread and the timer wheel's heartbeat. Call after initTimer().
+ */
+void initHealthRTOS(void);
+
+#endif
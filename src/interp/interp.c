@@ -0,0 +1,104 @@
+#include "interp/interp.h"
+
+#include <stdbool.h>
+
+#define ONE ((int32_t)1 << INTERP_SHIFT)
+
+static int32_t clampValue(int32_t value, int32_t low, int32_t high)
+{
+    if (value < low)
+    {
+        return low;
+    }
+    if (value > high)
+    {
+        return high;
+    }
+    return value;
+}
+
+void interpInit(interp_t *interp, interp_mode_t mode, int32_t limit, uint16_t maxTicks)
+{
+    interp->mode = mode;
+    interp->limit = limit;
+    interp->maxTicks = maxTicks;
+    interpJump(interp, 0);
+}
+
+void interpJump(interp_t *interp, int32_t value)
+{
+    value = clampValue(value, -interp->limit, interp->limit);
+    interp->target = value;
+    interp->value = value * ONE;
+    interp->slope = 0;
+    interp->low = interp->high = interp->value;
+    interp->moving = 0;
+    // The next setpoint starts a new stream rather than continuing from this one
+    interp->elapsed = interp->maxTicks + 1;
+}
+
+void interpSet(interp_t *interp, int32_t target)
+{
+    target = clampValue(target, -interp->limit, interp->limit);
+
+    // A setpoint after a long gap has no meaningful predecessor to take a slope or interval from
+    bool streaming = interp->elapsed > 0 && interp->elapsed <= interp->maxTicks;
+    int32_t interval = streaming ? interp->elapsed : interp->maxTicks;
+    int32_t previous = interp->target;
+
+    interp->target = target;
+    interp->elapsed = 0;
+    interp->slope = 0;
+    interp->moving = 0;
+
+    switch (interp->mode)
+    {
+    case INTERP_LINEAR:
+    {
+        int32_t end = target * ONE;
+        interp->slope = (end - interp->value) / interval;
+        interp->moving = (uint16_t)interval;
+        interp->low = (end < interp->value) ? end : interp->value;
+        interp->high = (end < interp->value) ? interp->value : end;
+        break;
+    }
+
+    case INTERP_EXTRAPOLATE:
+        interp->value = target * ONE;
+        if (streaming && target != 0)
+        {
+            interp->slope = (target - previous) * ONE / interval;
+            interp->moving = interp->maxTicks;
+        }
+        // Up to full speed in the current direction, but not through zero
+        interp->low = (target > 0) ? 0 : -interp->limit * ONE;
+        interp->high = (target < 0) ? 0 : interp->limit * ONE;
+        break;
+
+    default:
+        interp->value = target * ONE;
+        interp->low = interp->high = interp->value;
+        break;
+    }
+}
+
+int32_t interpStep(interp_t *interp)
+{
+    if (interp->elapsed <= interp->maxTicks)
+    {
+        interp->elapsed++;
+    }
+
+    if (interp->moving > 0)
+    {
+        interp->moving--;
+        interp->value = clampValue(interp->value + interp->slope, interp->low, interp->high);
+        if (interp->moving == 0 && interp->mode == INTERP_LINEAR)
+        {
+            // Drop the remainder of the slope division
+            interp->value = interp->target * ONE;
+        }
+    }
+
+    return (interp->value + ONE / 2) >> INTERP_SHIFT;
+}
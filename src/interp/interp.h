@@ -0,0 +1,69 @@
+/**
+ * @file interp.h
+ * @brief Smooths the sparse joystick setpoints into a duty updated at a fixed rate.
+ *
+ * The ESP32 sends a drive command every 50ms, which at the 500Hz step rate is
+ * one setpoint every 25 steps. interpStep() is called at a fixed rate and
+ * moves the output towards the latest setpoint in one of three ways:
+ *
+ *   INTERP_STEP         jumps to each setpoint when it arrives, as before.
+ *   INTERP_LINEAR       ramps from the current output to the new setpoint over
+ *                       the interval measured between the last two setpoints,
+ *                       so the output lags the joystick by one interval.
+ *   INTERP_EXTRAPOLATE  jumps to the new setpoint and keeps moving along the
+ *                       slope of the last two setpoints for at most maxTicks
+ *                       steps, then holds. Never extrapolates past zero, so
+ *                       slowing down never turns into reversing.
+ *
+ * Values are signed speeds (negative is backwards) held in Q16.16 fixed
+ * point. interpSet() does the one division per setpoint so interpStep() only
+ * adds and compares and can run in the TPM overflow interrupt. The two must not
+ * run concurrently.
+ *
+ * The interpolator has no hardware dependencies.
+ */
+#ifndef INTERP_H
+#define INTERP_H
+
+#include <stdint.h>
+
+#define INTERP_SHIFT 16
+
+typedef enum
+{
+    INTERP_STEP,
+    INTERP_LINEAR,
+    INTERP_EXTRAPOLATE
+} interp_mode_t;
+
+typedef struct interp_t
+{
+    interp_mode_t mode;
+    int32_t limit;     // largest output magnitude
+    uint16_t maxTicks; // longest ramp or extrapolation, and longest interval considered part of a stream
+    int32_t value;     // Q16.16
+    int32_t slope;     // Q16.16 per tick
+    int32_t target;    // latest setpoint
+    int32_t low, high; // output bounds until the next setpoint, Q16.16
+    uint16_t moving;   // ticks left to move along slope
+    uint16_t elapsed;  // ticks since the last setpoint, saturating
+} interp_t;
+
+void interpInit(interp_t *interp, interp_mode_t mode, int32_t limit, uint16_t maxTicks);
+
+/**
+ * @brief Feeds a new setpoint, to be followed smoothly according to the mode.
+ */
+void interpSet(interp_t *interp, int32_t target);
+
+/**
+ * @brief Sets the output to value straight away and holds it, for stops and motion programs.
+ */
+void interpJump(interp_t *interp, int32_t value);
+
+/**
+ * @brief Advances by one step and returns the output, rounded to a whole speed.
+ */
+int32_t interpStep(interp_t *interp);
+
+#endif
@@ -1,5 +1,13 @@
 #include "labs/blinky.h"
 
+#include "pinmap/pinmap.h"
+
+// Blinky drives the RGB LED and TPM1 itself, so it cannot be linked with the firmware
+PINMAP_CLAIM(PTB18);
+PINMAP_CLAIM(PTB19);
+PINMAP_CLAIM(PTD1);
+PINMAP_CLAIM(TPM1);
+
 volatile color_t color_to_show = RED;
 
 void initBlinkyGPIO(void)
@@ -4,10 +4,11 @@
 #include <stdbool.h>
 
 #include "MKL25Z4.h"
+#include "pinmap/pinmap.h"
 
-#define RED_LED_PIN 18    // PortB Pin 18
-#define GREEN_LED_PIN 19  // PortB Pin 19
-#define BLUE_LED_PIN 1    // PortD Pin 1
+#define RED_LED_PIN PIN_RGB_RED      // PortB Pin 18
+#define GREEN_LED_PIN PIN_RGB_GREEN  // PortB Pin 19
+#define BLUE_LED_PIN PIN_RGB_BLUE    // PortD Pin 1
 #define MASK(x) (1 << (x))
 
 typedef enum colour {
@@ -16,9 +17,6 @@ typedef enum colour {
     BLUE
 } colour_t;
 
-// Init RGB LED
-void initRGBGPIO(void);
-
 void onLed(colour_t colour);
 
 void offLed(colour_t colour);
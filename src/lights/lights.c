@@ -1,39 +1,8 @@
 #include "lights/lights.h"
 
-void initLEDGPIO(void) {
-    SIM->SCGC5 |= (SIM_SCGC5_PORTE_MASK | SIM_SCGC5_PORTC_MASK);
-
-    // Set MUX for E ports 20 to 30 (6)
-    PORTE->PCR[20] &= ~PORT_PCR_MUX_MASK;
-    PORTE->PCR[20] |= PORT_PCR_MUX(1);
-    PORTE->PCR[21] &= ~PORT_PCR_MUX_MASK;
-    PORTE->PCR[21] |= PORT_PCR_MUX(1);
-    PORTE->PCR[22] &= ~PORT_PCR_MUX_MASK;
-    PORTE->PCR[22] |= PORT_PCR_MUX(1);
-    PORTE->PCR[23] &= ~PORT_PCR_MUX_MASK;
-    PORTE->PCR[23] |= PORT_PCR_MUX(1);
-    PORTE->PCR[29] &= ~PORT_PCR_MUX_MASK;
-    PORTE->PCR[29] |= PORT_PCR_MUX(1);
-    PORTE->PCR[30] &= ~PORT_PCR_MUX_MASK;
-    PORTE->PCR[30] |= PORT_PCR_MUX(1);
-
-    // Set MUX for C ports (5)
-    PORTC->PCR[6] &= ~PORT_PCR_MUX_MASK;
-    PORTC->PCR[6] |= PORT_PCR_MUX(1);
-    PORTC->PCR[5] &= ~PORT_PCR_MUX_MASK;
-    PORTC->PCR[5] |= PORT_PCR_MUX(1);
-    PORTC->PCR[4] &= ~PORT_PCR_MUX_MASK;
-    PORTC->PCR[4] |= PORT_PCR_MUX(1);
-    PORTC->PCR[3] &= ~PORT_PCR_MUX_MASK;
-    PORTC->PCR[3] |= PORT_PCR_MUX(1);
-    PORTC->PCR[12] &= ~PORT_PCR_MUX_MASK;
-    PORTC->PCR[12] |= PORT_PCR_MUX(1);
-
-    // Set output directions
-    PTE->PDDR |= (MASK(20) | MASK(21) | MASK(22) | MASK(23) | MASK(29) | MASK(30));
-
-    PTC->PDDR |= (MASK(6) | MASK(5) | MASK(4) | MASK(3) | MASK(12));
-}
+#include <string.h>
+
+#include "bam/bam.h"
 
 void onELight(uint8_t id) { PTE->PSOR |= MASK(id); }
 
@@ -72,64 +41,78 @@ void offAllLights(PortPin lights[], size_t size) {
 }
 
 
-PortPin greenLights[10] = {{PRTE, 20}, {PRTE, 21}, {PRTE, 22}, {PRTE, 23}, {PRTE, 29},
-                           {PRTE, 30}, {PRTC, 6},  {PRTC, 5},  {PRTC, 4},  {PRTC, 3}};
+PortPin greenLights[10] = {{PRTE, PIN_GREEN_0}, {PRTE, PIN_GREEN_1}, {PRTE, PIN_GREEN_2}, {PRTE, PIN_GREEN_3},
+                           {PRTE, PIN_GREEN_4}, {PRTE, PIN_GREEN_5}, {PRTC, PIN_GREEN_6}, {PRTC, PIN_GREEN_7},
+                           {PRTC, PIN_GREEN_8}, {PRTC, PIN_GREEN_9}};
 
-PortPin redLight = {PRTC, 12};
+PortPin redLight = {PRTC, PIN_RED_LIGHT};
 
-bool isMoving = false;
+static sw_timer_t greenTimer;
+static sw_timer_t redTimer;
 
+// Brightness of the running light's head and the LEDs behind it
+static const uint8_t trail[] = {255, 64, 16, 4};
 
+// Lit LED of the running light, or -1 while stationary
+static int greenIndex = -1;
 
 /* When moving, green lights need to be running
 *  When stationary, ALL green lights are to be on
 */
-void green_lights_thread(void *argument) {
-    for (;;) {
-        // if the vehicle is moving,
-        if (isMoving) {
-            // off all lights first before running them
-            offAllLights(greenLights, 10);
-            // Running light loop
-            for (int i = 0; i < 10 && isMoving; i++) {
-                if (i == 0) {
-                    offLight(greenLights[9]);
-                } else {
-                    offLight(greenLights[i - 1]);
-                }
-                onLight(greenLights[i]);
-                osDelay(250);
-            }
-        } else {
-            // otherwise turn all off them on
-            onAllLights(greenLights, 10);
+static void greenLightsTick(void *argument) {
+    if (!stateMoving()) {
+        // otherwise turn all off them on, and wait for the next change
+        timerCancel(&greenTimer);
+        for (int i = 0; i < 10; i++) {
+            bamSet(i, 255);
         }
+        bamCommit();
+        greenIndex = -1;
+        return;
+    }
+
+    greenIndex = (greenIndex + 1) % 10;
+
+    // The head with a fading tail behind it, everything else off
+    for (int i = 0; i < 10; i++) {
+        int behind = (greenIndex - i + 10) % 10;
+        bamSet(i, (behind < (int) sizeof(trail)) ? trail[behind] : 0);
     }
+    bamCommit();
+    TRACE(TRACE_GREEN_LIGHTS_WAKE, greenIndex, 0);
 }
 
 /*
 * When moving, ALL red lights will blink for 500ms
 * When stationery, ALL red lights will blink for 250ms
 */
-void red_light_thread(void *argument) {
-    for (;;) {
-        onLight(redLight);
-        if (isMoving) {
-            osDelay(500);
-        } else {
-            osDelay(250);
-        }
-        offLight(redLight);
-		if (isMoving) {
-            osDelay(500);
-        } else {
-            osDelay(250);
-        }
-    }
+static void redLightTick(void *argument) {
+    static bool on;
+
+    on = !on;
+    bamSet(RED_LIGHT_BAM, on ? 255 : 0);
+    bamCommit();
+    TRACE(TRACE_RED_LIGHT_WAKE, on, 0);
+    timerStart(&redTimer, (stateMoving() ? RED_MOVING_MS : RED_STATIONARY_MS) * 1000, 0);
+}
+
+// Runs in whichever context changed STATE_MOVING; the tick itself still runs in the timer interrupt
+static void movingChanged(uint32_t changed, void *arg) {
+    timerStart(&greenTimer, 0, GREEN_STEP_MS * 1000);
 }
 
 void initLightsRTOS(void) {
-    // Initialize the function threads
-    osThreadNew(green_lights_thread, NULL, NULL);
-    osThreadNew(red_light_thread, NULL, NULL);
+    PortPin leds[11];
+
+    // Green lights are BAM LEDs 0-9, the red light is RED_LIGHT_BAM
+    memcpy(leds, greenLights, sizeof(greenLights));
+    leds[RED_LIGHT_BAM] = redLight;
+    initBam(leds, 11);
+
+    // Both callbacks run in the timer interrupt, so their bamCommit() calls never overlap
+    timerSetup(&greenTimer, greenLightsTick, NULL);
+    stateSubscribe(STATE_CHANGED(MOVING), movingChanged, NULL);
+    timerStart(&greenTimer, 0, GREEN_STEP_MS * 1000);
+    timerSetup(&redTimer, redLightTick, NULL);
+    timerStart(&redTimer, 0, 0);
 }
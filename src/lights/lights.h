@@ -6,18 +6,25 @@
 #include "RTE_Components.h"
 #include CMSIS_device_header
 #include "cmsis_os2.h"
+#include "pinmap/pinmap.h"
+#include "state/state.h"
+#include "timer/timer.h"
+#include "trace/trace.h"
 #include "utils/utils.h"
 
 #define PRTE 'E'
 #define PRTC 'C'
 
+#define GREEN_STEP_MS 250 // running light
+#define RED_MOVING_MS 500
+#define RED_STATIONARY_MS 250
+#define RED_LIGHT_BAM 10 // BAM LED index of the red light, after the ten green ones
+
 typedef struct {
     char port;
     uint8_t pin;
 } PortPin;
 
-void initLEDGPIO(void);
-
 void onELight(uint8_t id);
 void offELight(uint8_t id);
 
@@ -33,10 +40,10 @@ void offAllLights(PortPin lights[], size_t size);
 extern PortPin greenLights[10];
 extern PortPin redLights;
 
-extern bool isMoving;
-
-void green_lights_thread(void *argument);
-void red_light_thread(void *argument);
-
+/**
+ * @brief Hands the lights to the BAM driver and starts the timers animating them. Call after initPins() and initTimer().
+ *
+ * The green lights follow STATE_MOVING as soon as it changes, and the red light's blink rate from its next blink.
+ */
 void initLightsRTOS(void);
 #endif
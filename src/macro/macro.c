@@ -0,0 +1,239 @@
+#include "macro/macro.h"
+
+#include "motors/motor_driver.h"
+#include "timer/timer.h"
+
+#define CYCLES_PER_MS (DEFAULT_SYSTEM_CLOCK / 1000) // SysTimer runs from the core clock
+
+// Position of a segment within a program; ramped steps are made of several segments
+typedef struct cursor_t
+{
+    uint8_t step;
+    uint16_t segment;
+    uint16_t segments; // number of segments in step
+} cursor_t;
+
+static macro_program_t macroPool[MACRO_POOL_SIZE];
+
+// Slot receiving DUTY/TIME packets, or MACRO_POOL_SIZE if no upload is in progress
+static uint8_t uploadSlot = MACRO_POOL_SIZE;
+
+// Program being played, the segment being played and when it ends
+static macro_program_t *volatile running = NULL;
+static cursor_t current;
+static uint32_t segmentEnd;
+static sw_timer_t segmentTimer;
+
+static void segmentExpired(void *arg);
+
+void initMacro(void) { timerSetup(&segmentTimer, segmentExpired, NULL); }
+
+static bool isComplete(macro_program_t *program)
+{
+    return program->expectedSteps > 0 && program->stepCount == program->expectedSteps;
+}
+
+static uint16_t segmentsIn(macro_step_t *step)
+{
+    uint16_t duration = step->duration & MACRO_DURATION_MASK;
+
+    if (!(step->duration & MACRO_RAMP_FLAG) || duration < MACRO_RAMP_TICK_MS)
+    {
+        return 1;
+    }
+    return duration / MACRO_RAMP_TICK_MS;
+}
+
+static void cursorInit(cursor_t *cursor, macro_program_t *program)
+{
+    cursor->step = 0;
+    cursor->segment = 0;
+    cursor->segments = segmentsIn(&program->steps[0]);
+}
+
+// Moves to the next segment; returns false after the last one
+static bool cursorAdvance(cursor_t *cursor, macro_program_t *program)
+{
+    if (++cursor->segment < cursor->segments)
+    {
+        return true;
+    }
+    if (++cursor->step >= program->stepCount)
+    {
+        return false;
+    }
+    cursor->segment = 0;
+    cursor->segments = segmentsIn(&program->steps[cursor->step]);
+    return true;
+}
+
+// Length of a segment in SysTimer cycles. Segments of a step differ by at most one cycle and add up to the step exactly.
+static uint32_t segmentCycles(cursor_t *cursor, macro_program_t *program)
+{
+    uint32_t total = (program->steps[cursor->step].duration & MACRO_DURATION_MASK) * CYCLES_PER_MS;
+    uint32_t cycles = total / cursor->segments;
+
+    if (cursor->segment < total % cursor->segments)
+    {
+        cycles++;
+    }
+    return cycles;
+}
+
+static int segmentDuty(int start, int target, cursor_t *cursor)
+{
+    return start + (target - start) * (cursor->segment + 1) / cursor->segments;
+}
+
+static void applySegment(cursor_t *cursor, macro_program_t *program)
+{
+    macro_step_t *step = &program->steps[cursor->step];
+    int lDuty = step->lDuty;
+    int rDuty = step->rDuty;
+
+    if (step->duration & MACRO_RAMP_FLAG)
+    {
+        // Ramp from where the previous step ended, or from standstill
+        int lStart = (cursor->step > 0) ? program->steps[cursor->step - 1].lDuty : 0;
+        int rStart = (cursor->step > 0) ? program->steps[cursor->step - 1].rDuty : 0;
+        lDuty = segmentDuty(lStart, lDuty, cursor);
+        rDuty = segmentDuty(rStart, rDuty, cursor);
+    }
+
+    moveLeftSide(lDuty >= 0 ? FORWARD : BACKWARD, abs(lDuty) * MOTOR_SPEED_MAX / MACRO_MAX_DUTY);
+    moveRightSide(rDuty >= 0 ? FORWARD : BACKWARD, abs(rDuty) * MOTOR_SPEED_MAX / MACRO_MAX_DUTY);
+}
+
+static void finish(void)
+{
+    timerCancel(&segmentTimer);
+    running = NULL;
+    stateSetMoving(false);
+    stop();
+}
+
+// Runs in the timer interrupt
+static void segmentExpired(void *arg)
+{
+    if (running == NULL)
+    {
+        return;
+    }
+    if (!cursorAdvance(&current, running))
+    {
+        finish();
+        return;
+    }
+    applySegment(&current, running);
+
+    // From the previous segment's end rather than from now, so interrupt latency does not add up
+    segmentEnd += segmentCycles(&current, running);
+    timerStartAt(&segmentTimer, segmentEnd);
+}
+
+bool macroRun(uint8_t slot)
+{
+    if (slot >= MACRO_POOL_SIZE || !isComplete(&macroPool[slot]))
+    {
+        return false;
+    }
+
+    macroAbort();
+    // Drop drive commands queued before the program was started
+    osMessageQueueReset(motorMsg);
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    macro_program_t *program = &macroPool[slot];
+    cursorInit(&current, program);
+    running = program;
+
+    stateSetMoving(true);
+    applySegment(&current, program);
+
+    segmentEnd = osKernelGetSysTimerCount() + segmentCycles(&current, program);
+    timerStartAt(&segmentTimer, segmentEnd);
+    __set_PRIMASK(primask);
+    return true;
+}
+
+void macroAbort(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (running != NULL)
+    {
+        finish();
+    }
+    __set_PRIMASK(primask);
+}
+
+bool macroIsRunning(void) { return running != NULL; }
+
+static int8_t clampDuty(unsigned char value)
+{
+    return (int8_t)constrain((int8_t)value, -MACRO_MAX_DUTY, MACRO_MAX_DUTY);
+}
+
+void macroHandlePacket(packet_t *packet)
+{
+    macro_program_t *program = (uploadSlot < MACRO_POOL_SIZE) ? &macroPool[uploadSlot] : NULL;
+
+    switch (packet->command)
+    {
+    case COMMAND_MACRO_BEGIN:
+        // The slot being played cannot be overwritten
+        if (packet->x >= MACRO_POOL_SIZE || packet->y > MACRO_MAX_STEPS || &macroPool[packet->x] == running)
+        {
+            uploadSlot = MACRO_POOL_SIZE;
+            break;
+        }
+        uploadSlot = packet->x;
+        macroPool[uploadSlot].expectedSteps = packet->y;
+        macroPool[uploadSlot].stepCount = 0;
+        macroPool[uploadSlot].haveDuty = false;
+        break;
+
+    case COMMAND_MACRO_DUTY:
+        if (program == NULL || program->stepCount >= program->expectedSteps)
+        {
+            break;
+        }
+        program->steps[program->stepCount].lDuty = clampDuty(packet->x);
+        program->steps[program->stepCount].rDuty = clampDuty(packet->y);
+        program->haveDuty = true;
+        break;
+
+    case COMMAND_MACRO_TIME:
+    {
+        if (program == NULL || !program->haveDuty)
+        {
+            break;
+        }
+        uint16_t duration = packet->x | ((packet->y & 0x7F) << 8);
+        if (duration == 0)
+        {
+            duration = 1;
+        }
+        if (packet->y & 0x80)
+        {
+            duration |= MACRO_RAMP_FLAG;
+        }
+        program->steps[program->stepCount].duration = duration;
+        program->stepCount++;
+        program->haveDuty = false;
+        break;
+    }
+
+    case COMMAND_MACRO_RUN:
+        macroRun(packet->x);
+        break;
+
+    case COMMAND_MACRO_ABORT:
+        macroAbort();
+        break;
+
+    default:
+        break;
+    }
+}
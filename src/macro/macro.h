@@ -0,0 +1,84 @@
+/**
+ * @file macro.h
+ * @brief Onboard executor for short timed motion programs.
+ *
+ * A program is a list of steps, each holding a signed duty for the left and
+ * right side (-100 to 100, negative is backwards) and a duration in
+ * milliseconds. A step can optionally ramp linearly from the previous step's
+ * duties instead of jumping to its own. Programs are uploaded over UART1 with
+ * the COMMAND_MACRO_* packets:
+ *
+ *   COMMAND_MACRO_BEGIN  x: slot, y: number of steps
+ *   COMMAND_MACRO_DUTY   x: left duty, y: right duty (two's complement)
+ *   COMMAND_MACRO_TIME   x: duration bits 0-7, y: bit 7 ramp flag, bits 0-6 duration bits 8-14
+ *   COMMAND_MACRO_RUN    x: slot
+ *   COMMAND_MACRO_ABORT
+ *
+ * Each step is sent as a DUTY packet followed by a TIME packet, and the program
+ * can be run once all the steps announced by BEGIN have arrived.
+ *
+ * Playback is driven by a one-shot timer from timer/timer.h. Each segment's end
+ * is computed from the previous segment's end rather than from when the timer
+ * fired, so step boundaries do not drift by the interrupt latency. Ramped steps
+ * are split into MACRO_RAMP_TICK_MS segments whose lengths add up exactly to
+ * the step.
+ *
+ * A new drive command from the joystick, an abort packet or macroAbort() stops
+ * the program and the motors. Idle packets are ignored while a program runs.
+ */
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "packet/packet.h"
+
+#define MACRO_POOL_SIZE 4
+#define MACRO_MAX_STEPS 16
+#define MACRO_RAMP_TICK_MS 5
+#define MACRO_MAX_DUTY 100
+
+#define MACRO_RAMP_FLAG 0x8000
+#define MACRO_DURATION_MASK 0x7FFF
+
+typedef struct macro_step_t
+{
+    int8_t lDuty;
+    int8_t rDuty;
+    uint16_t duration; // milliseconds in bits 0-14, MACRO_RAMP_FLAG in bit 15
+} macro_step_t;
+
+typedef struct macro_program_t
+{
+    uint8_t expectedSteps; // announced by COMMAND_MACRO_BEGIN
+    uint8_t stepCount;     // complete steps received so far
+    bool haveDuty;         // a DUTY packet is waiting for its TIME packet
+    macro_step_t steps[MACRO_MAX_STEPS];
+} macro_program_t;
+
+/**
+ * @brief Prepares the playback timer. Call after initTimer().
+ */
+void initMacro(void);
+
+/**
+ * @brief Handles a COMMAND_MACRO_* packet.
+ */
+void macroHandlePacket(packet_t *packet);
+
+/**
+ * @brief Starts playing the program in slot. Returns false if the slot does not hold a complete program.
+ */
+bool macroRun(uint8_t slot);
+
+/**
+ * @brief Stops the running program, if any, and the motors.
+ */
+void macroAbort(void);
+
+bool macroIsRunning(void);
+
+#endif
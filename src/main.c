@@ -1,207 +1,43 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "RTE_Components.h"
 #include CMSIS_device_header
 #include "MKL25Z4.h"
+#include "battery/battery.h"
+#include "boot/boot.h"
 #include "cirq/cirq.h"
 #include "cmsis_os2.h"
+#include "config/config.h"
+#include "console/console.h"
+#include "flow/flow.h"
+#include "health/health.h"
 #include "led/led.h"
+#include "macro/macro.h"
 #include "lights/lights.h"
 #include "motors/motor_driver.h"
 #include "music/music.h"
 #include "packet/packet.h"
+#include "ping/ping.h"
+#include "pinmap/pinmap.h"
+#include "recorder/recorder.h"
 #include "serialize/serialize.h"
+#include "timer/timer.h"
+#include "trace/trace.h"
+#include "uart/uart.h"
 #include "utils/utils.h"
 
-#define BAUD_RATE 9600
-#define UART0_RX_PIN 1 // PortA Pin 1
-#define UART0_TX_PIN 2 // PortA Pin 2
-#define UART0_INT_PRIO 128
-#define UART1_RX_PIN 1 // PortE Pin 1
-#define UART1_TX_PIN 0 // PortE Pin 0
-#define UART1_INT_PRIO 128
-
-Q_t transmit0Q, receive0Q;
-Q_t transmit1Q, receive1Q;
 volatile char user_input_key; /* User input key read from serial port*/
 
-// Init UART0 Interrupt
-void initIntUART0(uint32_t baud_rate)
-{
-    // UART0 clock gate enable
-    SIM_SCGC4 |= SIM_SCGC4_UART0(1);
-
-    // select UART0 clock source
-    SIM_SOPT2 &= ~SIM_SOPT2_UART0SRC_MASK;
-    SIM_SOPT2 |= SIM_SOPT2_UART0SRC(1);
-
-    // configure UART0 TX/RX pins
-    SIM_SCGC5 |= SIM_SCGC5_PORTA(1);
-    PORTA_PCR(UART0_RX_PIN) = PORT_PCR_MUX(2);
-    PORTA_PCR(UART0_TX_PIN) = PORT_PCR_MUX(2);
-
-    // disable UART0
-    UART0_C2 &= ~(UART_C2_TE_MASK | UART_C2_RE_MASK);
-
-    uint32_t bus_clock = DEFAULT_SYSTEM_CLOCK; // for some reason, no need to divide by 2 when system clock is 48MHz
-    uint32_t divisor = bus_clock / (baud_rate * 16);
-    UART0_BDH = UART_BDH_SBR(divisor >> 8);
-    UART0_BDL = UART_BDL_SBR(divisor);
-
-    UART0_C1 = 0;
-    UART0_S2 = 0;
-    UART0_C3 = 0;
-
-    // enable UART0
-    UART0_C2 |= UART_C2_TE_MASK | UART_C2_RE_MASK;
-
-    Q_init(&transmit0Q);
-    Q_init(&receive0Q);
-
-    NVIC_SetPriority(UART0_IRQn, UART0_INT_PRIO);
-    NVIC_ClearPendingIRQ(UART0_IRQn);
-    NVIC_EnableIRQ(UART0_IRQn);
-
-    // UART0_C2 |= UART_C2_TIE_MASK | UART_C2_RIE_MASK;
-    UART0_C2 |= UART_C2_RIE_MASK;
-}
-
-// Init UART1 Interrupt
-void initIntUART1(uint32_t baud_rate)
-{
-    // UART1 clock gate enable
-    SIM_SCGC4 |= SIM_SCGC4_UART1(1);
-
-    // configure UART1 TX/RX pins
-    SIM_SCGC5 |= SIM_SCGC5_PORTE(1);
-    PORTE_PCR(UART1_RX_PIN) = PORT_PCR_MUX(3);
-    PORTE_PCR(UART1_TX_PIN) = PORT_PCR_MUX(3);
-
-    // disable UART1
-    UART1_C2 &= ~(UART_C2_TE_MASK | UART_C2_RE_MASK);
-
-    uint32_t bus_clock = DEFAULT_SYSTEM_CLOCK / 2;
-    uint32_t divisor = bus_clock / (baud_rate * 16);
-    UART1_BDH = UART_BDH_SBR(divisor >> 8);
-    UART1_BDL = UART_BDL_SBR(divisor);
-
-    UART1_C1 = 0;
-    UART1_S2 = 0;
-    UART1_C3 = 0;
-
-    // enable UART1
-    UART1_C2 |= UART_C2_TE_MASK | UART_C2_RE_MASK;
-
-    Q_init(&transmit1Q);
-    Q_init(&receive1Q);
-
-    NVIC_SetPriority(UART1_IRQn, UART1_INT_PRIO);
-    NVIC_ClearPendingIRQ(UART1_IRQn);
-    NVIC_EnableIRQ(UART1_IRQn);
-
-    UART1_C2 |= UART_C2_RIE_MASK;
-}
-
-void UART0_IRQHandler()
-{
-    NVIC_ClearPendingIRQ(UART0_IRQn);
-    NVIC_DisableIRQ(UART0_IRQn);
-    // Transmit
-    if (UART0_S1 & UART_S1_TDRE_MASK)
-    {
-        if (!Q_isEmpty(&transmit0Q))
-        {
-            UART0_D = Q_dequeue(&transmit0Q);
-        }
-        else
-        {
-            UART0_C2 &= ~UART_C2_TIE_MASK; // stop transmissions
-        }
-    }
-    // Receive
-    if (UART0_S1 & UART_S1_RDRF_MASK)
-    {
-        if (!Q_isFull(&receive0Q))
-        {
-            Q_enqueue(&receive0Q, UART0_D);
-        }
-        else
-        {
-            // remove oldest packet and add new packet
-            for (int i = 0; i < PACKET_SIZE; i++)
-            {
-                Q_dequeue(&receive1Q);
-                Q_enqueue(&receive1Q, UART1_D);
-            }
-        }
-    }
-    // Error
-    if (UART0_S1 & (UART_S1_OR_MASK | UART_S1_NF_MASK | UART_S1_FE_MASK | UART_S1_PF_MASK))
-    {
-        // handle error
-        // clear flag
-    }
-
-    NVIC_EnableIRQ(UART0_IRQn);
-}
-
-osSemaphoreId_t packetSemaphore;
-void UART1_IRQHandler()
-{
-    NVIC_ClearPendingIRQ(UART1_IRQn);
-    NVIC_DisableIRQ(UART1_IRQn);
-    // Transmit
-    if (UART1_S1 & UART_S1_TDRE_MASK)
-    {
-        if (!Q_isEmpty(&transmit1Q))
-        {
-            UART1_D = Q_dequeue(&transmit1Q);
-        }
-        else
-        {
-            UART1_C2 &= ~UART_C2_TIE_MASK; // stop transmissions
-        }
-    }
-    // Receive
-    if (UART1_S1 & UART_S1_RDRF_MASK)
-    {
-        if (!Q_isFull(&receive1Q))
-        {
-            Q_enqueue(&receive1Q, UART1_D);
-
-            // If the queue has at least 3 bytes, then it can be received and packaged into a packet
-            if (receive1Q.Size >= 3)
-            {
-                osSemaphoreRelease(packetSemaphore);
-            }
-        }
-        else
-        {
-            // remove oldest packet and add new packet
-            for (int i = 0; i < PACKET_SIZE; i++)
-            {
-                Q_dequeue(&receive1Q);
-                Q_enqueue(&receive1Q, UART1_D);
-            }
-        }
-    }
-    // Error
-    // if (UART1_S1 & (UART_S1_OR_MASK | UART_S1_NF_MASK | UART_S1_FE_MASK | UART_S1_PF_MASK))
-    // {
-    //     // handle error
-    //     // clear flag
-    // }
-
-    NVIC_EnableIRQ(UART1_IRQn);
-}
-
 static bool is_menu_displayed = false; /* Flag indicating menu status */
 
 static void transmit_data(void *pdata, size_t size);
 
 void controlLed(void)
 {
-    user_input_key = Q_dequeue(&receive0Q);
+    char key = 0;
+    uartRead(UART_PORT0, &key, 1, NULL);
+    user_input_key = key;
 
     // Display menu on power-up
     if (!is_menu_displayed)
@@ -239,27 +75,10 @@ static void transmit_data(void *pdata, size_t size)
 {
     // char buffer[70];
     // int len = serialize(buffer, pdata, size);
-    // for (int i = 0; i < len; i++) {
-    char *data = (char *)pdata;
-    for (int i = 0; i < size; i++)
-    {
-        NVIC_DisableIRQ(UART0_IRQn);
-        Q_enqueue(&transmit0Q, data[i]);
-        NVIC_EnableIRQ(UART0_IRQn);
-    }
-    UART0_C2 |= UART_C2_TIE_MASK;
+    uartWrite(UART_PORT0, pdata, size);
 }
 
-static void printString(char *str)
-{
-    while (*str)
-    {
-        NVIC_DisableIRQ(UART0_IRQn);
-        Q_enqueue(&transmit0Q, *str++);
-        NVIC_EnableIRQ(UART0_IRQn);
-    }
-    UART0_C2 |= UART_C2_TIE_MASK;
-}
+static void printString(const char *str) { consolePrint(str); }
 
 static void printPacket(packet_t *packet)
 {
@@ -310,137 +129,292 @@ static void printMotor(motor_t *motor)
 
 void receiveEspTest(void)
 {
-    char buffer[PACKET_SIZE] = {};
-    int count = 0;
+    frame_t frame;
 
-    while (!Q_isEmpty(&receive1Q) && count < PACKET_SIZE)
+    if (uartReadFrames(UART_PORT1, &frame, 1) == 1)
     {
-        buffer[count++] = Q_dequeue(&receive1Q);
+        motor_t motor;
+        parsePacket(&frame.packet, &motor);
+
+        // printMotor(&motor);
+        moveRobot(&motor);
     }
+}
 
-    packet_t packet;
-    result_t result;
-    if (count == 0)
+/*
+ * Acts on a decoded packet. Shared by live input from the ESP32 and replayed recordings.
+ * stamp is the packet's arrival time in osKernelGetSysTimerCount() cycles.
+ */
+void handlePacket(packet_t *packet, uint32_t stamp)
+{
+    switch (packet->command)
+    {
+    case 1:
     {
-        result = PACKET_INCOMPLETE;
+        bootMark(BOOT_FIRST_DRIVE);
+
+        // Joystick input takes over from a running motion program
+        macroAbort();
+
+        motor_t motor;
+        parsePacket(packet, &motor);
+
+        // Move motor message into queue
+        motorSubmit(&motor, stamp);
+        TRACE(TRACE_MOTOR_MSG_PUT, 0, osMessageQueueGetCount(motorMsg));
+        break;
+    }
+    case 2:
+        // Music toggle command for "Mary Had a Little Lamb"
+        stateSetMary(true);
+        initRgbLed();
+        onLed(RED);
+        break;
+
+    case 3:
+        // Music toggle command for "Happy Birthday"
+        stateSetMary(false);
+        initRgbLed();
+        onLed(BLUE);
+        break;
+
+    case COMMAND_MACRO_BEGIN:
+    case COMMAND_MACRO_DUTY:
+    case COMMAND_MACRO_TIME:
+    case COMMAND_MACRO_RUN:
+    case COMMAND_MACRO_ABORT:
+        macroHandlePacket(packet);
+        break;
+
+    default:
+        // Stop any movement if command is unrecognized, unless a motion program is playing
+        // (the ESP32 keeps sending idle packets while the sticks are centred)
+        if (!macroIsRunning())
+        {
+            stateSetMoving(false);
+            stop();
+        }
+        break;
     }
-    else
+}
+
+/*
+ * UART1 frame hook, in the UART1 interrupt: a drive frame is applied on the spot, skipping the packet and motor
+ * threads. Anything that needs the thread's handling first (a motion program to abort, a recording to log or a
+ * replay to stop) leaves the frame to the thread, as does every other command. Taken frames do not wake the
+ * packet thread; its FLOW_REFRESH_MS timeout keeps the credits going.
+ */
+static bool fastDrive(const packet_t *packet, uint32_t stamp)
+{
+    if (packet->command != 1 || macroIsRunning() || !recorderIsIdle())
     {
-        result = deserialize(buffer, count, &packet);
+        return false;
     }
 
-    if (result == PACKET_OK)
+    motor_t motor;
+    parsePacket((packet_t *)packet, &motor);
+    if (!motorApplyNow(&motor, stamp))
     {
-        motor_t motor;
-        parsePacket(&packet, &motor);
+        return false;
+    }
+    bootMark(BOOT_FIRST_DRIVE);
+    return true;
+}
 
-        // printMotor(&motor);
-        moveRobot(&motor);
+osSemaphoreId_t packetSemaphore;
+
+static flow_t flow;
+
+// Packets from the ESP32, queued whole by the UART1 ISR
+static frameq_t espFrames;
+
+static void sendCredit(void)
+{
+    uint32_t received, space;
+    packet_t credit;
+
+    uartGetReceiveSpace(UART_PORT1, &received, &space);
+    if (flowUpdate(&flow, received, space, osKernelGetTickCount(), &credit))
+    {
+        char buffer[PACKET_SIZE];
+        serialize(buffer, &credit, PACKET_SIZE);
+        if (!uartTryWrite(UART_PORT1, buffer, PACKET_SIZE))
+        {
+            // Sent once there is room, on a multidrop bus after the next grant
+            flowResend(&flow);
+        }
     }
 }
 
+// Periodic reports are dropped rather than waited for: a multidrop node that is not being polled never gets room
+static void sendReport(packet_t *report)
+{
+    char buffer[PACKET_SIZE];
+    serialize(buffer, report, PACKET_SIZE);
+    (void)uartTryWrite(UART_PORT1, buffer, PACKET_SIZE);
+}
+
 void receive_packet_thread(void *argument)
 {
+    bootMark(BOOT_READY);
+
     for (;;)
     {
-        // Wait until there is at least 3 bytes worth of data to be received
-        osSemaphoreAcquire(packetSemaphore, osWaitForever);
-        char buffer[PACKET_SIZE] = {};
-        int count = 0;
-
-        while (!Q_isEmpty(&receive1Q) && count < PACKET_SIZE)
+        // Wait until there is at least 3 bytes worth of data to be received, or until a credit refresh is due
+        if (osSemaphoreAcquire(packetSemaphore, FLOW_REFRESH_MS) == osOK)
         {
-            buffer[count++] = Q_dequeue(&receive1Q);
+            TRACE(TRACE_PACKET_WAKE, 0, 0);
         }
+        healthBeat(HEALTH_PACKET);
 
-        packet_t packet;
-        result_t result;
-        if (count == 0)
-        {
-            result = PACKET_INCOMPLETE;
-        }
-        else
+        // The semaphore is binary, so take every queued packet on each wake
+        frame_t frames[FRAMEQ_SIZE];
+        int count = uartReadFrames(UART_PORT1, frames, FRAMEQ_SIZE);
+        for (int i = 0; i < count; i++)
         {
-            result = deserialize(buffer, count, &packet);
-        }
+            packet_t *packet = &frames[i].packet;
+            TRACE(TRACE_PACKET_DECODED, packet->command, 0);
 
-        if (result == PACKET_OK)
-        {
-            switch (packet.command)
-            {
-            case 1:
+            // Latency probes and settings are answered straight away and never recorded or replayed
+            if (pingHandlePacket(packet) || configHandlePacket(packet))
             {
-                motor_t motor;
-                parsePacket(&packet, &motor);
+                continue;
+            }
 
-                // Move motor message into queue
-                osMessageQueuePut(motorMsg, &motor, 0, 0);
-                break;
+            recorderLog(packet);
+
+            // Joystick input stops a replay; anything else received during a replay is ignored
+            if (packet->command == 1)
+            {
+                recorderStopReplay();
             }
-            case 2:
-                // Music toggle command for "Mary Had a Little Lamb"
-                isMary = true;
-                initRgbLed();
-                onLed(RED);
-                break;
-
-            case 3:
-                // Music toggle command for "Happy Birthday"
-                isMary = false;
-                initRgbLed();
-                onLed(BLUE);
-                break;
-
-            default:
-                // Stop any movement if command is unrecognized
-                isMoving = false;
-                stop();
-                break;
+            if (!recorderIsReplaying())
+            {
+                handlePacket(packet, frames[i].stamp);
             }
         }
+
+        sendCredit();
+
+        packet_t report;
+        if (batteryReport(&report))
+        {
+            sendReport(&report);
+        }
+        if (healthReport(&report))
+        {
+            sendReport(&report);
+        }
     }
 }
 
 void initPacketThreadRTOS()
 {
-    // Semaphore is release by the ISR when there is at least 3 bytes of data to be read and packaged
-    // Semaphore is acquired by receive_packet_thread to parse the packet and is used to direct motors or toggle music
+    // Semaphore is released by the ISR whenever it queues a packet
+    // Semaphore is acquired by receive_packet_thread to handle the packets, which direct motors or toggle music
     packetSemaphore = osSemaphoreNew(1, 0, NULL);
+    flowInit(&flow);
+    uartSetReceiveSemaphore(UART_PORT1, packetSemaphore, PACKET_SIZE);
     osThreadNew(receive_packet_thread, NULL, NULL);
 }
 
+// Not needed to drive; with BOOT_FAST_START these come up in startup_thread once commands are accepted
+static void initLazyHardware(void)
+{
+    // Battery voltage, sampled on PIT channel 0 and filtered on a software timer; calibrating the ADC busy-waits
+    initBattery();
+
+    // On Board RGB Led
+    initRgbLed();
+
+    // Music
+    initMusic();
+}
+
+static void initLazyRTOS(void)
+{
+    initConfigRTOS();
+    initRecorderRTOS(handlePacket);
+    initLightsRTOS();
+    initMusicRTOS();
+    initConsoleRTOS();
+}
+
+// Lowest of the application threads, so it only runs while the drive path is idle
+static void startup_thread(void *argument)
+{
+#if BOOT_FAST_START
+    initLazyHardware();
+    initLazyRTOS();
+    bootMark(BOOT_LAZY);
+#endif
+    bootPrint(consolePrint);
+}
+
 void initRTOS()
 {
     osKernelInitialize();
+#if BOOT_FAST_START
+    // The drive path first
+    initPacketThreadRTOS();
+    initMotorControlRTOS();
+    initHealthRTOS();
+#else
+    initConsoleRTOS();
     initPacketThreadRTOS();
     initLightsRTOS();
     initMotorControlRTOS();
     initMusicRTOS();
+    initRecorderRTOS(handlePacket);
+    initConfigRTOS();
+    initHealthRTOS();
+    bootMark(BOOT_LAZY);
+#endif
+    const osThreadAttr_t attributes = {.name = "startup", .priority = osPriorityLow};
+    osThreadNew(startup_thread, NULL, &attributes);
+
+    bootMark(BOOT_KERNEL);
     osKernelStart();
 }
 
 void initHardware()
 {
-    // UART
-    // initIntUART0(BAUD_RATE);
-    initIntUART1(BAUD_RATE);
+    // Clock gates and every pin, from the table in pinmap/pinmap.h
+    initPins();
+    bootMark(BOOT_PINS);
 
-    // On Board RGB Led
-    initRGBGPIO();
-    initRgbLed();
+    // Software timers, used by the motors, lights, music and motion programs
+    initTimer();
+    bootMark(BOOT_TIMER);
+
+    // Settings, read in place from the config sectors
+    const config_t *config = configLoad();
 
-    // 10-segment LEDs
-    initLEDGPIO();
+    // UART, the ESP32 link first, queuing whole packets and applying drive frames in its interrupt
+    uartSetFramed(UART_PORT1, &espFrames, fastDrive);
+    uartInit(UART_PORT1, config->linkBaud);
+    uartInit(UART_PORT0, config->consoleBaud);
+    bootMark(BOOT_LINK);
 
     // Motors
     initMotors();
 
-    // Music
-    initMusic();
+    // Motion programs
+    initMacro();
+
+    // The rest of the settings: PWM profile, stick shaping, song
+    configApply();
+    bootMark(BOOT_MOTORS);
+
+#if !BOOT_FAST_START
+    initLazyHardware();
+#endif
 }
 
 int main(void)
 {
+    bootStart();
+    healthInit();
     SystemCoreClockUpdate();
 
     initHardware();
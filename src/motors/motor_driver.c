@@ -11,39 +11,133 @@
 
 #include "motors/motor_driver.h"
 
+#include <stdio.h>
+#include <string.h>
+
+#include "health/health.h"
+#include "timer/timer.h"
+
+// Arrival time of the last command applied, or time of the last stop()
+static volatile uint32_t orderStamp;
+
+// Signed speed of each side, shared with TPM1_IRQHandler
+static interp_t leftInterp;
+static interp_t rightInterp;
+
+static motor_pwm_stats_t pwmStats;
+
+const motor_pwm_profile_t motorPwmProfiles[MOTOR_PWM_PROFILE_COUNT] = {
+    {"500hz", 500, MOTOR_TPM_CLOCK / 500 - 1, 500 / MOTOR_STEP_HZ},
+    {"4khz", 4000, MOTOR_TPM_CLOCK / 4000 - 1, 4000 / MOTOR_STEP_HZ},
+    // Above hearing
+    {"20khz", 20000, MOTOR_TPM_CLOCK / 20000 - 1, 20000 / MOTOR_STEP_HZ},
+};
+
+// Channel value for each speed under the active profile, and the one being built for the next
+static uint16_t dutyTables[2][MOTOR_SPEED_MAX + 1];
+static const uint16_t* dutyTable;
+static const motor_pwm_profile_t* activeProfile;
+
+// Set by motorSetPwmProfile(), taken up by TPM1_IRQHandler at the next reload
+static const uint16_t* volatile pendingTable;
+static const motor_pwm_profile_t* volatile pendingProfile;
+
+// Overflows left until the next interpolator step, and the speeds it produced last
+static uint16_t overflows = 1;
+static int32_t lSpeedNow;
+static int32_t rSpeedNow;
+
+// Closed-loop state of one side, shared with TPM1_IRQHandler
+typedef struct speed_loop_t {
+    encoder_side_t side;
+    speed_est_t est;
+    pi_t pi;
+    int32_t direction;  // sign of the setpoint the loop last ran for, 0 when stopped
+    int32_t setpoint;   // pulses per second, Q28.4
+    uint32_t measured;  // pulses per second, Q28.4
+    int32_t correction; // added to the open-loop speed until the next control step
+} speed_loop_t;
+
+static volatile bool speedControl;
+static speed_loop_t leftLoop = {.side = ENCODER_LEFT};
+static speed_loop_t rightLoop = {.side = ENCODER_RIGHT};
+static uint16_t controlSteps = 1;
+static motor_speed_stats_t speedStats;
+
+// Set once the interpolators exist, so a frame arriving during boot waits for the thread
+static volatile bool fastPath;
+static motor_latency_t fastLatency;
+static motor_latency_t threadLatency;
+static const uint16_t latencyEdges[MOTOR_LATENCY_BUCKET_COUNT - 1] = MOTOR_LATENCY_BUCKET_EDGES;
+static uint32_t latencyEdgeCycles[MOTOR_LATENCY_BUCKET_COUNT - 1];
+
+static void initLatency(void) {
+    for (int i = 0; i < MOTOR_LATENCY_BUCKET_COUNT - 1; i++) {
+        latencyEdgeCycles[i] = timerCycles(latencyEdges[i]);
+    }
+}
+
+static void recordLatency(motor_latency_t* latency, uint32_t cycles) {
+    int bucket = 0;
+    while (bucket < MOTOR_LATENCY_BUCKET_COUNT - 1 && cycles >= latencyEdgeCycles[bucket]) {
+        bucket++;
+    }
+
+    latency->buckets[bucket]++;
+    latency->count++;
+    latency->total += cycles;
+    if (cycles > latency->max) {
+        latency->max = cycles;
+    }
+}
+
+static void resetSpeedLoop(speed_loop_t* loop) {
+    piReset(&loop->pi);
+    loop->direction = 0;
+    loop->setpoint = 0;
+    loop->correction = 0;
+}
+
+static void initSpeedLoop(speed_loop_t* loop) {
+    speedInit(&loop->est, timerCycles(1000000), timerCycles(CONTROL_STALL_MS * 1000));
+    piInit(&loop->pi, CONTROL_KP, CONTROL_KI, 0, MOTOR_SPEED_MAX);
+    resetSpeedLoop(loop);
+}
+
 void initMotors(void) {
-    initMotorGPIO();
+    initEncoders();
+    initSpeedLoop(&leftLoop);
+    initSpeedLoop(&rightLoop);
     initMotorTimers();
+    initLatency();
+    fastPath = MOTOR_FAST_PATH;
 }
 
-void initMotorGPIO(void) {
-    // Enable clock to Ports A and B
-    SIM->SCGC5 |= (SIM_SCGC5_PORTA_MASK | SIM_SCGC5_PORTB_MASK);
-
-    // Set MUX to ALT3 for TPM
-    PORTA->PCR[RIGHT_GREEN_FORWARD_PIN] &= ~PORT_PCR_MUX_MASK;
-    PORTA->PCR[RIGHT_GREEN_FORWARD_PIN] |= PORT_PCR_MUX(3);
-    PORTA->PCR[RIGHT_BLUE_BACK_PIN] &= ~PORT_PCR_MUX_MASK;
-    PORTA->PCR[RIGHT_BLUE_BACK_PIN] |= PORT_PCR_MUX(3);
+// Speed to channel value in Q16 fixed point, rounded; full speed is MOD + 1, always high
+static void fillDutyTable(uint16_t* table, uint16_t mod) {
+    uint32_t scale = ((uint32_t) (mod + 1) << 16) / MOTOR_SPEED_MAX;
 
-    PORTB->PCR[LEFT_GREEN_FORWARD_PIN] &= ~PORT_PCR_MUX_MASK;
-    PORTB->PCR[LEFT_GREEN_FORWARD_PIN] |= PORT_PCR_MUX(3);
-    PORTB->PCR[LEFT_BLUE_BACK_PIN] &= ~PORT_PCR_MUX_MASK;
-    PORTB->PCR[LEFT_BLUE_BACK_PIN] |= PORT_PCR_MUX(3);
+    for (uint32_t speed = 0; speed <= MOTOR_SPEED_MAX; speed++) {
+        table[speed] = (speed * scale + 0x8000) >> 16;
+    }
 }
 
 void initMotorTimers(void) {
-    // Enable clocks to TPM1 and TPM2
-    SIM->SCGC6 |= (SIM_SCGC6_TPM1_MASK | SIM_SCGC6_TPM2_MASK);
+    // initPins() gates TPM1 and TPM2, selects their clock and muxes the channels to the pins
+    // Stop both counters so they can be started together below
+    TPM1->SC &= ~TPM_SC_CMOD_MASK;
+    TPM2->SC &= ~TPM_SC_CMOD_MASK;
+    TPM1->CNT = 0;
+    TPM2->CNT = 0;
 
-    // Select internal clock source
-    SIM->SOPT2 &= ~SIM_SOPT2_TPMSRC_MASK;
-    SIM->SOPT2 |= SIM_SOPT2_TPMSRC(1);
+    activeProfile = &motorPwmProfiles[MOTOR_PWM_PROFILE];
+    fillDutyTable(dutyTables[0], activeProfile->mod);
+    dutyTable = dutyTables[0];
 
     // Configure TPM1
-    TPM1->MOD = PWM_PERIOD;
-    TPM1->SC &= ~(TPM_SC_CMOD_MASK | TPM_SC_PS_MASK);
-    TPM1->SC |= (TPM_SC_CMOD(1) | TPM_SC_PS(7));
+    TPM1->MOD = activeProfile->mod;
+    TPM1->SC &= ~TPM_SC_PS_MASK;
+    TPM1->SC |= TPM_SC_PS(MOTOR_TPM_PS);
     TPM1->SC &= ~TPM_SC_CPWMS_MASK;
 
     TPM1_C0SC &= ~(TPM_CnSC_ELSB_MASK | TPM_CnSC_MSB_MASK | TPM_CnSC_ELSA_MASK | TPM_CnSC_MSA_MASK);
@@ -54,9 +148,9 @@ void initMotorTimers(void) {
     TPM1_C1SC |= (TPM_CnSC_MSB(1) | TPM_CnSC_ELSB(1));
 
     // Configure TPM2
-    TPM2->MOD = PWM_PERIOD;
-    TPM2->SC &= ~(TPM_SC_CMOD_MASK | TPM_SC_PS_MASK);
-    TPM2->SC |= (TPM_SC_CMOD(1) | TPM_SC_PS(7));
+    TPM2->MOD = activeProfile->mod;
+    TPM2->SC &= ~TPM_SC_PS_MASK;
+    TPM2->SC |= TPM_SC_PS(MOTOR_TPM_PS);
     TPM2->SC &= ~TPM_SC_CPWMS_MASK;
 
     TPM2_C0SC &= ~(TPM_CnSC_ELSB_MASK | TPM_CnSC_MSB_MASK | TPM_CnSC_ELSA_MASK | TPM_CnSC_MSA_MASK);
@@ -66,6 +160,20 @@ void initMotorTimers(void) {
     TPM2_C1SC &= ~(TPM_CnSC_ELSB_MASK | TPM_CnSC_MSB_MASK | TPM_CnSC_ELSA_MASK | TPM_CnSC_MSA_MASK);
     TPM2_C1SC |= (TPM_CnSC_MSB(1) | TPM_CnSC_ELSB(1));
 
+    interpInit(&leftInterp, MOTOR_INTERP_MODE, MOTOR_SPEED_MAX, MOTOR_INTERP_MAX_TICKS);
+    interpInit(&rightInterp, MOTOR_INTERP_MODE, MOTOR_SPEED_MAX, MOTOR_INTERP_MAX_TICKS);
+
+    // Step the interpolators from the TPM1 overflow interrupt; CnV writes take effect at the next overflow
+    TPM1->SC |= (TPM_SC_TOF_MASK | TPM_SC_TOIE_MASK);
+    NVIC_SetPriority(TPM1_IRQn, MOTOR_INT_PRIO);
+    NVIC_ClearPendingIRQ(TPM1_IRQn);
+    NVIC_EnableIRQ(TPM1_IRQn);
+
+    // TPM2 waits for TPM1's first overflow before counting, so both reload together from then on
+    TPM2->CONF = (TPM2->CONF & ~TPM_CONF_TRGSEL_MASK) | TPM_CONF_TRGSEL(MOTOR_TRGSEL_TPM1_OVERFLOW) | TPM_CONF_CSOT_MASK;
+    TPM2->SC |= TPM_SC_CMOD(1);
+    TPM1->SC |= TPM_SC_CMOD(1);
+
     // For debugging
     // TPM2_C0V = 500;
     // TPM2_C1V = 0;
@@ -73,66 +181,492 @@ void initMotorTimers(void) {
     // TPM1_C1V = 0;
 }
 
+// Channel value for a speed, scaled for the battery voltage; never more than always high
+static uint16_t toCounts(int32_t speed) {
+    uint32_t counts = ((uint32_t) dutyTable[speed] * batteryGetCompensation()) >> BATTERY_COMP_SHIFT;
+    uint32_t full = activeProfile->mod + 1;
+    return (counts > full) ? full : counts;
+}
+
+// Splits a signed speed into the forward and backward channel values
+static void stageSide(int32_t speed, uint16_t* forward, uint16_t* backward) {
+    *forward = (speed > 0) ? toCounts(speed) : 0;
+    *backward = (speed < 0) ? toCounts(-speed) : 0;
+}
+
+static void recordCommit(uint32_t start, uint32_t end, uint32_t rightCount) {
+    uint32_t period = TPM1->MOD + 1;
+    int32_t phase = (int32_t) rightCount - (int32_t) end;
+
+    if (phase < 0) {
+        phase = -phase;
+    }
+    if ((uint32_t) phase > period / 2) {
+        phase = period - phase;
+    }
+
+    pwmStats.commits++;
+    if (end < start) {
+        pwmStats.split++;
+    }
+    if ((uint32_t) phase > pwmStats.phaseMax) {
+        pwmStats.phaseMax = phase;
+    }
+    if (end > pwmStats.commitMax) {
+        pwmStats.commitMax = end;
+    }
+}
+
+static int32_t toSpeed(Direction dir, unsigned char speed) {
+    return (dir == FORWARD) ? speed : -speed;
+}
+
+// Measures one side and updates its correction for the signed setpoint speed
+static void runSpeedLoop(speed_loop_t* loop, int32_t speed, uint32_t now) {
+    uint32_t edges, stamp;
+    encoderRead(loop->side, &edges, &stamp);
+    loop->measured = speedUpdate(&loop->est, edges, stamp, now);
+
+    int32_t direction = (speed > 0) - (speed < 0);
+    int32_t magnitude = abs(speed);
+    if (direction != loop->direction) {
+        // The integral was built up for the other direction or for a stop
+        piReset(&loop->pi);
+        loop->direction = direction;
+    }
+    loop->setpoint = magnitude * (CONTROL_FULL_PPS << CONTROL_SPEED_SHIFT) / MOTOR_SPEED_MAX;
+    if (magnitude == 0) {
+        loop->correction = 0;
+        return;
+    }
+    int32_t output = piStep(&loop->pi, loop->setpoint, (int32_t) loop->measured, magnitude, loop->est.fresh);
+    loop->correction = output - magnitude;
+}
+
+static void runSpeedControl(void) {
+    uint32_t start = osKernelGetSysTimerCount();
+    runSpeedLoop(&leftLoop, lSpeedNow, start);
+    runSpeedLoop(&rightLoop, rSpeedNow, start);
+
+    uint32_t cycles = osKernelGetSysTimerCount() - start;
+    speedStats.runs++;
+    speedStats.cyclesTotal += cycles;
+    if (cycles > speedStats.cyclesMax) {
+        speedStats.cyclesMax = cycles;
+    }
+}
+
+// Open-loop speed plus the side's correction; a stop or a new direction stays open loop until the loop has run
+static int32_t closedLoopSpeed(const speed_loop_t* loop, int32_t speed) {
+    int32_t direction = (speed > 0) - (speed < 0);
+    if (direction == 0 || direction != loop->direction) {
+        return speed;
+    }
+    return direction * constrain(abs(speed) + loop->correction, 0, MOTOR_SPEED_MAX);
+}
+
+// Call right after a reload; the hardware buffers the values until the next one
+static void commit(void) {
+    uint16_t lForward, lBackward, rForward, rBackward;
+    stageSide(lSpeedNow, &lForward, &lBackward);
+    stageSide(rSpeedNow, &rForward, &rBackward);
+
+    // Write all four channels back to back
+    uint32_t start = TPM1->CNT;
+    TPM1_C0V = lForward;
+    TPM1_C1V = lBackward;
+    TPM2_C0V = rForward;
+    TPM2_C1V = rBackward;
+    uint32_t end = TPM1->CNT;
+    recordCommit(start, end, TPM2->CNT);
+}
+
+void TPM1_IRQHandler(void) {
+    NVIC_ClearPendingIRQ(TPM1_IRQn);
+    if (TPM1->SC & TPM_SC_TOF_MASK) {
+        // Clear interrupt flag by writing 1 to it
+        TPM1->SC |= TPM_SC_TOF_MASK;
+
+        if (pendingProfile != NULL) {
+            // New period and the current speeds from the new table, taken up together at the next reload
+            TPM1->MOD = pendingProfile->mod;
+            TPM2->MOD = pendingProfile->mod;
+            dutyTable = pendingTable;
+            activeProfile = pendingProfile;
+            pendingProfile = NULL;
+            overflows = activeProfile->overflowsPerStep;
+            commit();
+        } else if (--overflows == 0) {
+            overflows = activeProfile->overflowsPerStep;
+            lSpeedNow = interpStep(&leftInterp);
+            rSpeedNow = interpStep(&rightInterp);
+            if (speedControl) {
+                if (--controlSteps == 0) {
+                    controlSteps = MOTOR_STEP_HZ / CONTROL_HZ;
+                    runSpeedControl();
+                }
+                lSpeedNow = closedLoopSpeed(&leftLoop, lSpeedNow);
+                rSpeedNow = closedLoopSpeed(&rightLoop, rSpeedNow);
+            }
+            commit();
+        }
+    }
+}
+
+bool motorSetPwmProfile(const char* name) {
+    const motor_pwm_profile_t* profile = NULL;
+
+    for (int i = 0; i < MOTOR_PWM_PROFILE_COUNT; i++) {
+        if (strcmp(motorPwmProfiles[i].name, name) == 0) {
+            profile = &motorPwmProfiles[i];
+        }
+    }
+    if (profile == NULL) {
+        return false;
+    }
+
+    while (pendingProfile != NULL) {
+        osDelay(1);
+    }
+
+    // dutyTable only changes when a switch is pending, so the other table is free
+    uint16_t* table = (dutyTable == dutyTables[0]) ? dutyTables[1] : dutyTables[0];
+    fillDutyTable(table, profile->mod);
+    pendingTable = table;
+    pendingProfile = profile;
+    return true;
+}
+
+const motor_pwm_profile_t* motorGetPwmProfile(void) { return activeProfile; }
+
+void motorClearPwmStats(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(&pwmStats, 0, sizeof(pwmStats));
+    __set_PRIMASK(primask);
+}
+
+void motorPrintPwmStats(void (*print)(const char* str)) {
+    char line[96];
+    motor_pwm_stats_t stats;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stats = pwmStats;
+    __set_PRIMASK(primask);
+
+    sprintf(line, "profile %s: %lu Hz, %lu counts per period\r\n", activeProfile->name,
+            (unsigned long)activeProfile->hz, (unsigned long)activeProfile->mod + 1);
+    print(line);
+    sprintf(line, "sides %lu counts apart, commits done by count %lu of %lu\r\n", (unsigned long)stats.phaseMax,
+            (unsigned long)stats.commitMax, (unsigned long)TPM1->MOD);
+    print(line);
+    sprintf(line, "%lu of %lu commits straddled a reload\r\n", (unsigned long)stats.split,
+            (unsigned long)stats.commits);
+    print(line);
+}
+
+void motorSetSpeedControl(bool enabled) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    resetSpeedLoop(&leftLoop);
+    resetSpeedLoop(&rightLoop);
+    controlSteps = 1;
+    speedControl = enabled;
+    __set_PRIMASK(primask);
+}
+
+bool motorGetSpeedControl(void) { return speedControl; }
+
+void motorClearSpeedStats(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(&speedStats, 0, sizeof(speedStats));
+    __set_PRIMASK(primask);
+}
+
+static void printSpeedLoop(void (*print)(const char* str), const char* name, const speed_loop_t* loop) {
+    char line[96];
+    // Tenths of a pulse per second
+    uint32_t setpoint = (uint32_t) loop->setpoint * 10 >> CONTROL_SPEED_SHIFT;
+    uint32_t measured = loop->measured * 10 >> CONTROL_SPEED_SHIFT;
+
+    sprintf(line, "%s: set %lu.%lu pps, measured %lu.%lu pps, correction %+ld\r\n", name,
+            (unsigned long) (setpoint / 10), (unsigned long) (setpoint % 10), (unsigned long) (measured / 10),
+            (unsigned long) (measured % 10), (long) loop->correction);
+    print(line);
+}
+
+void motorPrintSpeedStats(void (*print)(const char* str)) {
+    char line[96];
+    speed_loop_t left, right;
+    motor_speed_stats_t stats;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    left = leftLoop;
+    right = rightLoop;
+    stats = speedStats;
+    __set_PRIMASK(primask);
+
+    sprintf(line, "speed control %s, %d Hz, full speed %d pps\r\n", speedControl ? "on" : "off", CONTROL_HZ,
+            CONTROL_FULL_PPS);
+    print(line);
+    printSpeedLoop(print, "left ", &left);
+    printSpeedLoop(print, "right", &right);
+    if (stats.runs > 0) {
+        sprintf(line, "%lu control steps, %lu cycles avg, %lu max\r\n", (unsigned long) stats.runs,
+                (unsigned long) (stats.cyclesTotal / stats.runs), (unsigned long) stats.cyclesMax);
+        print(line);
+    }
+}
+
+void motorSetInterpMode(interp_mode_t mode) {
+    leftInterp.mode = mode;
+    rightInterp.mode = mode;
+}
+
+interp_mode_t motorGetInterpMode(void) { return leftInterp.mode; }
+
 void stop(void) {
-    TPM2_C0V = 0;
-    TPM2_C1V = 0;
-    TPM1_C0V = 0;
-    TPM1_C1V = 0;
+    TRACE(TRACE_TPM_WRITE, 0, 0);
+    // Commands that arrived before the stop must not restart the motors
+    orderStamp = osKernelGetSysTimerCount();
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    interpJump(&leftInterp, 0);
+    interpJump(&rightInterp, 0);
+    __set_PRIMASK(primask);
+}
+
+static volatile uint8_t stickDeadzone;
+static volatile uint8_t stickExpo;
+static volatile int8_t stickTrim;
+
+void motorSetStickShaping(uint8_t deadzone, uint8_t expo, int8_t trim) {
+    stickDeadzone = (deadzone > MOTOR_DEADZONE_MAX) ? MOTOR_DEADZONE_MAX : deadzone;
+    stickExpo = (expo > 100) ? 100 : expo;
+    stickTrim = constrain(trim, -MOTOR_TRIM_MAX, MOTOR_TRIM_MAX);
+}
+
+// Deadzone, rescaled so the rest of the throw still reaches full deflection, then the expo curve
+static int shapeAxis(int value) {
+    int magnitude = abs(value);
+    int deadzone = stickDeadzone;
+    int expo = stickExpo;
+
+    if (magnitude <= deadzone) {
+        return 0;
+    }
+    magnitude = (magnitude - deadzone) * 128 / (128 - deadzone);
+    magnitude = (magnitude * (100 - expo) + magnitude * magnitude * magnitude / (128 * 128) * expo) / 100;
+    return (value < 0) ? -magnitude : magnitude;
 }
 
 void parsePacket(packet_t* packet, motor_t* settings) {
-    int x = normalise((int) packet->x);
-    int y = normalise((int) packet->y);
+    int x = shapeAxis(normalise((int) packet->x));
+    int y = shapeAxis(normalise((int) packet->y));
 
     int lMotorVelocity = constrain(x - y, -128, 127);
     int rMotorVelocity = constrain(-x - y, -128, 127);
 
-    settings->lSpeed = map(abs(lMotorVelocity), 0, 127, 0, 100);
-    settings->rSpeed = map(abs(rMotorVelocity), 0, 127, 0, 100);
+    // -128 maps slightly past full speed
+    settings->lSpeed = constrain(map(abs(lMotorVelocity), 0, 127, 0, MOTOR_SPEED_MAX), 0, MOTOR_SPEED_MAX);
+    settings->rSpeed = constrain(map(abs(rMotorVelocity), 0, 127, 0, MOTOR_SPEED_MAX), 0, MOTOR_SPEED_MAX);
+
+    // Positive trim slows the left side, negative the right, to make a robot that pulls to one side drive straight
+    int trim = stickTrim;
+    if (trim > 0) {
+        settings->lSpeed = settings->lSpeed * (100 - trim) / 100;
+    } else if (trim < 0) {
+        settings->rSpeed = settings->rSpeed * (100 + trim) / 100;
+    }
 
     settings->lDir = (lMotorVelocity >= 0) ? FORWARD : BACKWARD;
     settings->rDir = (rMotorVelocity >= 0) ? FORWARD : BACKWARD;
 }
 
 void moveRightSide(Direction dir, unsigned char speed) {
-    uint16_t pwmValue = speed * PWM_PERIOD / 100;
+    int32_t signedSpeed = toSpeed(dir, speed);
 
-    if (dir == FORWARD) {
-        TPM2_C0V = pwmValue;
-        TPM2_C1V = 0;
-    } else {
-        TPM2_C1V = pwmValue;
-        TPM2_C0V = 0;
-    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    interpJump(&rightInterp, signedSpeed);
+    __set_PRIMASK(primask);
 }
 
 void moveLeftSide(Direction dir, unsigned char speed) {
-    uint16_t pwmValue = speed * PWM_PERIOD / 100;
+    int32_t signedSpeed = toSpeed(dir, speed);
 
-    if (dir == FORWARD) {
-        TPM1_C0V = pwmValue;
-        TPM1_C1V = 0;
-    } else {
-        TPM1_C1V = pwmValue;
-        TPM1_C0V = 0;
-    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    interpJump(&leftInterp, signedSpeed);
+    __set_PRIMASK(primask);
 }
 
 void moveRobot(motor_t* settings) {
-    moveLeftSide(settings->lDir, settings->lSpeed);
-    moveRightSide(settings->rDir, settings->rSpeed);
+    TRACE(TRACE_TPM_WRITE, settings->lSpeed, settings->rSpeed);
+    int32_t left = toSpeed(settings->lDir, settings->lSpeed);
+    int32_t right = toSpeed(settings->rDir, settings->rSpeed);
+
+    // Setpoints only; TPM1_IRQHandler moves the duty towards them
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    interpSet(&leftInterp, left);
+    interpSet(&rightInterp, right);
+    __set_PRIMASK(primask);
 		// stop();
 }
 
 osMessageQueueId_t motorMsg;
 
+static volatile uint32_t ageBudgetMs = MOTOR_AGE_BUDGET_MS;
+static motor_stats_t motorStats;
+
+// Applies a command unless a newer one or a stop() got there first. Masked throughout, as the
+// UART1 interrupt and the timer wheel's stop() can otherwise come between the check and the setpoints
+static bool applyInOrder(motor_t* motor, motor_latency_t* latency) {
+    bool applied = false;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    // Compare ages rather than stamps so the comparison survives the counter wrapping
+    uint32_t now = osKernelGetSysTimerCount();
+    uint32_t age = now - motor->stamp;
+    if (age > now - orderStamp) {
+        motorStats.outOfOrder++;
+    } else {
+        orderStamp = motor->stamp;
+        motorStats.applied++;
+        if (age > motorStats.ageMax) {
+            motorStats.ageMax = age;
+        }
+        recordLatency(latency, age);
+
+        stateSetMoving(true);
+        moveRobot(motor);
+        applied = true;
+    }
+    __set_PRIMASK(primask);
+    return applied;
+}
+
+void motorSubmit(motor_t* motor, uint32_t stamp) {
+    motor->stamp = stamp;
+    osMessageQueuePut(motorMsg, motor, 0, 0);
+}
+
+bool motorApplyNow(motor_t* motor, uint32_t stamp) {
+    if (!fastPath) {
+        return false;
+    }
+
+    motor->stamp = stamp;
+    if (applyInOrder(motor, &fastLatency)) {
+        motorStats.fast++;
+    }
+    return true;
+}
+
+void motorSetFastPath(bool enabled) { fastPath = enabled; }
+
+bool motorGetFastPath(void) { return fastPath; }
+
+void motorSetAgeBudget(uint32_t ms) { ageBudgetMs = (ms > MOTOR_AGE_BUDGET_MAX_MS) ? MOTOR_AGE_BUDGET_MAX_MS : ms; }
+
+uint32_t motorGetAgeBudget(void) { return ageBudgetMs; }
+
+void motorClearStats(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(&motorStats, 0, sizeof(motorStats));
+    __set_PRIMASK(primask);
+}
+
+void motorPrintStats(void (*print)(const char* str)) {
+    char line[80];
+    motor_stats_t stats;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stats = motorStats;
+    __set_PRIMASK(primask);
+
+    uint32_t cyclesPerUs = osKernelGetSysTimerFreq() / 1000000;
+    sprintf(line, "age budget %lu ms, oldest applied %lu us\r\n", (unsigned long)ageBudgetMs,
+            (unsigned long)(stats.ageMax / cyclesPerUs));
+    print(line);
+    sprintf(line, "applied %lu (%lu in the UART1 interrupt), stale %lu, out of order %lu\r\n",
+            (unsigned long)stats.applied, (unsigned long)stats.fast, (unsigned long)stats.stale,
+            (unsigned long)stats.outOfOrder);
+    print(line);
+}
+
+void motorClearLatency(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(&fastLatency, 0, sizeof(fastLatency));
+    memset(&threadLatency, 0, sizeof(threadLatency));
+    __set_PRIMASK(primask);
+}
+
+void motorPrintLatency(void (*print)(const char* str)) {
+    char line[80];
+    motor_latency_t fast, thread;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    fast = fastLatency;
+    thread = threadLatency;
+    __set_PRIMASK(primask);
+
+    uint32_t cyclesPerUs = osKernelGetSysTimerFreq() / 1000000;
+    sprintf(line, "fast path %s; last byte to setpoint:\r\n", fastPath ? "on" : "off");
+    print(line);
+    sprintf(line, "            interrupt     thread\r\n");
+    print(line);
+    sprintf(line, "  count    %10lu %10lu\r\n", (unsigned long)fast.count, (unsigned long)thread.count);
+    print(line);
+    sprintf(line, "  avg us   %10lu %10lu\r\n",
+            (unsigned long)(fast.count ? (uint32_t)(fast.total / fast.count) / cyclesPerUs : 0),
+            (unsigned long)(thread.count ? (uint32_t)(thread.total / thread.count) / cyclesPerUs : 0));
+    print(line);
+    sprintf(line, "  max us   %10lu %10lu\r\n", (unsigned long)(fast.max / cyclesPerUs),
+            (unsigned long)(thread.max / cyclesPerUs));
+    print(line);
+
+    for (int i = 0; i < MOTOR_LATENCY_BUCKET_COUNT; i++) {
+        if (i < MOTOR_LATENCY_BUCKET_COUNT - 1) {
+            sprintf(line, "  < %4u us %10lu %10lu\r\n", latencyEdges[i], (unsigned long)fast.buckets[i],
+                    (unsigned long)thread.buckets[i]);
+        } else {
+            sprintf(line, "  >=%4u us %10lu %10lu\r\n", latencyEdges[i - 1], (unsigned long)fast.buckets[i],
+                    (unsigned long)thread.buckets[i]);
+        }
+        print(line);
+    }
+}
+
 void motor_control_thread(void* argument) {
     motor_t myMotor;
+
     for (;;) {
         // Get motor message from queue, blocks and allows other threads to run if no message is received
-        osMessageQueueGet(motorMsg, &myMotor, NULL, osWaitForever);
-        isMoving = true;
-        moveRobot(&myMotor);
+        osStatus_t status = osMessageQueueGet(motorMsg, &myMotor, NULL, MOTOR_IDLE_WAIT_MS);
+        healthBeat(HEALTH_MOTOR);
+        if (status != osOK) {
+            continue;
+        }
+        TRACE(TRACE_MOTOR_MSG_GET, 0, osMessageQueueGetCount(motorMsg));
+
+        uint32_t age = osKernelGetSysTimerCount() - myMotor.stamp;
+        uint32_t budget = ageBudgetMs * (osKernelGetSysTimerFreq() / 1000);
+        if (budget != 0 && age > budget) {
+            motorStats.stale++;
+            continue;
+        }
+        applyInOrder(&myMotor, &threadLatency);
     }
 }
 
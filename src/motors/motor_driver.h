@@ -10,28 +10,87 @@
  * Right wheels operating on TPM2_CH0 and TPM2_CH1 which are PTA1 and PTA2 respectively
  * Left wheels operating on TPM1_CH0 and TPM1_CH1 which are PTB0 and PTB1 respectively.
  *
+ * Drive commands reach motor_control_thread through motorMsg stamped with the
+ * arrival time of their last byte. With the fast path on ("fast on"), the
+ * UART1 interrupt applies a drive frame itself through motorApplyNow() as soon
+ * as its last byte is in, skipping the packet thread, the queue and this
+ * thread; frames arriving during a motion program, recording or replay still
+ * take the thread path. The "fast" console command prints the latency from
+ * last byte to setpoint of both paths side by side. A command older than the age budget, or
+ * older than the last command applied or the last stop(), is dropped and
+ * counted instead of being applied late. The budget is set with the "age"
+ * console command. The packet has no spare byte for a sender sequence number,
+ * so ordering is by arrival time.
+ *
+ * Applied drive commands are setpoints for an interpolator per side, stepped
+ * from the TPM1 overflow interrupt at MOTOR_STEP_HZ so the duty changes smoothly
+ * between the ESP32's 50ms updates (see interp/interp.h). stop() and the motion
+ * programs' moveLeftSide()/moveRightSide() bypass the smoothing.
+ *
+ * Only TPM1_IRQHandler writes the channel values. TPM2 is started by TPM1's
+ * overflow trigger so both counters reload together, and the handler writes all
+ * four channels just after that reload; the TPM buffers them until the next
+ * one, so both sides change duty in the same PWM period, at most one step
+ * after the request. The "pwm" console command shows the measured skew.
+ *
+ * Speeds run from 0 to MOTOR_SPEED_MAX and are turned into channel values with
+ * a table built for the active PWM profile. All profiles share the TPM
+ * prescaler, which can only be changed with the counters stopped, and differ
+ * only in MOD. A profile switch writes the new MOD and the channel values from
+ * the new table just after a reload; both are buffered until the next one, so
+ * no period mixes the two profiles.
+ *
+ * Each channel value is scaled by the battery compensation factor as it is
+ * written (see battery/battery.h), so a speed maps to the same average motor
+ * voltage whatever the charge. The factor changes every 20ms at most and is
+ * picked up at the next interpolator step.
+ *
+ * With speed control on ("speed on"), the interpolator output is a wheel speed
+ * setpoint rather than a duty. Every MOTOR_STEP_HZ / CONTROL_HZ steps the
+ * interrupt measures each wheel from its encoder (see encoder/encoder.h) and
+ * runs a PI loop (see control/control.h) that adds to the open-loop duty
+ * whatever it takes to hold that speed on carpet or a low battery. Off by
+ * default, since it needs the encoders fitted.
+ *
  * @author
  * Cheng Jia Wei Andy
  */
 #ifndef MOTOR_DRIVER_H
 #define MOTOR_DRIVER_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "RTE_Components.h"
 #include CMSIS_device_header
 #include "cmsis_os2.h"
+#include "battery/battery.h"
+#include "control/control.h"
+#include "encoder/encoder.h"
+#include "interp/interp.h"
+#include "pinmap/pinmap.h"
 #include "serialize/serialize.h"
+#include "state/state.h"
+#include "trace/trace.h"
 #include "utils/utils.h"
 
-// For global isMoving variable
-#include "lights/lights.h"
-
-#define LEFT_GREEN_FORWARD_PIN 0  // PortB 0; TPM1_CH0
-#define LEFT_BLUE_BACK_PIN 1      // PortB 1; TPM1_CH1
-#define RIGHT_GREEN_FORWARD_PIN 1 // PortA 1; TPM2_CH0
-#define RIGHT_BLUE_BACK_PIN 2     // PortA 2; TPM2_CH1
+#define LEFT_GREEN_FORWARD_PIN PIN_MOTOR_LEFT_FORWARD   // PortB 0; TPM1_CH0
+#define LEFT_BLUE_BACK_PIN PIN_MOTOR_LEFT_BACK          // PortB 1; TPM1_CH1
+#define RIGHT_GREEN_FORWARD_PIN PIN_MOTOR_RIGHT_FORWARD // PortA 1; TPM2_CH0
+#define RIGHT_BLUE_BACK_PIN PIN_MOTOR_RIGHT_BACK        // PortA 2; TPM2_CH1
 #define MSG_COUNT 10
+#define MOTOR_AGE_BUDGET_MS 100       // default; two ESP32 send periods
+#define MOTOR_AGE_BUDGET_MAX_MS 10000 // in SysTimer cycles it has to fit in 32 bits
+#define MOTOR_IDLE_WAIT_MS 100  // longest motor_control_thread waits for a command before posting a heartbeat anyway
+#define MOTOR_INT_PRIO 64       // same as the timer wheel's PIT, so motion program steps and commits never preempt each other
+#define MOTOR_INTERP_MODE INTERP_LINEAR
+#define MOTOR_INTERP_MAX_TICKS 50 // steps; 100ms, two ESP32 send periods
+#define MOTOR_TRGSEL_TPM1_OVERFLOW 9
+#define MOTOR_STEP_HZ 500 // interpolator rate, whatever the PWM frequency
+#define MOTOR_PWM_PROFILE 0 // index into motorPwmProfiles at boot, until config/config.h selects another
+#define MOTOR_DEADZONE_MAX 64 // stick units either side of centre
+#define MOTOR_TRIM_MAX 50     // percent
+#define MOTOR_FAST_PATH 1     // apply drive frames in the UART1 interrupt from boot; "fast off" to compare
 
 typedef enum
 {
@@ -45,35 +104,100 @@ typedef struct motor_t
     unsigned char lSpeed;
     Direction rDir;
     unsigned char rSpeed;
+    uint32_t stamp; // osKernelGetSysTimerCount() when the command arrived
 } motor_t;
 
-/** @brief Defines the PWM period for a 500 Hz signal */
-#define PWM_PERIOD 749
+typedef struct motor_stats_t
+{
+    uint32_t applied;
+    uint32_t stale;      // older than the age budget
+    uint32_t outOfOrder; // older than a command already applied or a stop()
+    uint32_t ageMax;     // SysTimer cycles, of applied commands
+    uint32_t fast;       // of those applied, applied in the UART1 interrupt
+} motor_stats_t;
+
+#define MOTOR_LATENCY_BUCKET_COUNT 8
 
 /**
- * @brief Initializes all motors by setting up GPIO and timers.
- *
- * This function calls the necessary sub-functions to initialize the GPIO
- * pins and configure the TPM timers for PWM-based motor control.
+ * @brief Upper bucket edges in us; the last bucket holds everything above the last edge.
  */
-void initMotors(void);
+#define MOTOR_LATENCY_BUCKET_EDGES {10, 20, 50, 100, 200, 500, 1000}
+
+// From the arrival of a drive command's last byte to its setpoints being set
+typedef struct motor_latency_t
+{
+    uint32_t count;
+    uint32_t max; // SysTimer cycles
+    uint64_t total;
+    uint32_t buckets[MOTOR_LATENCY_BUCKET_COUNT];
+} motor_latency_t;
+
+typedef struct motor_pwm_stats_t
+{
+    uint32_t commits;
+    uint32_t split;     // commits that straddled a reload, so the sides may have changed a period apart
+    uint32_t phaseMax;  // largest TPM1/TPM2 counter difference, in counts
+    uint32_t commitMax; // latest TPM1 count at which a commit finished
+} motor_pwm_stats_t;
+
+typedef struct motor_speed_stats_t
+{
+    uint32_t runs;
+    uint32_t cyclesMax; // SysTimer cycles for one control step, both sides
+    uint64_t cyclesTotal;
+} motor_speed_stats_t;
+
+/** @brief Full speed for motor_t, moveLeftSide() and moveRightSide() */
+#define MOTOR_SPEED_MAX 255
+
+/** @brief TPM1/TPM2 count MCGFLLCLK divided by 2^MOTOR_TPM_PS in every profile */
+#define MOTOR_TPM_PS 1
+#define MOTOR_TPM_CLOCK (DEFAULT_SYSTEM_CLOCK >> MOTOR_TPM_PS)
+
+typedef struct motor_pwm_profile_t
+{
+    const char *name;
+    uint32_t hz;
+    uint16_t mod;              // MOTOR_TPM_CLOCK / hz - 1
+    uint16_t overflowsPerStep; // hz / MOTOR_STEP_HZ
+} motor_pwm_profile_t;
+
+#define MOTOR_PWM_PROFILE_COUNT 3
+extern const motor_pwm_profile_t motorPwmProfiles[MOTOR_PWM_PROFILE_COUNT];
 
 /**
- * @brief Configures the GPIO pins for motor control.
+ * @brief Initializes all motors by setting up the encoders and timers.
  *
- * This function enables the clocks for Ports A and B, and configures the pin
- * multiplexing to use the TPM (Timer/PWM Module) for generating PWM signals.
+ * The pins and clocks come from initPins(), see pinmap/pinmap.h; this function
+ * starts the encoders and configures the TPM timers for PWM-based motor control.
  */
-void initMotorGPIO(void);
+void initMotors(void);
 
 /**
  * @brief Configures TPM timers for PWM generation.
  *
- * This function sets up the TPM1 and TPM2 timers with a prescaler of 128,
- * configures the PWM period, and enables edge-aligned PWM on the specified channels.
+ * This function sets up the TPM1 and TPM2 timers with a prescaler of 2,
+ * configures the period of the MOTOR_PWM_PROFILE profile, and enables edge-aligned PWM on the specified channels.
+ * The TPM1 overflow interrupt steps the interpolators once per PWM period.
  */
 void initMotorTimers(void);
 
+/**
+ * @brief Selects how drive commands are smoothed, see interp/interp.h. Takes effect from the next command.
+ */
+void motorSetInterpMode(interp_mode_t mode);
+
+interp_mode_t motorGetInterpMode(void);
+
+/**
+ * @brief Switches to the PWM profile called name, from the next PWM period. Returns false if there is none.
+ *
+ * Waits for a switch still in progress, so call it from a thread.
+ */
+bool motorSetPwmProfile(const char *name);
+
+const motor_pwm_profile_t *motorGetPwmProfile(void);
+
 /**
  * @brief Stops all motors.
  *
@@ -81,6 +205,15 @@ void initMotorTimers(void);
  */
 void stop(void);
 
+/**
+ * @brief Sets how parsePacket() turns stick positions into speeds. All zero, the default, maps them linearly.
+ *
+ * deadzone: stick units either side of centre that read as centred, up to MOTOR_DEADZONE_MAX.
+ * expo: percent of cubic blended into the response curve, for finer control around centre.
+ * trim: percent the left side (positive) or right side (negative) is slowed by, up to MOTOR_TRIM_MAX.
+ */
+void motorSetStickShaping(uint8_t deadzone, uint8_t expo, int8_t trim);
+
 void parsePacket(packet_t *packet, motor_t *settings);
 
 void moveRobot(motor_t *motor_settings);
@@ -89,6 +222,67 @@ void moveLeftSide(Direction dir, unsigned char speed);
 
 extern osMessageQueueId_t motorMsg;
 
+/**
+ * @brief Queues a drive command for motor_control_thread. stamp is its arrival time in osKernelGetSysTimerCount() cycles.
+ */
+void motorSubmit(motor_t *motor, uint32_t stamp);
+
+/**
+ * @brief Applies a drive command straight away, from interrupt context. Returns false if the fast path is off.
+ *
+ * stamp is the arrival time of its last byte. A command older than the last
+ * one applied or the last stop() is dropped, as in motor_control_thread.
+ */
+bool motorApplyNow(motor_t *motor, uint32_t stamp);
+
+void motorSetFastPath(bool enabled);
+
+bool motorGetFastPath(void);
+
+/**
+ * @brief Prints the latency histograms of drive commands applied in the UART1 interrupt and by motor_control_thread.
+ */
+void motorPrintLatency(void (*print)(const char *str));
+
+void motorClearLatency(void);
+
+/**
+ * @brief Sets the age above which queued commands are dropped. 0 disables the check.
+ *
+ * Budgets above MOTOR_AGE_BUDGET_MAX_MS are clamped to it.
+ */
+void motorSetAgeBudget(uint32_t ms);
+
+uint32_t motorGetAgeBudget(void);
+
+/**
+ * @brief Prints the age budget and the applied/dropped command counters through print.
+ */
+void motorPrintStats(void (*print)(const char *str));
+
+void motorClearStats(void);
+
+/**
+ * @brief Prints the PWM profile and the measured skew between the TPM1 and TPM2 updates through print.
+ */
+void motorPrintPwmStats(void (*print)(const char *str));
+
+void motorClearPwmStats(void);
+
+/**
+ * @brief Switches between open-loop duty and closed-loop wheel speed control.
+ */
+void motorSetSpeedControl(bool enabled);
+
+bool motorGetSpeedControl(void);
+
+/**
+ * @brief Prints the speed setpoints, the measured wheel speeds and the cost of the control step through print.
+ */
+void motorPrintSpeedStats(void (*print)(const char *str));
+
+void motorClearSpeedStats(void);
+
 void initMotorControlRTOS(void);
 void motor_control_thread(void *argument);
 
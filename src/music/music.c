@@ -11,25 +11,12 @@ int birthday[25] = {
 
 void initMusic(void)
 {
-    initMusicGPIO();
     initMusicTimer();
 }
 
-void initMusicGPIO(void)
-{
-    SIM_SCGC5 |= SIM_SCGC5_PORTE_MASK;
-
-    PORTE_PCR(31) &= ~PORT_PCR_MUX_MASK;
-    PORTE_PCR(31) |= PORT_PCR_MUX(3);
-}
-
+// initPins() gates TPM0, selects its clock and muxes PTE31 to TPM0_CH4
 void initMusicTimer(void)
 {
-    SIM_SCGC6 |= SIM_SCGC6_TPM0_MASK;
-
-    SIM_SOPT2 &= ~SIM_SOPT2_TPMSRC_MASK;
-    SIM_SOPT2 |= SIM_SOPT2_TPMSRC(1);
-
     TPM0_SC &= ~((TPM_SC_CMOD_MASK) | (TPM_SC_PS_MASK));
     // TPM0_SC |= (TPM_SC_CMOD(1) | TPM_SC_PS(7));  // ps=128
     TPM0_SC |= (TPM_SC_CMOD(1) | TPM_SC_PS(3)); // ps=8
@@ -39,38 +26,42 @@ void initMusicTimer(void)
     TPM0_C4SC |= (TPM_CnSC_ELSB(1) | (TPM_CnSC_MSB(1)));
 }
 
-bool isMary = true;
+static sw_timer_t noteTimer;
+static bool playingMary;
+static bool noteOn;
+static int noteIndex;
 
-void music_thread(void *argument)
+// Plays one note, then the gap after it; the song restarts whenever STATE_MARY changes
+static void musicTick(void *argument)
 {
-    for (;;)
+    if (noteOn)
     {
-        if (isMary)
-        {
-            for (int i = 0; i < 27 && isMary; i++)
-            {
-                TPM0_MOD = mary[i];
-                TPM0_C4V = mary[i] / 2;
-                osDelay(300);
-                TPM0_C4V = 0;
-                osDelay(25);
-            }
-        }
-        else
-        {
-            for (int i = 0; i < 25 && !isMary; i++)
-            {
-                TPM0_MOD = birthday[i];
-                TPM0_C4V = birthday[i] / 2;
-                osDelay(500);
-                TPM0_C4V = 0;
-                osDelay(50);
-            }
-        }
+        TPM0_C4V = 0;
+        noteOn = false;
+        timerStart(&noteTimer, (playingMary ? MARY_GAP_MS : BIRTHDAY_GAP_MS) * 1000, 0);
+        return;
     }
+
+    bool wantMary = stateMary();
+    if (playingMary != wantMary)
+    {
+        playingMary = wantMary;
+        noteIndex = 0;
+    }
+    int *song = playingMary ? mary : birthday;
+    int length = playingMary ? 27 : 25;
+
+    TRACE(TRACE_MUSIC_NOTE, noteIndex, song[noteIndex]);
+    TPM0_MOD = song[noteIndex];
+    TPM0_C4V = song[noteIndex] / 2;
+    noteOn = true;
+    noteIndex = (noteIndex + 1) % length;
+    timerStart(&noteTimer, (playingMary ? MARY_NOTE_MS : BIRTHDAY_NOTE_MS) * 1000, 0);
 }
 
 void initMusicRTOS(void)
 {
-    osThreadNew(music_thread, NULL, NULL);
+    playingMary = stateMary();
+    timerSetup(&noteTimer, musicTick, NULL);
+    timerStart(&noteTimer, 0, 0);
 }
@@ -9,11 +9,16 @@
 #include "RTE_Components.h"
 #include CMSIS_device_header
 #include "cmsis_os2.h"
+#include "timer/timer.h"
+#include "trace/trace.h"
 #include "utils/utils.h"
-// For global isMoving variable
-#include "lights/lights.h"
+#include "state/state.h"
 
 #define MUSIC_PIN 31
+#define MARY_NOTE_MS 300
+#define MARY_GAP_MS 25
+#define BIRTHDAY_NOTE_MS 500
+#define BIRTHDAY_GAP_MS 50
 #define C 2294
 #define D_NOTE 2044
 #define E 1820
@@ -39,13 +44,13 @@ extern int mary[27];
 extern int birthday[25];
 
 void initMusic(void);
-void initMusicGPIO(void);
 void initMusicTimer(void);
 
-extern bool isMary;
-
-void music_thread(void *argument);
-
+/**
+ * @brief Starts the timer playing the songs. Call after initTimer() and initMusic().
+ *
+ * The song follows STATE_MARY, restarting from its first note at the next note after a change.
+ */
 void initMusicRTOS(void);
 
 #endif
@@ -11,6 +11,29 @@ typedef struct packet_t {
     unsigned char command;
 } packet_t;
 
+// Motion program commands, see macro/macro.h
+#define COMMAND_MACRO_BEGIN 16
+#define COMMAND_MACRO_DUTY 17
+#define COMMAND_MACRO_TIME 18
+#define COMMAND_MACRO_RUN 19
+#define COMMAND_MACRO_ABORT 20
+
+// Link latency probe, see ping/ping.h
+#define COMMAND_PING 32
+#define COMMAND_PING_REPORT 33
+
+// Flow control from the KL25Z to the ESP32, see flow/flow.h
+#define COMMAND_CREDIT 34
+
+// Battery voltage and motor duty compensation, see battery/battery.h
+#define COMMAND_BATTERY 35
+
+// Runtime settings, see config/config.h
+#define COMMAND_CONFIG 36
+
+// Deadline misses of the real-time threads, see health/health.h
+#define COMMAND_HEALTH 37
+
 typedef enum {
     PACKET_OK = 0,
     PACKET_INCOMPLETE = 1,
@@ -0,0 +1,136 @@
+#include "ping/ping.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+#include "serialize/serialize.h"
+#include "uart/uart.h"
+
+typedef struct ping_stats_t
+{
+    uint32_t echoes;
+    uint32_t reports;
+    uint16_t rttMin; // 0.1ms
+    uint16_t rttMax;
+    uint16_t rttLast;
+    uint32_t rttSum;
+    uint32_t buckets[PING_BUCKET_COUNT];
+    uint32_t turnaroundMax; // SysTimer cycles from decoding a ping to its echo being queued
+    uint32_t turnaroundSum;
+} ping_stats_t;
+
+static const uint16_t bucketEdges[PING_BUCKET_COUNT - 1] = PING_BUCKET_EDGES;
+
+// Only written by receive_packet_thread; the console reads a copy
+static ping_stats_t stats = {.rttMin = UINT16_MAX};
+
+static void echo(const packet_t *packet)
+{
+    uint32_t start = osKernelGetSysTimerCount();
+
+    char buffer[PACKET_SIZE];
+    serialize(buffer, (void *)packet, PACKET_SIZE);
+    uartWrite(UART_PORT1, buffer, PACKET_SIZE);
+
+    uint32_t cycles = osKernelGetSysTimerCount() - start;
+    stats.echoes++;
+    stats.turnaroundSum += cycles;
+    if (cycles > stats.turnaroundMax)
+    {
+        stats.turnaroundMax = cycles;
+    }
+}
+
+static void record(uint16_t rtt)
+{
+    int bucket = 0;
+    while (bucket < PING_BUCKET_COUNT - 1 && rtt >= bucketEdges[bucket])
+    {
+        bucket++;
+    }
+
+    stats.reports++;
+    stats.buckets[bucket]++;
+    stats.rttLast = rtt;
+    stats.rttSum += rtt;
+    if (rtt < stats.rttMin)
+    {
+        stats.rttMin = rtt;
+    }
+    if (rtt > stats.rttMax)
+    {
+        stats.rttMax = rtt;
+    }
+}
+
+bool pingHandlePacket(const packet_t *packet)
+{
+    switch (packet->command)
+    {
+    case COMMAND_PING:
+        echo(packet);
+        return true;
+
+    case COMMAND_PING_REPORT:
+        record((uint16_t)(packet->x | (packet->y << 8)));
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+void pingClearStats(void)
+{
+    osKernelLock();
+    memset(&stats, 0, sizeof(stats));
+    stats.rttMin = UINT16_MAX;
+    osKernelUnlock();
+}
+
+void pingPrintStats(void (*print)(const char *str))
+{
+    char line[80];
+    ping_stats_t copy;
+
+    osKernelLock();
+    copy = stats;
+    osKernelUnlock();
+
+    uint32_t cyclesPerUs = osKernelGetSysTimerFreq() / 1000000;
+    sprintf(line, "echoes %lu, turnaround avg %lu us, max %lu us\r\n", (unsigned long)copy.echoes,
+            (unsigned long)(copy.echoes ? copy.turnaroundSum / copy.echoes / cyclesPerUs : 0),
+            (unsigned long)(copy.turnaroundMax / cyclesPerUs));
+    print(line);
+
+    if (copy.reports == 0)
+    {
+        print("no RTT reports from the ESP32\r\n");
+        return;
+    }
+
+    // RTTs are in 0.1ms units
+    sprintf(line, "rtt %lu reports, last %u.%u ms, min %u.%u ms, avg %lu.%lu ms, max %u.%u ms\r\n",
+            (unsigned long)copy.reports, copy.rttLast / 10, copy.rttLast % 10, copy.rttMin / 10, copy.rttMin % 10,
+            (unsigned long)(copy.rttSum / copy.reports / 10), (unsigned long)(copy.rttSum / copy.reports % 10),
+            copy.rttMax / 10, copy.rttMax % 10);
+    print(line);
+
+    for (int i = 0; i < PING_BUCKET_COUNT; i++)
+    {
+        if (i < PING_BUCKET_COUNT - 1)
+        {
+            sprintf(line, "  < %4u.%u ms %lu\r\n", bucketEdges[i] / 10, bucketEdges[i] % 10,
+                    (unsigned long)copy.buckets[i]);
+        }
+        else
+        {
+            sprintf(line, "  >=%4u.%u ms %lu\r\n", bucketEdges[i - 1] / 10, bucketEdges[i - 1] % 10,
+                    (unsigned long)copy.buckets[i]);
+        }
+        print(line);
+    }
+}
@@ -0,0 +1,46 @@
+/**
+ * @file ping.h
+ * @brief Round-trip latency probe on the ESP32 link.
+ *
+ * The ESP32 periodically sends COMMAND_PING with x: sequence number and
+ * y: low byte of its millis() at sending. receive_packet_thread echoes the
+ * packet back unchanged on UART1 TX as soon as it is decoded, ahead of the
+ * recorder and the packet handler. The ESP32 matches the echo to its send time,
+ * keeps a rolling histogram on its Serial port and reports each round trip back
+ * with COMMAND_PING_REPORT (x, y: RTT in 0.1ms units, low byte first), which is
+ * collected here and printed by the "ping" console command.
+ *
+ * The measured RTT covers both UART transfers, the UART1 ISR, the wake-up of
+ * receive_packet_thread and the ESP32's own loop, so it is the figure to tune
+ * baud rate, queue depth and thread priorities against.
+ */
+#ifndef PING_H
+#define PING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "packet/packet.h"
+
+#define PING_BUCKET_COUNT 10
+
+/**
+ * @brief Upper bucket edges in 0.1ms; the last bucket holds everything above the last edge.
+ */
+#define PING_BUCKET_EDGES {50, 75, 100, 150, 200, 300, 500, 1000, 2000}
+
+/**
+ * @brief Echoes a COMMAND_PING or records a COMMAND_PING_REPORT. Returns false for any other packet.
+ *
+ * Called from receive_packet_thread.
+ */
+bool pingHandlePacket(const packet_t *packet);
+
+/**
+ * @brief Prints the RTT histogram and echo turnaround through print.
+ */
+void pingPrintStats(void (*print)(const char *str));
+
+void pingClearStats(void);
+
+#endif
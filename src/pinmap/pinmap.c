@@ -0,0 +1,85 @@
+#include "pinmap/pinmap.h"
+
+#include <stdio.h>
+
+#define PIN_MASK(pin) (1u << (pin))
+
+// SIM_SCGCn gates of the peripherals, one constant per register
+#define PERIPH_GATE4(resource, scgc, gate, owner) | ((scgc) == 4 ? SIM_SCGC##scgc##_##gate##_MASK : 0u)
+#define PERIPH_GATE5(resource, scgc, gate, owner) | ((scgc) == 5 ? SIM_SCGC##scgc##_##gate##_MASK : 0u)
+#define PERIPH_GATE6(resource, scgc, gate, owner) | ((scgc) == 6 ? SIM_SCGC##scgc##_##gate##_MASK : 0u)
+#define PERIPH_GATE7(resource, scgc, gate, owner) | ((scgc) == 7 ? SIM_SCGC##scgc##_##gate##_MASK : 0u)
+#define SCGC_MASK(n) (0u PERIPHMAP(PERIPH_GATE##n))
+
+// Ports are only clocked if the table uses one of their pins
+#define PIN_ONE(port, name, pin, mux, pcr, dir) +1
+#define PORT_GATE(port) | ((0 PINMAP_##port(PIN_ONE)) > 0 ? SIM_SCGC5_PORT##port##_MASK : 0u)
+
+#define PIN_PCR(port, name, pin, mux, pcr, dir) PORT##port->PCR[pin] = PORT_PCR_MUX(mux) | (pcr);
+#define PIN_OUTPUT(port, name, pin, mux, pcr, dir) | ((dir) != PIN_IN ? PIN_MASK(pin) : 0u)
+#define PIN_HIGH(port, name, pin, mux, pcr, dir) | ((dir) == PIN_OUT_HIGH ? PIN_MASK(pin) : 0u)
+
+// Outputs get their starting level before they are driven
+#define PORT_INIT(port)                                                                                                \
+    PINMAP_##port(PIN_PCR) PT##port->PDOR = 0u PINMAP_##port(PIN_HIGH);                                                \
+    PT##port->PDDR = 0u PINMAP_##port(PIN_OUTPUT);
+
+// The same symbols PINMAP_CLAIM() defines, so a claim on anything in the table fails to link. Pasted here rather
+// than passed on, as resources such as UART0 are also device macros.
+#define PIN_CLAIM(port, name, pin, mux, pcr, dir) const uint8_t pinmapClaim_PT##port##pin = 0;
+#define PORT_CLAIMS(port) PINMAP_##port(PIN_CLAIM)
+#define PERIPH_CLAIM(resource, scgc, gate, owner) const uint8_t pinmapClaim_##resource = 0;
+
+PINMAP_PORTS(PORT_CLAIMS)
+PERIPHMAP(PERIPH_CLAIM)
+
+typedef struct pin_info_t
+{
+    const char *port;
+    uint8_t pin;
+    uint8_t mux;
+    uint8_t dir;
+    const char *name;
+} pin_info_t;
+
+typedef struct periph_info_t
+{
+    const char *resource;
+    const char *owner;
+} periph_info_t;
+
+#define PIN_INFO(port, name, pin, mux, pcr, dir) {#port, (pin), (mux), (dir), #name},
+#define PORT_INFO(port) PINMAP_##port(PIN_INFO)
+#define PERIPH_INFO(resource, scgc, gate, owner) {#resource, owner},
+
+static const pin_info_t pinInfo[] = {PINMAP_PORTS(PORT_INFO)};
+static const periph_info_t periphInfo[] = {PERIPHMAP(PERIPH_INFO)};
+
+void initPins(void)
+{
+    SIM_SCGC4 |= SCGC_MASK(4);
+    SIM_SCGC5 |= SCGC_MASK(5) PINMAP_PORTS(PORT_GATE);
+    SIM_SCGC6 |= SCGC_MASK(6);
+    SIM_SCGC7 |= SCGC_MASK(7);
+    SIM_SOPT2 = (SIM_SOPT2 & ~PINMAP_SOPT2_MASK) | PINMAP_SOPT2;
+
+    PINMAP_PORTS(PORT_INIT)
+}
+
+void pinmapPrint(void (*print)(const char *str))
+{
+    static const char *const dirs[] = {"", " out low", " out high"};
+    char line[64];
+
+    for (size_t i = 0; i < sizeof(pinInfo) / sizeof(pinInfo[0]); i++)
+    {
+        const pin_info_t *p = &pinInfo[i];
+        sprintf(line, "PT%s%-2u alt%u%-9s %s\r\n", p->port, p->pin, p->mux, dirs[p->dir], p->name);
+        print(line);
+    }
+    for (size_t i = 0; i < sizeof(periphInfo) / sizeof(periphInfo[0]); i++)
+    {
+        sprintf(line, "%-10s %s\r\n", periphInfo[i].resource, periphInfo[i].owner);
+        print(line);
+    }
+}
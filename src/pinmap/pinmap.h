@@ -0,0 +1,133 @@
+/**
+ * @file pinmap.h
+ * @brief Every pin and clock-gated peripheral the firmware uses, in one table, and the init generated from it.
+ *
+ * PINMAP_A to PINMAP_E list the pins of each port as
+ * X(port, name, pin, mux, pcr, dir): the mux alternative, any other PCR bits
+ * (pulls, interrupt configuration) and, for GPIO, the direction and the level
+ * an output starts at. PERIPHMAP lists the peripherals as
+ * X(resource, scgc, gate, owner): the SIM_SCGCn register and mask enabling
+ * its clock and the module driving it.
+ *
+ * initPins() is expanded from the tables at compile time. It writes each
+ * SIM_SCGCn that has a gate once, SIM_SOPT2 once, each PCR with a single store
+ * and PDOR and PDDR of each port with one store each; the masks are constant
+ * expressions, so there are no loops and no read-modify-writes of PORT
+ * registers. Modules only configure the peripheral itself and take their pin
+ * numbers from the PIN_<name> constants.
+ *
+ * A pin or resource listed twice is a duplicate enumerator, so the table does
+ * not compile. Code outside the table that takes over a pin or peripheral, such
+ * as the lab exercises in src/labs, declares it with PINMAP_CLAIM(); linked
+ * into the same image as the table, the claim is a multiply defined symbol and
+ * the build fails naming the pin or peripheral.
+ */
+#ifndef PINMAP_H
+#define PINMAP_H
+
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+
+#define PIN_IN 0       // input, or a peripheral function
+#define PIN_OUT_LOW 1  // GPIO output, starts low
+#define PIN_OUT_HIGH 2 // GPIO output, starts high
+
+#define PIN_PULLUP (PORT_PCR_PE_MASK | PORT_PCR_PS_MASK)
+#define PIN_IRQ_RISING PORT_PCR_IRQC(9)
+
+#define PINMAP_A(X)                                                                   \
+    X(A, MOTOR_RIGHT_FORWARD, 1, 3, 0, PIN_IN)    /* TPM2_CH0 */                      \
+    X(A, MOTOR_RIGHT_BACK, 2, 3, 0, PIN_IN)       /* TPM2_CH1 */                      \
+    X(A, ENCODER_LEFT, 12, 1, PIN_PULLUP | PIN_IRQ_RISING, PIN_IN)                    \
+    X(A, ENCODER_RIGHT, 13, 1, PIN_PULLUP | PIN_IRQ_RISING, PIN_IN)
+
+#define PINMAP_B(X)                                                                   \
+    X(B, MOTOR_LEFT_FORWARD, 0, 3, 0, PIN_IN)     /* TPM1_CH0 */                      \
+    X(B, MOTOR_LEFT_BACK, 1, 3, 0, PIN_IN)        /* TPM1_CH1 */                      \
+    X(B, BATTERY_SENSE, 2, 0, 0, PIN_IN)          /* ADC0_SE12 */                     \
+    X(B, RGB_RED, 18, 1, 0, PIN_OUT_HIGH)         /* active low */                    \
+    X(B, RGB_GREEN, 19, 1, 0, PIN_OUT_HIGH)
+
+#define PINMAP_C(X)                                                                   \
+    X(C, GREEN_6, 6, 1, 0, PIN_OUT_LOW)                                               \
+    X(C, GREEN_7, 5, 1, 0, PIN_OUT_LOW)                                               \
+    X(C, GREEN_8, 4, 1, 0, PIN_OUT_LOW)                                               \
+    X(C, GREEN_9, 3, 1, 0, PIN_OUT_LOW)                                               \
+    X(C, RED_LIGHT, 12, 1, 0, PIN_OUT_LOW)
+
+#define PINMAP_D(X)                                                                   \
+    X(D, RGB_BLUE, 1, 1, 0, PIN_OUT_HIGH)                                             \
+    X(D, UART2_RX, 2, 3, 0, PIN_IN)                                                   \
+    X(D, UART2_TX, 3, 3, 0, PIN_IN)                                                   \
+    X(D, UART0_RX, 6, 3, 0, PIN_IN)               /* PTA1/PTA2 are the right motors */ \
+    X(D, UART0_TX, 7, 3, 0, PIN_IN)
+
+#define PINMAP_E(X)                                                                   \
+    X(E, UART1_TX, 0, 3, 0, PIN_IN)               /* to the ESP32 */                  \
+    X(E, UART1_RX, 1, 3, 0, PIN_IN)                                                   \
+    X(E, GREEN_0, 20, 1, 0, PIN_OUT_LOW)                                              \
+    X(E, GREEN_1, 21, 1, 0, PIN_OUT_LOW)                                              \
+    X(E, GREEN_2, 22, 1, 0, PIN_OUT_LOW)                                              \
+    X(E, GREEN_3, 23, 1, 0, PIN_OUT_LOW)                                              \
+    X(E, GREEN_4, 29, 1, 0, PIN_OUT_LOW)                                              \
+    X(E, GREEN_5, 30, 1, 0, PIN_OUT_LOW)                                              \
+    X(E, BUZZER, 31, 3, 0, PIN_IN)                /* TPM0_CH4 */
+
+#define PINMAP_PORTS(X) X(A) X(B) X(C) X(D) X(E)
+
+#define PERIPHMAP(X)                                                                  \
+    X(UART0, 4, UART0, "console")                                                     \
+    X(UART1, 4, UART1, "esp32 link")                                                  \
+    X(UART2, 4, UART2, "spare uart")                                                  \
+    X(LPTMR0, 5, LPTMR, "bam")                                                        \
+    X(DMAMUX_CH0, 6, DMAMUX, "battery")                                               \
+    X(PIT_CH0, 6, PIT, "battery")                                                     \
+    X(PIT_CH1, 6, PIT, "timer")                                                       \
+    X(TPM0, 6, TPM0, "music")                                                         \
+    X(TPM1, 6, TPM1, "motors")                                                        \
+    X(TPM2, 6, TPM2, "motors")                                                        \
+    X(ADC0, 6, ADC0, "battery")                                                       \
+    X(DMA_CH0, 7, DMA, "battery")
+
+// TPM counters and UART0 both run from MCGFLLCLK
+#define PINMAP_SOPT2 (SIM_SOPT2_TPMSRC(1) | SIM_SOPT2_UART0SRC(1))
+#define PINMAP_SOPT2_MASK (SIM_SOPT2_TPMSRC_MASK | SIM_SOPT2_UART0SRC_MASK)
+
+// Pin numbers, PIN_<name>
+#define PINMAP_NUMBER(port, name, pin, mux, pcr, dir) PIN_##name = (pin),
+enum
+{
+    PINMAP_A(PINMAP_NUMBER) PINMAP_B(PINMAP_NUMBER) PINMAP_C(PINMAP_NUMBER) PINMAP_D(PINMAP_NUMBER)
+        PINMAP_E(PINMAP_NUMBER)
+};
+#undef PINMAP_NUMBER
+
+// A pin or peripheral listed twice redeclares one of these
+#define PINMAP_PIN_CLAIM(port, name, pin, mux, pcr, dir) PINMAP_TAKEN_PT##port##pin,
+#define PINMAP_PERIPH_CLAIM(resource, scgc, gate, owner) PINMAP_TAKEN_##resource,
+enum
+{
+    PINMAP_A(PINMAP_PIN_CLAIM) PINMAP_B(PINMAP_PIN_CLAIM) PINMAP_C(PINMAP_PIN_CLAIM) PINMAP_D(PINMAP_PIN_CLAIM)
+        PINMAP_E(PINMAP_PIN_CLAIM) PERIPHMAP(PINMAP_PERIPH_CLAIM)
+};
+#undef PINMAP_PIN_CLAIM
+#undef PINMAP_PERIPH_CLAIM
+
+/**
+ * @brief Claims a pin (PTB18) or a PERIPHMAP resource (TPM1) for code that does not go through the table.
+ */
+#define PINMAP_CLAIM(resource) const uint8_t pinmapClaim_##resource = 0
+
+/**
+ * @brief Gates the port and peripheral clocks and configures every pin. Call first.
+ */
+void initPins(void);
+
+/**
+ * @brief Prints the pin table and the peripheral owners through print.
+ */
+void pinmapPrint(void (*print)(const char *str));
+
+#endif
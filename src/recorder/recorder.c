@@ -0,0 +1,284 @@
+#include "recorder/recorder.h"
+
+#include <stdio.h>
+
+#include "motors/motor_driver.h"
+#include "state/state.h"
+
+#define RECORDER_FLAG_WORK 0x01   // state changed or a batch is ready
+#define RECORDER_FLAG_STOP 0x02   // stop the replay
+#define RECORDER_FLAG_MOVING 0x04 // STATE_MOVING changed
+
+static volatile recorder_state_t state = RECORDER_IDLE;
+static osThreadId_t recorderThreadId;
+static void (*replayHandler)(packet_t *packet, uint32_t stamp);
+
+// Single producer (recorderLog) single consumer (recorder_thread) ring
+static recorder_entry_t ring[RECORDER_RING_SIZE];
+static volatile uint32_t ringHead = 0; // next entry to write to flash
+static volatile uint32_t ringTail = 0; // next free entry
+
+// Logging state, only touched by the receive thread while recording
+static packet_t lastPacket;
+static uint32_t lastTick;
+static bool haveLastPacket;
+
+// Entries in flash and the address of the next one
+static uint32_t entryCount = 0;
+static uint32_t writeAddress = FLASH_RECORDER_START;
+
+// recorderLog overhead in system timer cycles
+static uint32_t logCalls = 0;
+static uint32_t logCyclesTotal = 0;
+static uint32_t logCyclesMax = 0;
+static uint32_t ringOverflows = 0;
+
+static const recorder_entry_t *const recording = (const recorder_entry_t *)FLASH_RECORDER_START;
+
+void recorderLog(packet_t *packet)
+{
+    if (state != RECORDER_RECORDING)
+    {
+        return;
+    }
+
+    uint32_t start = osKernelGetSysTimerCount();
+    uint32_t now = osKernelGetTickCount();
+
+    bool repeat = haveLastPacket && packet->x == lastPacket.x && packet->y == lastPacket.y &&
+                  packet->command == lastPacket.command;
+    if (!repeat)
+    {
+        if (ringTail - ringHead < RECORDER_RING_SIZE)
+        {
+            recorder_entry_t *entry = &ring[ringTail & (RECORDER_RING_SIZE - 1)];
+            uint32_t delta = haveLastPacket ? now - lastTick : 0;
+            entry->delta = (delta > 0xFFFF) ? 0xFFFF : (uint16_t)delta;
+            entry->x = packet->x;
+            entry->y = packet->y;
+            entry->command = packet->command;
+            entry->valid = RECORDER_ENTRY_VALID;
+            entry->reserved = 0xFFFF;
+            ringTail++;
+
+            if (ringTail - ringHead >= RECORDER_BATCH_SIZE)
+            {
+                osThreadFlagsSet(recorderThreadId, RECORDER_FLAG_WORK);
+            }
+        }
+        else
+        {
+            ringOverflows++;
+        }
+
+        lastPacket = *packet;
+        lastTick = now;
+        haveLastPacket = true;
+    }
+
+    uint32_t cycles = osKernelGetSysTimerCount() - start;
+    logCalls++;
+    logCyclesTotal += cycles;
+    if (cycles > logCyclesMax)
+    {
+        logCyclesMax = cycles;
+    }
+}
+
+bool recorderStartRecording(void)
+{
+    if (state != RECORDER_IDLE || stateMoving())
+    {
+        return false;
+    }
+    state = RECORDER_ERASING;
+    osThreadFlagsSet(recorderThreadId, RECORDER_FLAG_WORK);
+    return true;
+}
+
+void recorderStopRecording(void)
+{
+    if (state == RECORDER_RECORDING || state == RECORDER_ERASING)
+    {
+        state = RECORDER_STOPPING;
+        osThreadFlagsSet(recorderThreadId, RECORDER_FLAG_WORK);
+    }
+}
+
+bool recorderStartReplay(void)
+{
+    if (state != RECORDER_IDLE || recording[0].valid != RECORDER_ENTRY_VALID)
+    {
+        return false;
+    }
+    state = RECORDER_REPLAYING;
+    osThreadFlagsSet(recorderThreadId, RECORDER_FLAG_WORK);
+    return true;
+}
+
+void recorderStopReplay(void)
+{
+    if (state == RECORDER_REPLAYING)
+    {
+        osThreadFlagsSet(recorderThreadId, RECORDER_FLAG_STOP);
+    }
+}
+
+bool recorderIsReplaying(void) { return state == RECORDER_REPLAYING; }
+
+bool recorderIsIdle(void) { return state == RECORDER_IDLE; }
+
+// Each sector erase masks interrupts for 14ms or more, so it waits while the robot is moving, or until the
+// recording is stopped
+static void eraseRecording(void)
+{
+    entryCount = 0;
+    writeAddress = FLASH_RECORDER_START;
+    for (uint32_t address = FLASH_RECORDER_START; address < FLASH_RECORDER_START + FLASH_RECORDER_SIZE;
+         address += FLASH_SECTOR_SIZE)
+    {
+        osThreadFlagsClear(RECORDER_FLAG_MOVING);
+        while (stateMoving() && state == RECORDER_ERASING)
+        {
+            osThreadFlagsWait(RECORDER_FLAG_MOVING | RECORDER_FLAG_WORK, osFlagsWaitAny, osWaitForever);
+        }
+        if (state != RECORDER_ERASING)
+        {
+            return;
+        }
+        flashEraseSector(address);
+        // Let the other threads run between sectors
+        osThreadYield();
+    }
+}
+
+// Writes count entries from the ring to flash, one longword at a time so interrupts are only briefly masked
+static void flushEntries(uint32_t count)
+{
+    while (count-- > 0 && ringHead != ringTail)
+    {
+        if (entryCount < RECORDER_CAPACITY)
+        {
+            const uint32_t *words = (const uint32_t *)&ring[ringHead & (RECORDER_RING_SIZE - 1)];
+            flashProgramLongword(writeAddress, words[0]);
+            flashProgramLongword(writeAddress + 4, words[1]);
+            writeAddress += sizeof(recorder_entry_t);
+            entryCount++;
+        }
+        ringHead++;
+    }
+
+    if (entryCount >= RECORDER_CAPACITY && state == RECORDER_RECORDING)
+    {
+        state = RECORDER_STOPPING; // region is full
+    }
+}
+
+// Sleeps for up to timeout ticks; returns true as soon as a stop is requested
+static bool waitForStop(int32_t timeout)
+{
+    uint32_t flags = (timeout > 0) ? osThreadFlagsWait(RECORDER_FLAG_STOP, osFlagsWaitAny, timeout)
+                                   : osThreadFlagsClear(RECORDER_FLAG_STOP);
+    return !(flags & osFlagsError) && (flags & RECORDER_FLAG_STOP);
+}
+
+static void replay(void)
+{
+    uint32_t target = osKernelGetTickCount();
+
+    osThreadFlagsClear(RECORDER_FLAG_STOP);
+    for (uint32_t i = 0; i < RECORDER_CAPACITY && recording[i].valid == RECORDER_ENTRY_VALID; i++)
+    {
+        // Wait relative to the previous entry's due time, not to when it was handled, so timing does not drift
+        target += recording[i].delta;
+        if (waitForStop((int32_t)(target - osKernelGetTickCount())))
+        {
+            break;
+        }
+
+        packet_t packet = {recording[i].x, recording[i].y, recording[i].command};
+        replayHandler(&packet, osKernelGetSysTimerCount());
+    }
+
+    stateSetMoving(false);
+    stop();
+}
+
+void recorder_thread(void *argument)
+{
+    for (;;)
+    {
+        osThreadFlagsWait(RECORDER_FLAG_WORK, osFlagsWaitAny, osWaitForever);
+
+        switch (state)
+        {
+        case RECORDER_ERASING:
+            eraseRecording();
+            ringHead = ringTail;
+            haveLastPacket = false;
+            // recorderStopRecording() may have been called during the erase
+            if (state == RECORDER_ERASING)
+            {
+                state = RECORDER_RECORDING;
+            }
+            else
+            {
+                state = RECORDER_IDLE;
+            }
+            break;
+
+        case RECORDER_RECORDING:
+            flushEntries(RECORDER_BATCH_SIZE);
+            if (state != RECORDER_STOPPING)
+            {
+                break;
+            }
+            // fall through when the region filled up
+
+        case RECORDER_STOPPING:
+            flushEntries(RECORDER_RING_SIZE);
+            state = RECORDER_IDLE;
+            break;
+
+        case RECORDER_REPLAYING:
+            replay();
+            state = RECORDER_IDLE;
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+void recorderPrintStats(void (*print)(const char *str))
+{
+    static const char *const stateNames[] = {"idle", "erasing", "recording", "stopping", "replaying"};
+    char line[80];
+
+    uint32_t entries = 0;
+    while (entries < RECORDER_CAPACITY && recording[entries].valid == RECORDER_ENTRY_VALID)
+    {
+        entries++;
+    }
+
+    sprintf(line, "rec %s, %lu/%lu entries in flash, %lu ring overflows\r\n", stateNames[state],
+            (unsigned long)entries, (unsigned long)RECORDER_CAPACITY, (unsigned long)ringOverflows);
+    print(line);
+    sprintf(line, "log calls %lu, avg %lu cycles, max %lu cycles; flash irq-off max %lu cycles\r\n",
+            (unsigned long)logCalls, (unsigned long)(logCalls ? logCyclesTotal / logCalls : 0),
+            (unsigned long)logCyclesMax, (unsigned long)flashMaxBlockedCycles());
+    print(line);
+}
+
+static void movingChanged(uint32_t changed, void *arg) { osThreadFlagsSet(recorderThreadId, RECORDER_FLAG_MOVING); }
+
+void initRecorderRTOS(void (*handlePacket)(packet_t *packet, uint32_t stamp))
+{
+    replayHandler = handlePacket;
+
+    // Below the real-time threads so flash writes and replay never delay them
+    const osThreadAttr_t attributes = {.name = "recorder", .priority = osPriorityBelowNormal};
+    recorderThreadId = osThreadNew(recorder_thread, NULL, &attributes);
+    stateSubscribe(STATE_CHANGED(MOVING), movingChanged, NULL);
+}
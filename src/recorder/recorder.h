@@ -0,0 +1,93 @@
+/**
+ * @file recorder.h
+ * @brief Records the decoded command stream to flash and replays it at the original timing.
+ *
+ * While recording, every packet decoded by receive_packet_thread is logged with
+ * the number of kernel ticks since the previously logged one. Repeats of the
+ * previous packet are folded into the next delta, so the idle packets the ESP32
+ * sends while the sticks are centred do not fill the flash. Logging only copies
+ * the entry into a RAM ring; recorder_thread runs below normal priority and
+ * writes the ring to the reserved flash region in batches of
+ * RECORDER_BATCH_SIZE entries. The time spent in recorderLog() is measured and
+ * printed by the "rec" console command.
+ *
+ * Starting a recording erases the region first, which masks interrupts for one
+ * sector erase at a time, so recorderStartRecording() refuses while
+ * STATE_MOVING is set, and each sector waits until the robot is stationary
+ * again if it starts moving during the erase.
+ *
+ * Replay feeds the entries back through the same packet handler as live input,
+ * from recorder_thread, at the original timing. Live input other than a drive
+ * command is ignored during a replay, and a drive command stops it.
+ */
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+#include "flash/flash.h"
+#include "packet/packet.h"
+
+#define RECORDER_RING_SIZE 32 // must be a power of 2
+#define RECORDER_BATCH_SIZE 8
+#define RECORDER_ENTRY_VALID 0xA5
+
+typedef struct recorder_entry_t
+{
+    uint16_t delta; // kernel ticks since the previous entry
+    unsigned char x;
+    unsigned char y;
+    unsigned char command;
+    uint8_t valid;     // RECORDER_ENTRY_VALID; erased flash reads 0xFF
+    uint16_t reserved;
+} recorder_entry_t;
+
+#define RECORDER_CAPACITY (FLASH_RECORDER_SIZE / sizeof(recorder_entry_t))
+
+typedef enum
+{
+    RECORDER_IDLE,
+    RECORDER_ERASING,
+    RECORDER_RECORDING,
+    RECORDER_STOPPING,
+    RECORDER_REPLAYING
+} recorder_state_t;
+
+/**
+ * @brief Logs a decoded packet if a recording is in progress. Runs in bounded time.
+ */
+void recorderLog(packet_t *packet);
+
+/**
+ * @brief Erases the region and starts recording. Returns false if busy or the robot is moving.
+ */
+bool recorderStartRecording(void);
+void recorderStopRecording(void);
+
+bool recorderStartReplay(void);
+void recorderStopReplay(void);
+
+bool recorderIsReplaying(void);
+
+/**
+ * @brief True unless a recording or replay is starting, running or finishing.
+ */
+bool recorderIsIdle(void);
+
+/**
+ * @brief Prints the recorder state, entry count and logging overhead through print.
+ */
+void recorderPrintStats(void (*print)(const char *str));
+
+void recorder_thread(void *argument);
+
+/**
+ * @brief Creates recorder_thread. Replayed packets are passed to handlePacket, stamped with the time they are replayed.
+ */
+void initRecorderRTOS(void (*handlePacket)(packet_t *packet, uint32_t stamp));
+
+#endif
@@ -7,54 +7,38 @@
 
 static char _privateBuffer[PACKET_SIZE];
 
-static result_t assemble(char *outputBuffer, const char *inputBuffer, int len) {
-    // byes copied to output buffer so far
-    static int counter = 0;
-
-    // for leftover bytes from previous call
-    static bool leftoverFlag = false;
-    static int bytesLeftover = 0;
-    static char leftoverBuffer[PACKET_SIZE];
+// byes copied to output buffer so far
+static int counter = 0;
 
-    int bytesAvailableInOutputBuffer;
+// bytes received after the last completed packet, taken first on the next call
+// Input beyond what fits is discarded: the receive thread never passes more than PACKET_SIZE bytes per call
+#define LEFTOVER_SIZE PACKET_SIZE
+static int bytesLeftover = 0;
+static char leftoverBuffer[LEFTOVER_SIZE];
 
+static result_t assemble(char *outputBuffer, const char *inputBuffer, int len) {
     // copy leftover bytes from previous call first
-    if (leftoverFlag) {
-        int bytesToCopyToOutput;
-        if (bytesLeftover <= PACKET_SIZE) {  // leftover bytes cannot form a full packet
-            leftoverFlag = false;
-            bytesToCopyToOutput = bytesLeftover;
-        } else {  // leftover bytes can form a full packet
-            bytesToCopyToOutput = PACKET_SIZE;
-        }
-
-        bytesLeftover -= bytesToCopyToOutput;  // remove bytes that were copied from leftover buffer
-
-        // copy leftover bytes to output
-        for (int i = 0; i < bytesToCopyToOutput; i++) {
-            outputBuffer[counter++] = leftoverBuffer[i];
-        }
+    int fromLeftover = 0;
+    while (counter < PACKET_SIZE && fromLeftover < bytesLeftover) {
+        outputBuffer[counter++] = leftoverBuffer[fromLeftover++];
     }
+    bytesLeftover -= fromLeftover;
+    memmove(leftoverBuffer, leftoverBuffer + fromLeftover, bytesLeftover);
 
-    // fill up leftover buffer
-    if (counter + len >= PACKET_SIZE) {  // copied bytes + current stream exceed packet size; there will be bytes leftover
-        bytesAvailableInOutputBuffer = PACKET_SIZE - counter;
-        leftoverFlag = true;
-        int bytesToCopyToLeftover = len - bytesAvailableInOutputBuffer;
-
-        // copy leftover bytes from output to leftover buffer after entries that were already inside
-        for (int i = 0; i < bytesToCopyToLeftover; i++) {
-            leftoverBuffer[bytesLeftover + i] = inputBuffer[bytesAvailableInOutputBuffer + i];
-        }
-
-        bytesLeftover += bytesToCopyToLeftover; // add bytes that were copied to leftover buffer
-    } else {    // there will be no bytes leftover after copying input to output
-        bytesAvailableInOutputBuffer = len;
+    // copy input bytes to output
+    int fromInput = 0;
+    while (counter < PACKET_SIZE && fromInput < len) {
+        outputBuffer[counter++] = inputBuffer[fromInput++];
     }
 
-    // copy input bytes to output
-    for (int i = 0; i < bytesAvailableInOutputBuffer; i++) {
-        outputBuffer[counter++] = inputBuffer[i];
+    // keep the rest of the input for the next call, as much as fits
+    int toLeftover = len - fromInput;
+    if (toLeftover > LEFTOVER_SIZE - bytesLeftover) {
+        toLeftover = LEFTOVER_SIZE - bytesLeftover;
+    }
+    if (toLeftover > 0) {
+        memcpy(leftoverBuffer + bytesLeftover, inputBuffer + fromInput, toLeftover);
+        bytesLeftover += toLeftover;
     }
 
     if (counter == PACKET_SIZE) {
@@ -74,6 +58,28 @@ result_t deserialize(const char *buffer, int len, void *output) {
     return result;
 }
 
+void deserializeReset(void) {
+    counter = 0;
+    bytesLeftover = 0;
+}
+
+result_t receivePacket(int (*read)(char *buffer, int len, bool *resync), packet_t *packet) {
+    char buffer[PACKET_SIZE] = {0};
+    bool resync = false;
+    int count = read(buffer, PACKET_SIZE, &resync);
+
+    result_t result = PACKET_INCOMPLETE;
+    if (count > 0) {
+        result = deserialize(buffer, count, packet);
+    }
+
+    if (resync) {
+        // Drop the partial packet left over from before a receive error
+        deserializeReset();
+    }
+    return result;
+}
+
 int serialize(char *buffer, void *dataStructure, size_t size) {
     memcpy(buffer, dataStructure, size);
     return size;
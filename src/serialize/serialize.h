@@ -1,9 +1,23 @@
 #ifndef SERIALIZE_H
 #define SERIALIZE_H
 
+#include <stdbool.h>
+
 #include "packet/packet.h"
 
 int serialize(char *buffer, void *dataStructure, size_t size);
 
 result_t deserialize(const char *buffer, int len, void *output);
+
+// Discards any partially assembled packet so the next byte starts a new one
+void deserializeReset(void);
+
+/*
+ * Body of a packet receiving thread on a byte stream: takes up to PACKET_SIZE bytes through read and
+ * assembles them, dropping the partial packet when read reports a resync point.
+ * read has the semantics of uartRead(); the host tools under tools/ pass a ring of their own.
+ * UART1 queues whole packets instead (see uart/uart_rx.h); this is the byte ring it replaced,
+ * kept so tools/uart_stress.c can compare the two.
+ */
+result_t receivePacket(int (*read)(char *buffer, int len, bool *resync), packet_t *packet);
 #endif
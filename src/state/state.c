@@ -0,0 +1,100 @@
+#include "state/state.h"
+
+#include <stddef.h>
+#include <string.h>
+
+typedef struct subscriber_t
+{
+    uint32_t mask;
+    state_notify_t notify;
+    void *arg;
+} subscriber_t;
+
+#define FIELD_OFFSET(ID, member, type) [STATE_##ID] = offsetof(robot_state_t, member),
+static const uint8_t offsets[STATE_FIELD_COUNT] = {STATE_FIELDS(FIELD_OFFSET)};
+
+#define FIELD_SIZE(ID, member, type) [STATE_##ID] = sizeof(type),
+static const uint8_t sizes[STATE_FIELD_COUNT] = {STATE_FIELDS(FIELD_SIZE)};
+
+static robot_state_t state = {.moving = false, .mary = true};
+static volatile uint32_t sequence; // odd while a write is in progress
+
+static subscriber_t subscribers[STATE_SUBSCRIBERS_MAX];
+static int subscriberCount;
+
+void stateRead(robot_state_t *snapshot)
+{
+    uint32_t before;
+
+    do
+    {
+        before = sequence;
+        __DMB();
+        memcpy(snapshot, &state, sizeof(*snapshot));
+        __DMB();
+    } while ((before & 1) || before != sequence);
+}
+
+bool stateMoving(void)
+{
+    robot_state_t snapshot;
+    stateRead(&snapshot);
+    return snapshot.moving;
+}
+
+bool stateMary(void)
+{
+    robot_state_t snapshot;
+    stateRead(&snapshot);
+    return snapshot.mary;
+}
+
+static void publish(state_field_t field, const void *value)
+{
+    uint8_t *member = (uint8_t *)&state + offsets[field];
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool changed = memcmp(member, value, sizes[field]) != 0;
+    if (changed)
+    {
+        sequence++;
+        __DMB();
+        memcpy(member, value, sizes[field]);
+        __DMB();
+        sequence++;
+    }
+    __set_PRIMASK(primask);
+
+    if (!changed)
+    {
+        return;
+    }
+    uint32_t bit = 1u << field;
+    for (int i = 0; i < subscriberCount; i++)
+    {
+        if (subscribers[i].mask & bit)
+        {
+            subscribers[i].notify(bit, subscribers[i].arg);
+        }
+    }
+}
+
+void stateSetMoving(bool moving) { publish(STATE_MOVING, &moving); }
+
+void stateSetMary(bool mary) { publish(STATE_MARY, &mary); }
+
+bool stateSubscribe(uint32_t mask, state_notify_t notify, void *arg)
+{
+    if (subscriberCount == STATE_SUBSCRIBERS_MAX)
+    {
+        return false;
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    subscribers[subscriberCount] = (subscriber_t){mask, notify, arg};
+    subscriberCount++;
+    __set_PRIMASK(primask);
+    return true;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file state.h
+ * @brief Robot state shared between threads and interrupts, published under a sequence lock.
+ *
+ * STATE_FIELDS lists the fields as X(ID, member, type). Every write goes
+ * through a stateSet function, which makes the sequence count odd, stores the
+ * field, and makes it even again. Interrupts stay masked for the whole write,
+ * so writers in threads and interrupts never interleave. Readers take no
+ * lock. stateRead() copies the whole structure and tries again if the count
+ * was odd or changed meanwhile. A snapshot is therefore always consistent,
+ * and costs one copy unless a write lands in the middle of it.
+ *
+ * A write that changes a field calls the subscribers whose mask has the
+ * field's STATE_CHANGED() bit, once the field is published. A write that
+ * leaves the value as it was calls nobody, so subscribers are only woken by
+ * real changes. They run in the writer's context, which may be an interrupt
+ * or a section with interrupts masked. Like timer callbacks, they must be
+ * short and ISR-safe: timerStart(), osThreadFlagsSet() and the like.
+ */
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+
+#define STATE_FIELDS(X)                                                                                                \
+    X(MOVING, moving, bool) /* a drive command, motion program or replay is driving the motors */                      \
+    X(MARY, mary, bool)     /* song playing: Mary Had a Little Lamb, or else Happy Birthday */
+
+#define STATE_SUBSCRIBERS_MAX 4
+
+#define STATE_ID(ID, member, type) STATE_##ID,
+typedef enum
+{
+    STATE_FIELDS(STATE_ID) STATE_FIELD_COUNT
+} state_field_t;
+#undef STATE_ID
+
+#define STATE_CHANGED(ID) (1u << STATE_##ID)
+
+#define STATE_MEMBER(ID, member, type) type member;
+typedef struct robot_state_t
+{
+    STATE_FIELDS(STATE_MEMBER)
+} robot_state_t;
+#undef STATE_MEMBER
+
+/**
+ * @brief Called with the STATE_CHANGED() bits of the fields a write changed, among those subscribed to.
+ */
+typedef void (*state_notify_t)(uint32_t changed, void *arg);
+
+/**
+ * @brief Copies a consistent snapshot of the state. Safe from any context.
+ */
+void stateRead(robot_state_t *snapshot);
+
+bool stateMoving(void);
+bool stateMary(void);
+
+/**
+ * @brief Publish one field and notify its subscribers if it changed. Safe from any context.
+ */
+void stateSetMoving(bool moving);
+void stateSetMary(bool mary);
+
+/**
+ * @brief Calls notify with arg whenever a write changes a field in mask. Returns false if the table is full.
+ *
+ * Call from the modules' init functions.
+ */
+bool stateSubscribe(uint32_t mask, state_notify_t notify, void *arg);
+
+#endif
@@ -0,0 +1,380 @@
+#include "timer/timer.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define PIT_MIN_CYCLES 24 // bus cycles; 1us, so a deadline that has just passed still interrupts
+
+#define BENCH_PERIOD_MS 10
+#define BENCH_COUNT 100
+
+static sw_timer_t *slots[TIMER_SLOTS];
+
+// Slot tick processed next; every deadline before it has fired
+static uint32_t wheelTick;
+static uint32_t activeCount;
+
+// PIT channel 1 is running for armedAt
+static bool armed;
+static uint32_t armedAt;
+
+// Set while PIT_IRQHandler fires callbacks, which then leave arming to it
+static bool dispatching;
+
+static uint32_t cyclesPerUs;
+static timer_stats_t timerStats;
+
+// Wrap-safe comparisons of SysTimer values and slot ticks
+static bool isBefore(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+static bool isTickBefore(uint32_t a, uint32_t b) { return (int16_t)(a - b) < 0; }
+
+static uint32_t tickOf(uint32_t cycles) { return (cycles >> TIMER_TICK_SHIFT) & 0xFFFF; }
+
+void initTimer(void)
+{
+    // Enable the PIT module and stop the timers while debugging
+    PIT_MCR = PIT_MCR_FRZ_MASK;
+    PIT_TCTRL0 = 0;
+    PIT_TCTRL1 = 0;
+    PIT_TFLG0 = PIT_TFLG_TIF_MASK;
+    PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+
+    cyclesPerUs = osKernelGetSysTimerFreq() / 1000000;
+    if (cyclesPerUs == 0)
+    {
+        // The kernel is not initialised yet; the SysTimer runs at the core clock
+        cyclesPerUs = DEFAULT_SYSTEM_CLOCK / 1000000;
+    }
+
+    NVIC_SetPriority(PIT_IRQn, TIMER_INT_PRIO);
+    NVIC_ClearPendingIRQ(PIT_IRQn);
+    NVIC_EnableIRQ(PIT_IRQn);
+}
+
+uint32_t timerCycles(uint32_t us) { return us * cyclesPerUs; }
+
+// Loads PIT channel 1 to interrupt at deadline. The PIT counts the bus clock, half the SysTimer's.
+static void arm(uint32_t deadline)
+{
+    uint32_t now = osKernelGetSysTimerCount();
+    uint32_t load = isBefore(now, deadline) ? (deadline - now + 1) / 2 : 0;
+
+    if (load < PIT_MIN_CYCLES)
+    {
+        load = PIT_MIN_CYCLES;
+    }
+    PIT_TCTRL1 = 0;
+    PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+    PIT_LDVAL1 = load - 1;
+    PIT_TCTRL1 = PIT_TCTRL_TIE_MASK | PIT_TCTRL_TEN_MASK;
+    armed = true;
+    armedAt = deadline;
+}
+
+static void disarm(void)
+{
+    PIT_TCTRL1 = 0;
+    PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+    armed = false;
+}
+
+static void unlink(sw_timer_t *timer)
+{
+    *timer->link = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->link = timer->link;
+    }
+    timer->link = NULL;
+    activeCount--;
+}
+
+static void insert(sw_timer_t *timer)
+{
+    if (activeCount == 0)
+    {
+        // Every slot is empty, so the wheel can jump to the present
+        wheelTick = tickOf(osKernelGetSysTimerCount());
+    }
+
+    // Overdue timers go into the slot processed next
+    uint32_t tick = tickOf(timer->deadline);
+    if (isTickBefore(tick, wheelTick))
+    {
+        tick = wheelTick;
+    }
+
+    sw_timer_t **head = &slots[tick & (TIMER_SLOTS - 1)];
+    timer->next = *head;
+    timer->link = head;
+    if (*head != NULL)
+    {
+        (*head)->link = &timer->next;
+    }
+    *head = timer;
+    activeCount++;
+
+    if (!dispatching && (!armed || isBefore(timer->deadline, armedAt)))
+    {
+        arm(timer->deadline);
+    }
+}
+
+void timerSetup(sw_timer_t *timer, timer_callback_t callback, void *arg)
+{
+    timer->next = NULL;
+    timer->link = NULL;
+    timer->deadline = 0;
+    timer->period = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+void timerStart(sw_timer_t *timer, uint32_t delayUs, uint32_t periodUs)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (timer->link != NULL)
+    {
+        unlink(timer);
+    }
+    timer->deadline = osKernelGetSysTimerCount() + timerCycles(delayUs);
+    timer->period = timerCycles(periodUs);
+    insert(timer);
+    __set_PRIMASK(primask);
+}
+
+void timerStartAt(sw_timer_t *timer, uint32_t deadline)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (timer->link != NULL)
+    {
+        unlink(timer);
+    }
+    timer->deadline = deadline;
+    timer->period = 0;
+    insert(timer);
+    __set_PRIMASK(primask);
+}
+
+void timerCancel(sw_timer_t *timer)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (timer->link != NULL)
+    {
+        unlink(timer);
+        if (activeCount == 0 && !dispatching)
+        {
+            disarm();
+        }
+    }
+    __set_PRIMASK(primask);
+}
+
+bool timerIsActive(sw_timer_t *timer) { return timer->link != NULL; }
+
+// Unlinks and returns a due timer from the slot at wheelTick, or NULL if there is none
+static sw_timer_t *takeDue(uint32_t now)
+{
+    for (sw_timer_t *timer = slots[wheelTick & (TIMER_SLOTS - 1)]; timer != NULL; timer = timer->next)
+    {
+        uint32_t tick = tickOf(timer->deadline);
+        // Timers from later turns of the wheel share the slot; overdue ones were put in it late
+        if (isTickBefore(tick, wheelTick) || (tick == wheelTick && !isBefore(now, timer->deadline)))
+        {
+            unlink(timer);
+            return timer;
+        }
+    }
+    return NULL;
+}
+
+static void fire(sw_timer_t *timer, uint32_t now)
+{
+    uint32_t late = now - timer->deadline;
+
+    timerStats.fired++;
+    timerStats.lateTotal += late;
+    if (late > timerStats.lateMax)
+    {
+        timerStats.lateMax = late;
+    }
+
+    // Reschedule first so the callback can cancel or restart its own timer
+    if (timer->period != 0)
+    {
+        timer->deadline += timer->period;
+        insert(timer);
+    }
+    timer->callback(timer->arg);
+}
+
+// Earliest deadline left in the slot at wheelTick, or the start of the next slot
+static uint32_t nextDeadline(void)
+{
+    uint32_t next = (wheelTick + 1) << TIMER_TICK_SHIFT;
+    bool found = false;
+
+    for (sw_timer_t *timer = slots[wheelTick & (TIMER_SLOTS - 1)]; timer != NULL; timer = timer->next)
+    {
+        if (tickOf(timer->deadline) == wheelTick && (!found || isBefore(timer->deadline, next)))
+        {
+            next = timer->deadline;
+            found = true;
+        }
+    }
+    return next;
+}
+
+void PIT_IRQHandler(void)
+{
+    NVIC_ClearPendingIRQ(PIT_IRQn);
+
+    if (!(PIT_TFLG1 & PIT_TFLG_TIF_MASK))
+    {
+        return;
+    }
+    PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+
+    uint32_t now = osKernelGetSysTimerCount();
+    uint32_t nowTick = tickOf(now);
+
+    // One timer at a time, so a callback can cancel any timer that has not fired yet
+    dispatching = true;
+    for (;;)
+    {
+        sw_timer_t *timer = takeDue(now);
+        if (timer != NULL)
+        {
+            fire(timer, now);
+        }
+        else if (isTickBefore(wheelTick, nowTick))
+        {
+            // Every timer left in a slot already passed belongs to a later turn
+            wheelTick = (wheelTick + 1) & 0xFFFF;
+        }
+        else
+        {
+            break;
+        }
+    }
+    dispatching = false;
+
+    if (activeCount == 0)
+    {
+        disarm();
+        return;
+    }
+
+    // Callbacks may have started timers that are due already; they are in the slot at wheelTick
+    arm(nextDeadline());
+}
+
+void timerClearStats(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(&timerStats, 0, sizeof(timerStats));
+    __set_PRIMASK(primask);
+}
+
+void timerPrintStats(void (*print)(const char *str))
+{
+    char line[96];
+    timer_stats_t stats;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stats = timerStats;
+    uint32_t active = activeCount;
+    __set_PRIMASK(primask);
+
+    uint32_t lateAvg = (stats.fired > 0) ? (uint32_t)(stats.lateTotal / stats.fired) : 0;
+    sprintf(line, "%lu active, %lu fired, late avg %lu us, max %lu us\r\n", (unsigned long)active,
+            (unsigned long)stats.fired, (unsigned long)(lateAvg / cyclesPerUs),
+            (unsigned long)(stats.lateMax / cyclesPerUs));
+    print(line);
+}
+
+typedef struct interval_stats_t
+{
+    bool started;
+    uint32_t last;
+    uint32_t count; // intervals measured
+    uint32_t min, max;
+    uint64_t total;
+} interval_stats_t;
+
+static void intervalInit(interval_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->min = UINT32_MAX;
+}
+
+static void intervalRecord(interval_stats_t *stats, uint32_t now)
+{
+    // The first call only sets the reference point
+    if (stats->started)
+    {
+        uint32_t interval = now - stats->last;
+        stats->total += interval;
+        if (interval < stats->min)
+        {
+            stats->min = interval;
+        }
+        if (interval > stats->max)
+        {
+            stats->max = interval;
+        }
+        stats->count++;
+    }
+    stats->started = true;
+    stats->last = now;
+}
+
+static void intervalPrint(void (*print)(const char *str), const char *name, interval_stats_t *stats)
+{
+    char line[96];
+
+    if (stats->count == 0)
+    {
+        return;
+    }
+    uint32_t avg = (uint32_t)(stats->total / stats->count);
+    sprintf(line, "%s: min %lu us, avg %lu us, max %lu us, jitter %lu us\r\n", name,
+            (unsigned long)(stats->min / cyclesPerUs), (unsigned long)(avg / cyclesPerUs),
+            (unsigned long)(stats->max / cyclesPerUs), (unsigned long)((stats->max - stats->min) / cyclesPerUs));
+    print(line);
+}
+
+static interval_stats_t benchTimerStats;
+
+static void benchCallback(void *arg) { intervalRecord(&benchTimerStats, osKernelGetSysTimerCount()); }
+
+void timerBenchmark(void (*print)(const char *str))
+{
+    sw_timer_t benchTimer;
+    interval_stats_t delayStats;
+    char line[64];
+
+    intervalInit(&benchTimerStats);
+    intervalInit(&delayStats);
+
+    // Both run at once, so they see the same load from the other threads and interrupts
+    timerSetup(&benchTimer, benchCallback, NULL);
+    timerStart(&benchTimer, BENCH_PERIOD_MS * 1000, BENCH_PERIOD_MS * 1000);
+    for (int i = 0; i <= BENCH_COUNT; i++)
+    {
+        osDelay(BENCH_PERIOD_MS);
+        intervalRecord(&delayStats, osKernelGetSysTimerCount());
+    }
+    timerCancel(&benchTimer);
+
+    sprintf(line, "%d intervals of %d ms\r\n", BENCH_COUNT, BENCH_PERIOD_MS);
+    print(line);
+    intervalPrint(print, "osDelay", &delayStats);
+    intervalPrint(print, "timer  ", &benchTimerStats);
+}
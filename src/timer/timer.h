@@ -0,0 +1,102 @@
+/**
+ * @file timer.h
+ * @brief Software timers with microsecond resolution, driven by PIT channel 1.
+ *
+ * Timers are kept in a hashed timing wheel of TIMER_SLOTS slots, each covering
+ * 2^TIMER_TICK_SHIFT SysTimer cycles (about 1.4ms). A timer goes into the slot
+ * its deadline falls in and is unlinked from it to cancel, so starting and
+ * cancelling take constant time whatever the number of timers. Deadlines more
+ * than a turn of the wheel away share a slot with nearer ones and are skipped
+ * until their turn comes round.
+ *
+ * PIT channel 1 is not run at a fixed tick. It is loaded for the earliest
+ * deadline in the current slot or, if there is none, for the start of the next
+ * slot, and stopped while no timer is active. Deadlines are compared with
+ * osKernelGetSysTimerCount(), so a timer fires within the interrupt latency of
+ * its deadline rather than on the next 1ms RTOS tick.
+ *
+ * Callbacks run in PIT_IRQHandler at TIMER_INT_PRIO and must be short and
+ * ISR-safe: GPIO and timer writes, osEventFlagsSet(), osSemaphoreRelease() and
+ * the like. timerStart(), timerStartAt() and timerCancel() may be called from
+ * threads, interrupts and callbacks, including on the timer that is firing.
+ * Periodic timers are rescheduled from their previous deadline, so they do not
+ * drift by the time taken to service them.
+ *
+ * The "timer" console command prints how late callbacks ran; "timer bench"
+ * measures a periodic timer against an osDelay() loop.
+ */
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+
+#define TIMER_SLOTS 64 // power of two
+#define TIMER_TICK_SHIFT 16
+#define TIMER_INT_PRIO 64
+#define TIMER_MAX_US 40000000 // deadlines must be less than half the SysTimer wrap (89s) away
+
+typedef void (*timer_callback_t)(void *arg);
+
+typedef struct sw_timer_t
+{
+    struct sw_timer_t *next;
+    struct sw_timer_t **link; // the pointer to this timer in its slot, NULL when inactive
+    uint32_t deadline;        // SysTimer cycles
+    uint32_t period;          // SysTimer cycles, 0 for one-shot
+    timer_callback_t callback;
+    void *arg;
+} sw_timer_t;
+
+typedef struct timer_stats_t
+{
+    uint32_t fired;
+    uint32_t lateMax; // SysTimer cycles between deadline and callback
+    uint64_t lateTotal;
+} timer_stats_t;
+
+/**
+ * @brief Enables the PIT and its interrupt. Call after initPins() and before starting any timer.
+ */
+void initTimer(void);
+
+void timerSetup(sw_timer_t *timer, timer_callback_t callback, void *arg);
+
+/**
+ * @brief (Re)starts timer to fire in delayUs, then every periodUs unless that is 0.
+ */
+void timerStart(sw_timer_t *timer, uint32_t delayUs, uint32_t periodUs);
+
+/**
+ * @brief (Re)starts timer as a one-shot at an absolute osKernelGetSysTimerCount() value.
+ *
+ * Deadlines already passed fire straight away. Chaining deadlines this way keeps
+ * a sequence of intervals exact.
+ */
+void timerStartAt(sw_timer_t *timer, uint32_t deadline);
+
+void timerCancel(sw_timer_t *timer);
+
+bool timerIsActive(sw_timer_t *timer);
+
+/**
+ * @brief Converts microseconds to SysTimer cycles.
+ */
+uint32_t timerCycles(uint32_t us);
+
+void timerPrintStats(void (*print)(const char *str));
+
+void timerClearStats(void);
+
+/**
+ * @brief Compares a periodic timer with an osDelay() loop for about a second and prints both.
+ *
+ * Blocks the calling thread while it runs.
+ */
+void timerBenchmark(void (*print)(const char *str));
+
+#endif
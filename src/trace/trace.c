@@ -0,0 +1,51 @@
+#include "trace/trace.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+static trace_record_t traceBuffer[TRACE_SIZE];
+static volatile uint32_t traceCount = 0; // total records written; next slot is traceCount % TRACE_SIZE
+static volatile bool tracePaused = false;
+
+void traceEvent(uint8_t event, uint8_t arg8, uint16_t arg16)
+{
+    if (tracePaused)
+    {
+        return;
+    }
+
+    // Reserve a slot and take the timestamp together so slot order matches time order
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    trace_record_t *record = &traceBuffer[traceCount & (TRACE_SIZE - 1)];
+    traceCount++;
+    record->timestamp = osKernelGetSysTimerCount();
+    __set_PRIMASK(primask);
+
+    record->event = event;
+    record->arg8 = arg8;
+    record->arg16 = arg16;
+}
+
+void traceDump(void (*print)(const char *str))
+{
+    char line[32];
+
+    tracePaused = true;
+
+    uint32_t count = traceCount;
+    uint32_t first = (count > TRACE_SIZE) ? count - TRACE_SIZE : 0;
+
+    sprintf(line, "TRACE BEGIN %lx\r\n", (unsigned long)osKernelGetSysTimerFreq());
+    print(line);
+    for (uint32_t i = first; i < count; i++)
+    {
+        trace_record_t *record = &traceBuffer[i & (TRACE_SIZE - 1)];
+        sprintf(line, "%08lx %02x %02x %04x\r\n", (unsigned long)record->timestamp, record->event, record->arg8,
+                record->arg16);
+        print(line);
+    }
+    print("TRACE END\r\n");
+
+    tracePaused = false;
+}
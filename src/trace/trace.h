@@ -0,0 +1,86 @@
+/**
+ * @file trace.h
+ * @brief In-RAM event trace ring for diagnosing stutters and scheduling issues.
+ *
+ * Every trace point appends an 8-byte record (timestamp, event id and two
+ * arguments) to a fixed ring in RAM. Records can be written from ISRs and
+ * threads alike; the only shared step is reserving a slot, which takes a few
+ * cycles with interrupts masked since the Cortex-M0+ has no exclusive access
+ * instructions. The ring is dumped as text over UART0 with the "trace" console
+ * command and converted with tools/trace2chrome.py for viewing in about:tracing.
+ *
+ * Tracing is compiled out unless TRACE_ENABLED is defined to 1, e.g. by adding
+ * TRACE_ENABLED=1 to the C/C++ preprocessor defines in uKeilVision.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cmsis_os2.h"
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+
+/** @brief Number of records in the ring. Must be a power of 2. */
+#define TRACE_SIZE 128
+
+/*
+ * Event ids. Keep in sync with EVENTS in tools/trace2chrome.py.
+ */
+typedef enum
+{
+    TRACE_UART1_ISR_ENTER = 0, // arg8: UART1_S1
+    TRACE_UART1_ISR_EXIT,      // arg16: UART1 packets queued
+    TRACE_UART_RX_RELEASE,     // arg8: port, arg16: receive ring size
+    TRACE_PACKET_WAKE,         // arg16: receive1Q size
+    TRACE_PACKET_DECODED,      // arg8: command
+    TRACE_MOTOR_MSG_PUT,       // arg16: motorMsg count after the put
+    TRACE_MOTOR_MSG_GET,       // arg16: motorMsg count after the get
+    TRACE_TPM_WRITE,           // arg8: left speed, arg16: right speed
+    TRACE_GREEN_LIGHTS_WAKE,   // arg8: lit LED index
+    TRACE_RED_LIGHT_WAKE,      // arg8: 1 if turned on
+    TRACE_MUSIC_NOTE,          // arg8: note index, arg16: TPM0 MOD
+    TRACE_DEADLINE_MISS,       // arg8: health_task_t, arg16: its deadline in ms
+    TRACE_DEADLINE_RECOVER,    // arg8: health_task_t, arg16: overrun in ms
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+typedef struct trace_record_t
+{
+    uint32_t timestamp; // osKernelGetSysTimerCount() at the time of the event
+    uint8_t event;
+    uint8_t arg8;
+    uint16_t arg16;
+} trace_record_t;
+
+#if TRACE_ENABLED
+#define TRACE(event, arg8, arg16) traceEvent((event), (arg8), (arg16))
+#else
+#define TRACE(event, arg8, arg16) ((void)0)
+#endif
+
+/**
+ * @brief Appends a record to the trace ring, overwriting the oldest one.
+ *
+ * Safe to call from both thread and interrupt context. Use the TRACE macro
+ * instead so the call disappears when tracing is disabled.
+ */
+void traceEvent(uint8_t event, uint8_t arg8, uint16_t arg16);
+
+/**
+ * @brief Writes the ring, oldest record first, as text lines through print.
+ *
+ * Recording is paused for the duration of the dump so the output is a
+ * consistent snapshot. Format (all fields hex):
+ *   TRACE BEGIN <timer frequency in Hz>
+ *   <timestamp> <event> <arg8> <arg16>
+ *   ...
+ *   TRACE END
+ */
+void traceDump(void (*print)(const char *str));
+
+#endif
@@ -0,0 +1,405 @@
+#include "uart/uart.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static uart_t uartPorts[UART_PORT_COUNT] = {
+    [UART_PORT0] = {.regs = (UART_Type *)UART0,
+                    .irq = UART0_IRQn,
+                    .clockHz = DEFAULT_SYSTEM_CLOCK, // MCGFLLCLK, not divided down to the bus clock
+                    .lowPower = true},
+    [UART_PORT1] = {.regs = UART1,
+                    .irq = UART1_IRQn,
+                    .clockHz = DEFAULT_SYSTEM_CLOCK / 2, // bus clock
+                    .lowPower = false},
+    [UART_PORT2] = {.regs = UART2,
+                    .irq = UART2_IRQn,
+                    .clockHz = DEFAULT_SYSTEM_CLOCK / 2, // bus clock
+                    .lowPower = false},
+};
+
+void uartSetBaudRate(uart_port_t port, uint32_t baudRate)
+{
+    uart_t *uart = &uartPorts[port];
+    uint8_t enabled = uart->regs->C2 & (UART_C2_TE_MASK | UART_C2_RE_MASK);
+
+    // baud rate can only be changed while the transmitter and receiver are disabled
+    uart->regs->C2 &= ~(UART_C2_TE_MASK | UART_C2_RE_MASK);
+
+    uint32_t divisor = uart->clockHz / (baudRate * 16);
+    uart->regs->BDH = UART_BDH_SBR(divisor >> 8);
+    uart->regs->BDL = UART_BDL_SBR(divisor);
+
+    uart->regs->C2 |= enabled;
+}
+
+void uartInit(uart_port_t port, uint32_t baudRate)
+{
+    uart_t *uart = &uartPorts[port];
+
+    // initPins() gates the clock, selects the UART0 clock source and muxes the pins
+    // disable the port while it is configured
+    uart->regs->C2 &= ~(UART_C2_TE_MASK | UART_C2_RE_MASK);
+
+    uartSetBaudRate(port, baudRate);
+
+    uart->regs->C1 = 0;
+    uart->regs->S2 = 0;
+    uart->regs->C3 = UART_C3_ORIE_MASK | UART_C3_NEIE_MASK | UART_C3_FEIE_MASK | UART_C3_PEIE_MASK;
+
+    uartRxInit(&uart->rx);
+    Q_init(&uart->tx);
+
+    // enable the port
+    uart->regs->C2 |= UART_C2_TE_MASK | UART_C2_RE_MASK;
+
+    NVIC_SetPriority(uart->irq, UART_INT_PRIO);
+    NVIC_ClearPendingIRQ(uart->irq);
+    NVIC_EnableIRQ(uart->irq);
+
+    uart->regs->C2 |= UART_C2_RIE_MASK;
+}
+
+void uartSetReceiveSemaphore(uart_port_t port, osSemaphoreId_t semaphore, uint32_t threshold)
+{
+    uartPorts[port].rxThreshold = threshold;
+    uartPorts[port].rxSemaphore = semaphore;
+}
+
+void uartSetFramed(uart_port_t port, frameq_t *frames, uart_frame_hook_t hook)
+{
+    uartRxSetFrames(&uartPorts[port].rx, frames);
+    uartPorts[port].frameHook = hook;
+}
+
+void uartSetAddress(uart_port_t port, uint8_t address)
+{
+    uart_t *uart = &uartPorts[port];
+    UART_Type *regs = uart->regs;
+
+    // UART0 has no address-mark wakeup in this driver, and only packets have addresses
+    if (uart->lowPower || uart->rx.frames == NULL || address > UART_ADDRESS_MAX)
+    {
+        return;
+    }
+
+    NVIC_DisableIRQ(uart->irq);
+    uint8_t enabled = regs->C2 & (UART_C2_TE_MASK | UART_C2_RE_MASK);
+    regs->C2 &= ~(UART_C2_TE_MASK | UART_C2_RE_MASK | UART_C2_ILIE_MASK);
+
+    uart->address = address;
+    uart->txGrant = 0;
+    uart->granted = false;
+    uartRxSetAddress(&uart->rx, address);
+    if (address != 0)
+    {
+        regs->C1 |= UART_C1_M_MASK | UART_C1_WAKE_MASK;
+        regs->C2 |= UART_C2_RWU_MASK; // asleep until the first address character
+    }
+    else
+    {
+        regs->C2 &= ~UART_C2_RWU_MASK;
+        regs->C1 &= ~(UART_C1_M_MASK | UART_C1_WAKE_MASK);
+        regs->C3 &= ~UART_C3_T8_MASK;
+    }
+
+    regs->C2 |= enabled;
+    NVIC_EnableIRQ(uart->irq);
+    // Anything held back for a grant goes out straight away on a point-to-point link
+    regs->C2 |= UART_C2_TIE_MASK;
+}
+
+void uartWrite(uart_port_t port, const void *buffer, size_t len)
+{
+    uart_t *uart = &uartPorts[port];
+    const unsigned char *data = (const unsigned char *)buffer;
+
+    while (len > 0)
+    {
+        NVIC_DisableIRQ(uart->irq);
+        while (len > 0 && !Q_isFull(&uart->tx))
+        {
+            Q_enqueue(&uart->tx, *data++);
+            len--;
+        }
+        NVIC_EnableIRQ(uart->irq);
+        uart->regs->C2 |= UART_C2_TIE_MASK;
+
+        if (len > 0)
+        {
+            // Wait for the transmitter to drain instead of dropping bytes
+            osDelay(1);
+        }
+    }
+}
+
+bool uartTryWrite(uart_port_t port, const void *buffer, size_t len)
+{
+    uart_t *uart = &uartPorts[port];
+    const unsigned char *data = (const unsigned char *)buffer;
+
+    if (uart->address != 0 && (!uart->granted || osKernelGetTickCount() - uart->lastGrantMs >= UART_BUS_QUIET_MS))
+    {
+        return false;
+    }
+
+    NVIC_DisableIRQ(uart->irq);
+    bool room = Q_SIZE - uart->tx.Size >= len;
+    for (size_t i = 0; room && i < len; i++)
+    {
+        Q_enqueue(&uart->tx, data[i]);
+    }
+    NVIC_EnableIRQ(uart->irq);
+
+    if (room)
+    {
+        uart->regs->C2 |= UART_C2_TIE_MASK;
+    }
+    return room;
+}
+
+int uartRead(uart_port_t port, char *buffer, int len, bool *resync)
+{
+    uart_t *uart = &uartPorts[port];
+
+    NVIC_DisableIRQ(uart->irq);
+    int count = uartRxRead(&uart->rx, buffer, len, resync);
+    NVIC_EnableIRQ(uart->irq);
+
+    return count;
+}
+
+int uartReadFrames(uart_port_t port, frame_t *frames, int max)
+{
+    uart_t *uart = &uartPorts[port];
+
+    NVIC_DisableIRQ(uart->irq);
+    int count = uartRxReadFrames(&uart->rx, frames, max);
+    NVIC_EnableIRQ(uart->irq);
+
+    return count;
+}
+
+uint32_t uartLastReadStamp(uart_port_t port) { return uartPorts[port].rx.lastStamp; }
+
+void uartGetReceiveSpace(uart_port_t port, uint32_t *received, uint32_t *space)
+{
+    uart_t *uart = &uartPorts[port];
+
+    NVIC_DisableIRQ(uart->irq);
+    *received = uart->rx.received;
+    *space = uartRxSpace(&uart->rx);
+    NVIC_EnableIRQ(uart->irq);
+}
+
+// Framed ports: offers the packet just completed to the hook, or else queues it. Returns true if it was queued
+static bool offerFrame(uart_t *uart, uint32_t stamp)
+{
+    if (uart->frameHook != NULL && uart->frameHook((const packet_t *)uart->rx.frame, stamp))
+    {
+        return false;
+    }
+    uartRxQueueFrame(&uart->rx, stamp);
+    return true;
+}
+
+// Multidrop ports: the receiver sleeps through every packet but this node's, which opens a grant to reply in
+static bool receiveAddressed(uart_t *uart, bool mark, unsigned char data, uint8_t errors, uint32_t stamp)
+{
+    UART_Type *regs = uart->regs;
+
+    if (mark && !(errors & UART_RX_ERRORS))
+    {
+        uart->txGrant = 0; // the bridge has moved on
+        if (!uartRxAddressMark(&uart->rx, data))
+        {
+            regs->C2 |= UART_C2_RWU_MASK;
+        }
+        return false;
+    }
+
+    if (!uartRxPushFramed(&uart->rx, data, errors))
+    {
+        if (uart->rx.discarding)
+        {
+            // the rest of the broken packet is skipped by the hardware
+            regs->C2 |= UART_C2_RWU_MASK;
+        }
+        return false;
+    }
+
+    regs->C2 |= UART_C2_RWU_MASK;
+    uart->txGrant = UART_BUS_GRANT;
+    uart->lastGrantMs = osKernelGetTickCount();
+    uart->granted = true;
+    if (!Q_isEmpty(&uart->tx))
+    {
+        regs->C2 |= UART_C2_TIE_MASK;
+    }
+    return offerFrame(uart, stamp);
+}
+
+// Multidrop ports only send whole packets, so the bridge can frame each grant on its own
+static bool mayTransmit(uart_t *uart)
+{
+    if (Q_isEmpty(&uart->tx))
+    {
+        return false;
+    }
+    if (uart->address == 0)
+    {
+        return true;
+    }
+    return uart->txGrant > 0 && (uart->txGrant % PACKET_SIZE != 0 || uart->tx.Size >= PACKET_SIZE);
+}
+
+// Even parity of data, sent as the ninth bit
+static bool evenParity(unsigned char data)
+{
+    data ^= data >> 4;
+    data ^= data >> 2;
+    data ^= data >> 1;
+    return data & 1;
+}
+
+void uartHandleIRQ(uart_port_t port)
+{
+    uart_t *uart = &uartPorts[port];
+    UART_Type *regs = uart->regs;
+
+    NVIC_ClearPendingIRQ(uart->irq);
+    NVIC_DisableIRQ(uart->irq);
+
+    uint8_t status = regs->S1;
+    // Transmit
+    if (status & UART_S1_TDRE_MASK)
+    {
+        if (mayTransmit(uart))
+        {
+            unsigned char data = Q_dequeue(&uart->tx);
+            if (uart->address != 0)
+            {
+                uart->txGrant--;
+                regs->C3 = evenParity(data) ? (regs->C3 | UART_C3_T8_MASK) : (regs->C3 & ~UART_C3_T8_MASK);
+            }
+            regs->D = data;
+        }
+        else
+        {
+            regs->C2 &= ~UART_C2_TIE_MASK; // stop transmissions, until the next grant on a multidrop port
+        }
+    }
+    // Receive
+    if (status & (UART_S1_RDRF_MASK | UART_S1_ERROR_MASK))
+    {
+        // The ninth bit has to be read before D. Reading D after S1 clears RDRF, and the error flags on UART1/2
+        bool mark = (uart->address != 0) && (regs->C3 & UART_C3_R8_MASK);
+        unsigned char data = regs->D;
+
+        if ((status & (UART_S1_ERROR_MASK | UART_S1_IDLE_MASK)) && uart->lowPower)
+        {
+            // the receiver stops storing data until OR is cleared, and an IDLE from before this byte is stale
+            regs->S1 = status & (UART_S1_ERROR_MASK | UART_S1_IDLE_MASK);
+        }
+
+        uint8_t errors = status & UART_S1_ERROR_MASK;
+        uint32_t stamp = osKernelGetSysTimerCount();
+        bool release;
+        if (uart->address != 0)
+        {
+            release = receiveAddressed(uart, mark, data, errors, stamp);
+        }
+        else if (uart->rx.frames != NULL)
+        {
+            release = uartRxPushFramed(&uart->rx, data, errors) && offerFrame(uart, stamp);
+        }
+        else
+        {
+            release = uartRxPush(&uart->rx, data, errors, stamp) && uart->rx.ring.Size >= uart->rxThreshold;
+        }
+
+        if (release && uart->rxSemaphore != NULL)
+        {
+            TRACE(TRACE_UART_RX_RELEASE, port, uartRxPending(&uart->rx));
+            osSemaphoreRelease(uart->rxSemaphore);
+        }
+
+        // Resynchronise on the next idle line if it comes while discarding or with a packet partly in
+        bool resyncOnIdle = uart->address == 0 && (uart->rx.discarding || uart->rx.frameFill != 0);
+        if (resyncOnIdle != ((regs->C2 & UART_C2_ILIE_MASK) != 0))
+        {
+            regs->C2 ^= UART_C2_ILIE_MASK;
+        }
+    }
+    // Idle line while discarding or mid-packet: the packet is over and the next byte starts a new one. An IDLE read with a
+    // byte was cleared above along with it, and ILIE stays armed for the idle line after that byte.
+    if (uartRxIdleBoundary(status) && (regs->C2 & UART_C2_ILIE_MASK))
+    {
+        if (uart->lowPower)
+        {
+            regs->S1 = UART_S1_IDLE_MASK;
+        }
+        else
+        {
+            (void)regs->D; // clears IDLE
+        }
+        regs->C2 &= ~UART_C2_ILIE_MASK;
+        // A framed port has nothing for the reader to drop
+        if (uartRxIdle(&uart->rx) && uart->rxSemaphore != NULL)
+        {
+            osSemaphoreRelease(uart->rxSemaphore);
+        }
+    }
+
+    NVIC_EnableIRQ(uart->irq);
+}
+
+void UART0_IRQHandler(void) { uartHandleIRQ(UART_PORT0); }
+
+void UART1_IRQHandler(void)
+{
+    TRACE(TRACE_UART1_ISR_ENTER, UART1_S1, 0);
+    uartHandleIRQ(UART_PORT1);
+    TRACE(TRACE_UART1_ISR_EXIT, 0, uartRxPending(&uartPorts[UART_PORT1].rx));
+}
+
+void UART2_IRQHandler(void) { uartHandleIRQ(UART_PORT2); }
+
+void uartGetStats(uart_port_t port, uart_stats_t *stats)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memcpy(stats, (const void *)&uartPorts[port].rx.stats, sizeof(uart_stats_t));
+    __set_PRIMASK(primask);
+}
+
+void uartClearStats(uart_port_t port)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset((void *)&uartPorts[port].rx.stats, 0, sizeof(uart_stats_t));
+    __set_PRIMASK(primask);
+}
+
+void uartPrintStats(void (*print)(const char *str))
+{
+    char line[128];
+
+    for (int port = 0; port < UART_PORT_COUNT; port++)
+    {
+        if (!(uartPorts[port].regs->C2 & (UART_C2_TE_MASK | UART_C2_RE_MASK)))
+        {
+            continue; // not initialised
+        }
+
+        uart_stats_t stats;
+        uartGetStats((uart_port_t)port, &stats);
+        sprintf(line, "UART%d OR %lu NF %lu FE %lu PF %lu drop %lu (full %lu) resync %lu evicted %lu others %lu\r\n",
+                port,
+                (unsigned long)stats.overrun, (unsigned long)stats.noise, (unsigned long)stats.framing,
+                (unsigned long)stats.parity, (unsigned long)stats.dropped, (unsigned long)stats.overflow,
+                (unsigned long)stats.resync, (unsigned long)stats.evicted,
+                (unsigned long)stats.others);
+        print(line);
+    }
+}
@@ -0,0 +1,201 @@
+/**
+ * @file uart.h
+ * @brief Interrupt-driven driver shared by UART0, UART1 and UART2.
+ *
+ * Each port is described by an entry in a table holding its registers,
+ * module clock, receive/transmit rings and error counters, and all three IRQ
+ * handlers run the same handler body on their entry.
+ *
+ * Current setup:
+ * UART0 on PTD6 (RX) / PTD7 (TX): debug console.
+ * UART1 on PTE1 (RX) / PTE0 (TX): ESP32 link.
+ * UART2 on PTD2 (RX) / PTD3 (TX): spare channel for a debug or telemetry link.
+ * The pins, clock gates and UART0 clock source are set up by initPins().
+ *
+ * UART0 is the low-power UART of the KL25Z. Its first eight registers have the
+ * same layout as UART1/2, but its error flags are write-1-to-clear and it is
+ * clocked from MCGFLLCLK instead of the bus clock.
+ *
+ * The receiver also keeps error statistics: every receive error flag it clears,
+ * every byte dropped because the ring was full and every time the stream had to
+ * be resynchronised after an error. They are printed by the "stats" console
+ * command and are meant for sizing rings and choosing baud rates.
+ *
+ * A port carrying packets can be made a framed one with uartSetFramed(). Its
+ * ISR then assembles packets itself and queues them whole in a frame queue
+ * (see frameq/frameq.h), each with the arrival stamp of its last byte, and the
+ * reading thread takes them out with uartReadFrames(). Each packet is first
+ * offered to an optional frame hook, still in interrupt context; a packet the
+ * hook takes is never queued, so it is never seen by the reading thread.
+ *
+ * A framed port on UART1 or UART2 can share its line with other robots as a
+ * node on a multidrop bus, with uartSetAddress(). The port then runs 9-bit
+ * characters with address-mark wakeup (C1 M and WAKE): the bridge marks the
+ * first character of each packet as an address with the ninth bit, and the
+ * receiver sleeps (C2 RWU) through every packet addressed to another node, so
+ * those cost one interrupt, for the address character, instead of one per
+ * byte. The KL25Z's match-address registers only exist on UART0, which is the
+ * console, so the address itself is compared in the ISR.
+ *
+ * The nodes share the return line too, so a node only transmits in the grant
+ * that follows each packet addressed to it: up to UART_BUS_GRANT bytes, whole
+ * packets only, ending at the next address character. Each ninth bit sent is
+ * even parity, so the bridge reads the replies as 8E1. A node the bridge is not
+ * polling, before its controller pairs or after it disconnects, never gets a
+ * grant, so periodic telemetry goes through uartTryWrite(), which drops it
+ * rather than wait for room that would never come.
+ */
+#ifndef UART_H
+#define UART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "RTE_Components.h"
+#include CMSIS_device_header
+#include "cirq/cirq.h"
+#include "cmsis_os2.h"
+#include "frameq/frameq.h"
+#include "packet/packet.h"
+#include "trace/trace.h"
+#include "uart/uart_rx.h"
+
+#define UART_INT_PRIO 128
+
+#define UART_ADDRESS_MAX 254
+#define UART_BUS_GRANT (2 * PACKET_SIZE) // bytes a multidrop node may send after each packet addressed to it
+#define UART_BUS_QUIET_MS 250            // a multidrop node not addressed for this long is not being polled
+
+typedef enum
+{
+    UART_PORT0,
+    UART_PORT1,
+    UART_PORT2,
+    UART_PORT_COUNT
+} uart_port_t;
+
+/**
+ * @brief Offered each whole packet in the port's ISR; stamp is the arrival time of its last byte. Returns true to take it.
+ */
+typedef bool (*uart_frame_hook_t)(const packet_t *packet, uint32_t stamp);
+
+typedef struct uart_t
+{
+    // Hardware description
+    UART_Type *regs; // UART0 is accessed through the same layout as UART1/2
+    IRQn_Type irq;
+    uint32_t clockHz; // UART module clock
+    bool lowPower;    // UART0: write-1-to-clear status flags, clock source selected in SIM_SOPT2 by initPins()
+
+    // Rings, only touched with the port's interrupt disabled outside the ISR
+    uart_rx_t rx; // receive ring, error counters and resynchronisation, see uart/uart_rx.h
+    Q_t tx;
+
+    // Released whenever the receive ring holds at least rxThreshold bytes, or on a framed port a packet is queued
+    osSemaphoreId_t rxSemaphore;
+    uint32_t rxThreshold;
+
+    // Framed ports only, see uartSetFramed()
+    uart_frame_hook_t frameHook;
+
+    // Multidrop ports only, see uartSetAddress()
+    uint8_t address;  // 0 on a point-to-point link
+    uint8_t txGrant;  // bytes the node may still send before the next address character
+    bool granted;     // a grant has opened since uartSetAddress()
+    volatile uint32_t lastGrantMs; // osKernelGetTickCount() when the last one opened
+} uart_t;
+
+/** @brief Receive error flags in UARTx_S1; identical bit positions on UART0 and UART1/2, and to UART_RX_ERRORS. */
+#define UART_S1_ERROR_MASK (UART_S1_OR_MASK | UART_S1_NF_MASK | UART_S1_FE_MASK | UART_S1_PF_MASK)
+
+/**
+ * @brief Configures the port after initPins(), sets the baud rate and enables its receive interrupt.
+ */
+void uartInit(uart_port_t port, uint32_t baudRate);
+
+/**
+ * @brief Changes the baud rate of an initialised port.
+ */
+void uartSetBaudRate(uart_port_t port, uint32_t baudRate);
+
+/**
+ * @brief Makes the ISR release semaphore once at least threshold bytes are waiting, or on a framed port for every packet.
+ */
+void uartSetReceiveSemaphore(uart_port_t port, osSemaphoreId_t semaphore, uint32_t threshold);
+
+/**
+ * @brief Makes the port queue whole packets in frames, offering each to hook first if it is not NULL. Call before uartInit().
+ */
+void uartSetFramed(uart_port_t port, frameq_t *frames, uart_frame_hook_t hook);
+
+/**
+ * @brief Puts an initialised framed UART1 or UART2 on a multidrop bus at address, or back on a point-to-point link with 0.
+ *
+ * The bridge at the other end has to switch to the same framing at the same time.
+ */
+void uartSetAddress(uart_port_t port, uint8_t address);
+
+/**
+ * @brief Queues len bytes for transmission.
+ *
+ * Bytes are copied into the transmit ring in bulk with the port interrupt masked
+ * once per batch, and the transmitter interrupt is armed once per batch. Returns
+ * as soon as everything is queued. If the ring fills up the calling thread sleeps
+ * until the ISR has drained it, so this must not be called from interrupt context.
+ */
+void uartWrite(uart_port_t port, const void *buffer, size_t len);
+
+/**
+ * @brief Queues all len bytes if they fit in the transmit ring, and returns true; else queues nothing. Never blocks.
+ *
+ * On a multidrop port it also refuses while the node has not been addressed
+ * for UART_BUS_QUIET_MS, as nothing queued could go out until it is.
+ */
+bool uartTryWrite(uart_port_t port, const void *buffer, size_t len);
+
+/**
+ * @brief Takes up to len received bytes without blocking. Returns the number read.
+ *
+ * Reading stops early at a resync point. When it does, *resync is set and the
+ * caller must discard any partially assembled packet before reading again.
+ * resync may be NULL for text streams.
+ */
+int uartRead(uart_port_t port, char *buffer, int len, bool *resync);
+
+/**
+ * @brief Framed ports: takes up to max packets, oldest first, without blocking. Returns the number read.
+ *
+ * Each comes with the arrival time of its last byte in osKernelGetSysTimerCount() cycles.
+ */
+int uartReadFrames(uart_port_t port, frame_t *frames, int max);
+
+/**
+ * @brief Arrival time, in osKernelGetSysTimerCount() cycles, of the last byte returned by uartRead().
+ *
+ * Only meaningful to the port's single reading thread, right after uartRead().
+ */
+uint32_t uartLastReadStamp(uart_port_t port);
+
+/**
+ * @brief Reads, as one snapshot, how many bytes the port has received since init and how many more its receive ring can take.
+ */
+void uartGetReceiveSpace(uart_port_t port, uint32_t *received, uint32_t *space);
+
+/**
+ * @brief Shared body of the UARTx_IRQHandler functions.
+ */
+void uartHandleIRQ(uart_port_t port);
+
+/**
+ * @brief Copies a consistent snapshot of a port's counters.
+ */
+void uartGetStats(uart_port_t port, uart_stats_t *stats);
+
+void uartClearStats(uart_port_t port);
+
+/**
+ * @brief Prints the counters of every initialised port as text lines through print.
+ */
+void uartPrintStats(void (*print)(const char *str));
+
+#endif
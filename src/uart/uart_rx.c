@@ -0,0 +1,200 @@
+#include "uart/uart_rx.h"
+
+#include <stddef.h>
+
+void uartRxInit(uart_rx_t *rx)
+{
+    Q_init(&rx->ring);
+    rx->received = 0;
+    rx->count = 0;
+    rx->consumed = 0;
+    rx->discarding = false;
+    rx->resyncPending = false;
+    rx->resyncAt = 0;
+    rx->lastStamp = 0;
+    rx->frameFill = 0;
+    if (rx->frames != NULL)
+    {
+        frameqInit(rx->frames);
+    }
+}
+
+void uartRxSetFrames(uart_rx_t *rx, frameq_t *frames) { rx->frames = frames; }
+
+void uartRxSetAddress(uart_rx_t *rx, uint8_t address) { rx->address = address; }
+
+static void countErrors(uart_rx_t *rx, uint8_t errors)
+{
+    if (errors & UART_RX_OVERRUN)
+    {
+        rx->stats.overrun++;
+    }
+    if (errors & UART_RX_NOISE)
+    {
+        rx->stats.noise++;
+    }
+    if (errors & UART_RX_FRAMING)
+    {
+        rx->stats.framing++;
+    }
+    if (errors & UART_RX_PARITY)
+    {
+        rx->stats.parity++;
+    }
+}
+
+bool uartRxPush(uart_rx_t *rx, unsigned char data, uint8_t errors, uint32_t stamp)
+{
+    rx->received++;
+    if (errors & UART_RX_ERRORS)
+    {
+        countErrors(rx, errors);
+        rx->discarding = true;
+        return false;
+    }
+    if (rx->discarding || Q_isFull(&rx->ring))
+    {
+        if (!rx->discarding)
+        {
+            rx->stats.overflow++;
+        }
+        rx->stats.dropped++;
+        rx->discarding = true;
+        return false;
+    }
+
+    rx->stamps[rx->ring.Tail] = stamp;
+    Q_enqueue(&rx->ring, data);
+    rx->count++;
+    return true;
+}
+
+bool uartRxPushFramed(uart_rx_t *rx, unsigned char data, uint8_t errors)
+{
+    rx->received++;
+    if (errors & UART_RX_ERRORS)
+    {
+        countErrors(rx, errors);
+    }
+    if ((errors & UART_RX_ERRORS) || rx->discarding)
+    {
+        // The rest of a broken packet is dropped up to the idle line, the part already in with it
+        rx->stats.dropped += rx->frameFill + !(errors & UART_RX_ERRORS);
+        rx->frameFill = 0;
+        rx->discarding = true;
+        return false;
+    }
+
+    rx->frame[rx->frameFill++] = data;
+    if (rx->frameFill < PACKET_SIZE)
+    {
+        return false;
+    }
+    rx->frameFill = 0;
+    return true;
+}
+
+bool uartRxAddressMark(uart_rx_t *rx, unsigned char address)
+{
+    rx->stats.dropped += rx->frameFill;
+    rx->frameFill = 0;
+    if (rx->discarding)
+    {
+        rx->discarding = false;
+        rx->stats.resync++;
+    }
+    if (address != rx->address)
+    {
+        rx->stats.others++;
+        return false;
+    }
+    return true;
+}
+
+void uartRxQueueFrame(uart_rx_t *rx, uint32_t stamp)
+{
+    if (!frameqPush(rx->frames, (const packet_t *)rx->frame, stamp))
+    {
+        rx->stats.evicted++;
+        rx->stats.dropped += PACKET_SIZE;
+    }
+}
+
+bool uartRxIdleBoundary(uint8_t status)
+{
+    return (status & UART_RX_IDLE) && !(status & (UART_RX_FULL | UART_RX_ERRORS));
+}
+
+bool uartRxIdle(uart_rx_t *rx)
+{
+    if (rx->frames != NULL && (rx->discarding || rx->frameFill != 0))
+    {
+        // Nothing of a broken packet was queued, so there is nothing for the reader to drop. A packet still partly
+        // in lost a byte without an error flag, or one end started mid-packet.
+        rx->stats.dropped += rx->frameFill;
+        rx->frameFill = 0;
+        rx->discarding = false;
+        rx->stats.resync++;
+        return false;
+    }
+    if (!rx->discarding)
+    {
+        return false;
+    }
+    rx->discarding = false;
+    rx->resyncAt = rx->count;
+    rx->resyncPending = true;
+    return true;
+}
+
+static bool atResyncPoint(uart_rx_t *rx) { return rx->resyncPending && rx->consumed == rx->resyncAt; }
+
+int uartRxRead(uart_rx_t *rx, char *buffer, int len, bool *resync)
+{
+    int count = 0;
+
+    // Stop at the resync point so bytes of a broken packet are never combined with the next one
+    while (count < len && !Q_isEmpty(&rx->ring) && !atResyncPoint(rx))
+    {
+        rx->lastStamp = rx->stamps[rx->ring.Head];
+        buffer[count++] = Q_dequeue(&rx->ring);
+        rx->consumed++;
+    }
+
+    bool resyncNow = atResyncPoint(rx);
+    if (resyncNow)
+    {
+        rx->resyncPending = false;
+        rx->stats.resync++;
+    }
+
+    if (resync != NULL)
+    {
+        *resync = resyncNow;
+    }
+    return count;
+}
+
+int uartRxReadFrames(uart_rx_t *rx, frame_t *frames, int max)
+{
+    int count = frameqDrainAll(rx->frames, frames, max);
+
+    if (count > 0)
+    {
+        rx->lastStamp = frames[count - 1].stamp;
+    }
+    return count;
+}
+
+uint32_t uartRxPending(const uart_rx_t *rx) { return (rx->frames != NULL) ? rx->frames->size : rx->ring.Size; }
+
+uint32_t uartRxSpace(const uart_rx_t *rx)
+{
+    if (rx->frames != NULL)
+    {
+        // The packet being assembled already has its slot
+        uint32_t free = (FRAMEQ_SIZE - rx->frames->size) * PACKET_SIZE;
+        return (free > rx->frameFill) ? free - rx->frameFill : 0;
+    }
+    return Q_SIZE - rx->ring.Size;
+}
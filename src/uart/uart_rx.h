@@ -0,0 +1,170 @@
+/**
+ * @file uart_rx.h
+ * @brief Hardware independent half of the UART receiver: receive ring, error accounting and resynchronisation.
+ *
+ * The packet streams have no framing bytes, so after an error or a dropped byte
+ * the receiver cannot tell where the next packet starts. The ESP32 sends each
+ * packet back to back with a gap of at least 50ms between packets, so bytes are
+ * discarded until the line goes idle and the reader is told to drop its partial
+ * packet once it has consumed every byte queued before the error.
+ *
+ * Every byte is stored with an arrival stamp from the caller's clock, so
+ * readers can tell how old the data they take out is.
+ *
+ * A port carrying packets can instead be given a frame queue (see
+ * frameq/frameq.h) with uartRxSetFrames(). Its bytes are then assembled into
+ * packets as they arrive, with uartRxPushFramed(), and only whole packets are
+ * queued. A packet broken by an error is dropped on the spot along with the
+ * rest of it up to the idle line, so readers never see a resync point, and a
+ * full queue drops its oldest packet rather than the newest bytes. A packet
+ * still partly assembled when the line goes idle lost a byte with no error
+ * flag, or one end started mid-packet, so it is dropped too.
+ *
+ * A framed port can also sit on a multidrop bus, where the sender marks the
+ * first character of every packet as an address. uartRxSetAddress() gives it
+ * its own address, and the caller hands each address character to
+ * uartRxAddressMark() instead of uartRxPushFramed(). An address character is
+ * a frame boundary, so it also ends a discard without waiting for an idle line.
+ *
+ * The interrupt handler calls uartRxPush() for every received byte and
+ * uartRxIdle() on an idle line that uartRxIdleBoundary() accepts; a thread calls uartRxRead() with the port
+ * interrupt masked. Nothing here touches hardware, so the same code runs in the
+ * host tools under tools/.
+ */
+#ifndef UART_RX_H
+#define UART_RX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cirq/cirq.h"
+#include "frameq/frameq.h"
+#include "packet/packet.h"
+
+// Receive error flags, at the same bit positions as in UARTx_S1
+#define UART_RX_PARITY 0x01  // PF
+#define UART_RX_FRAMING 0x02 // FE
+#define UART_RX_NOISE 0x04   // NF
+#define UART_RX_OVERRUN 0x08 // OR: a byte arrived before the previous one was read
+#define UART_RX_ERRORS (UART_RX_PARITY | UART_RX_FRAMING | UART_RX_NOISE | UART_RX_OVERRUN)
+#define UART_RX_IDLE 0x10 // IDLE
+#define UART_RX_FULL 0x20 // RDRF
+
+typedef struct uart_stats_t
+{
+    uint32_t overrun;
+    uint32_t noise;
+    uint32_t framing;
+    uint32_t parity;
+    uint32_t dropped;  // bytes discarded because the receive ring was full or the stream was resynchronising
+    uint32_t overflow; // of those, bytes that arrived while the ring was full
+    uint32_t resync;  // times the reader discarded a partial packet to realign with the sender
+    uint32_t evicted; // frames dropped, oldest first, to make room in a full frame queue
+    uint32_t others;  // frames addressed to other nodes on a multidrop bus
+} uart_stats_t;
+
+typedef struct uart_rx_t
+{
+    Q_t ring;
+    uint32_t stamps[Q_SIZE]; // arrival stamp of each byte in ring, at the same index
+    uint32_t lastStamp;      // stamp of the last byte taken by uartRxRead()
+    volatile uint32_t received; // bytes received since init, including dropped and erroneous ones
+    volatile uint32_t count;    // bytes put into ring since init; byte streams only
+    uint32_t consumed;       // bytes taken out of ring since init; byte streams only
+    volatile bool discarding;
+    volatile bool resyncPending;
+    volatile uint32_t resyncAt;
+    volatile uart_stats_t stats;
+
+    // Framed ports only
+    frameq_t *frames;
+    uint8_t address; // on a multidrop bus, 0 on a point-to-point link
+    uint8_t frameFill;
+    unsigned char frame[PACKET_SIZE]; // being assembled
+} uart_rx_t;
+
+/**
+ * @brief Empties the ring, and the frame queue if there is one.
+ */
+void uartRxInit(uart_rx_t *rx);
+
+/**
+ * @brief Makes the port a framed one, queuing whole packets in frames. Call before uartRxInit().
+ */
+void uartRxSetFrames(uart_rx_t *rx, frameq_t *frames);
+
+/**
+ * @brief Framed ports: puts the port on a multidrop bus at address, or back on a point-to-point link with 0.
+ */
+void uartRxSetAddress(uart_rx_t *rx, uint8_t address);
+
+/**
+ * @brief Handles one received byte. errors holds the UART_RX_* flags reported with it, stamp its arrival time.
+ *
+ * Returns true if the byte was queued. After an error or a drop, rx->discarding
+ * is set until uartRxIdle() is called.
+ */
+bool uartRxPush(uart_rx_t *rx, unsigned char data, uint8_t errors, uint32_t stamp);
+
+/**
+ * @brief Framed ports: handles one received byte. Returns true once it completes a packet, left in rx->frame.
+ *
+ * The packet is not queued yet: the caller may act on it itself, or pass it
+ * on with uartRxQueueFrame().
+ */
+bool uartRxPushFramed(uart_rx_t *rx, unsigned char data, uint8_t errors);
+
+/**
+ * @brief Multidrop ports: handles an address character. Returns true if the packet it starts is for this node.
+ *
+ * Any partial packet is dropped and a discard ends here. Address characters are
+ * not counted in rx->received, which tracks the packet bytes sent to this node.
+ */
+bool uartRxAddressMark(uart_rx_t *rx, unsigned char address);
+
+/**
+ * @brief Framed ports: queues the packet just completed, stamped with stamp, dropping the oldest one if the queue is full.
+ */
+void uartRxQueueFrame(uart_rx_t *rx, uint32_t stamp);
+
+/**
+ * @brief Whether status, the UART_RX_* flags read in one interrupt, holds an idle line that ends a packet.
+ *
+ * IDLE stays set until the next byte is read. Read together with a byte or an
+ * error, it was set by the gap before that byte, so it is not the end of the
+ * packet the byte belongs to.
+ */
+bool uartRxIdleBoundary(uint8_t status);
+
+/**
+ * @brief Handles an idle line. Returns true if it ended a discard and set a resync point.
+ *
+ * On a framed port it also drops a partly assembled packet.
+ */
+bool uartRxIdle(uart_rx_t *rx);
+
+/**
+ * @brief Takes up to len bytes. Returns the number read.
+ *
+ * Reading stops early at a resync point. When it does, *resync is set and the
+ * caller must discard any partially assembled packet before reading again.
+ * resync may be NULL for text streams.
+ */
+int uartRxRead(uart_rx_t *rx, char *buffer, int len, bool *resync);
+
+/**
+ * @brief Framed ports: takes up to max queued packets, oldest first. Returns the number taken.
+ */
+int uartRxReadFrames(uart_rx_t *rx, frame_t *frames, int max);
+
+/**
+ * @brief Bytes, or on a framed port packets, waiting to be read.
+ */
+uint32_t uartRxPending(const uart_rx_t *rx);
+
+/**
+ * @brief Bytes the port can still take before it has to drop any.
+ */
+uint32_t uartRxSpace(const uart_rx_t *rx);
+
+#endif
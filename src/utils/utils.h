@@ -7,6 +7,7 @@
 
 #define DELAY_DURATION 0x80000
 
+// Busy-waits nof loop iterations. Only for code running before the kernel; use timer/timer.h otherwise.
 void delay(volatile uint32_t nof);
 
 int normalise(int val);
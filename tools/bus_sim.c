@@ -0,0 +1,515 @@
+/**
+ * @file bus_sim.c
+ * @brief Host-side simulation of several robots sharing one multidrop UART1 bus with the ESP32 bridge.
+ *
+ * Each robot runs the firmware's receive path from uart/uart_rx.c at its own
+ * bus address, as the UART1 ISR drives it: address characters go to
+ * uartRxAddressMark(), the rest to uartRxPushFramed(), and the receiver sleeps
+ * (C2 RWU) through packets for other robots. The bridge schedules the way
+ * ps4_controller.ino does in bus mode: each controller's newest stick state
+ * is kept per robot, robots with something to send are served round robin,
+ * one packet at a time, and after each packet the addressed robot gets a
+ * grant of UART_BUS_GRANT bytes to answer in, closed after three character
+ * times of silence or once it is used up. The bridge notices the window has
+ * closed on its next poll, every --poll-us.
+ *
+ * Characters are 11 bits (start, 8 data, address/parity bit, stop). The
+ * bridge can only produce the ninth bit by switching the parity of its UART,
+ * which costs --gap-us after every character it sends.
+ *
+ * Each robot answers with --replies packets a second (credits, ping echoes,
+ * battery reports), queued in a transmit ring of the firmware's size and sent
+ * --turnaround-us after the packet that opens its grant. A robot that cannot
+ * start within the window is counted as late: on the real bus its reply would
+ * collide with the next robot's, or be cut off by the next address character.
+ * Replies are queued the way receive_packet_thread does with uartTryWrite():
+ * dropped when the ring is full, or when the robot has not been addressed for
+ * UART_BUS_QUIET_MS. --blocking-writes queues them with a uartWrite() that
+ * waits for room instead, stalling the robot's packet thread meanwhile.
+ *
+ * --unpolled N leaves the last N robots without a controller, as before it
+ * pairs or after it disconnects: the bridge never addresses them, so they
+ * never get a grant. For each robot the longest stall of its packet thread is
+ * reported; one longer than the health deadline plus the COP timeout would
+ * reset the robot (see health/health.h).
+ *
+ * Reported per robot: packets delivered per second, stick states coalesced
+ * away, latency from a stick state being read to its packet being complete
+ * at the robot (mean, 95th percentile, max), receive interrupts per second
+ * with and without address-mark wakeup, and reply throughput and latency.
+ * Then the aggregate throughput, how busy the line is and Jain's fairness
+ * index over the packets each robot received.
+ *
+ * Build from the repository root (Linux or macOS):
+ *
+ *   cc -std=c99 -O2 -Isrc -o bus_sim tools/bus_sim.c src/uart/uart_rx.c src/cirq/cirq.c src/frameq/frameq.c -lm
+ *
+ * Examples:
+ *
+ *   ./bus_sim
+ *   ./bus_sim --robots 8 --rate 50
+ *   ./bus_sim --robots 4 --baud 115200 --poll-us 100
+ *   ./bus_sim --robots 4 --unpolled 1 --seconds 10
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cirq/cirq.h"
+#include "frameq/frameq.h"
+#include "packet/packet.h"
+#include "uart/uart_rx.h"
+
+#define UART_BUS_GRANT (2 * PACKET_SIZE) // as in uart/uart.h, which needs the device headers
+#define UART_BUS_QUIET_MS 250
+#define HEALTH_RESET_MS (250 + 1024) // HEALTH_PACKET's deadline, then the COP timeout
+#define BITS_PER_CHAR 11
+#define SILENCE_CHARS 3
+#define ROBOTS_MAX 32
+#define COMMAND_DRIVE 1
+#define COMMAND_CREDIT 34
+
+typedef struct options_t
+{
+    int robots;
+    double baud;
+    double rate;    // stick states per second per controller
+    double replies; // packets per second each robot answers with
+    double gapUs;
+    double turnaroundUs;
+    double pollUs;
+    double seconds;
+    unsigned seed;
+    int unpolled;        // robots, counted from the last, whose controller is not connected
+    bool blockingWrites; // queue replies with a uartWrite() that waits for room
+} options_t;
+
+typedef struct samples_t
+{
+    double *values;
+    size_t count, capacity;
+} samples_t;
+
+typedef struct robot_t
+{
+    // KL25Z side
+    uart_rx_t rx;
+    frameq_t frames;
+    Q_t tx;
+    double replyStamps[Q_SIZE / PACKET_SIZE]; // when each packet in tx was queued, oldest first
+    int replyHead;
+    bool asleep;
+    uint8_t grant;
+    double lastGrant;    // when the last packet addressed to it completed
+    double stalledSince; // packet thread waiting in uartWrite() since, or negative
+    double stallMax;
+    uint64_t wakeInterrupts; // with address-mark wakeup
+    uint64_t allInterrupts;  // taking every character
+
+    // Bridge side
+    bool drivePending;
+    double driveStamp; // when the pending stick state was read
+    double nextUpdate;
+    double nextReply;
+    uint32_t coalesced;
+
+    // Results
+    uint32_t delivered;
+    samples_t latency;
+    uint32_t replies, dropped, late;
+    samples_t replyLatency;
+} robot_t;
+
+static options_t opt;
+static robot_t robots[ROBOTS_MAX];
+static double lineBusyUs;
+
+static void addSample(samples_t *s, double value)
+{
+    if (s->count == s->capacity)
+    {
+        s->capacity = s->capacity ? s->capacity * 2 : 1024;
+        s->values = realloc(s->values, s->capacity * sizeof(double));
+        if (s->values == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->values[s->count++] = value;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void summarise(samples_t *s, double *mean, double *p95, double *max)
+{
+    *mean = *p95 = *max = 0;
+    if (s->count == 0)
+    {
+        return;
+    }
+    qsort(s->values, s->count, sizeof(double), compareDoubles);
+    double sum = 0;
+    for (size_t i = 0; i < s->count; i++)
+    {
+        sum += s->values[i];
+    }
+    *mean = sum / s->count;
+    *p95 = s->values[s->count * 95 / 100];
+    *max = s->values[s->count - 1];
+}
+
+static double charUs(void) { return BITS_PER_CHAR * 1e6 / opt.baud; }
+
+// Controllers and reply sources up to time now
+static void advance(double now)
+{
+    for (int i = 0; i < opt.robots; i++)
+    {
+        robot_t *r = &robots[i];
+        while (r->nextUpdate <= now)
+        {
+            if (r->drivePending)
+            {
+                r->coalesced++;
+            }
+            r->drivePending = true;
+            r->driveStamp = r->nextUpdate;
+            r->nextUpdate += 1e6 / opt.rate;
+        }
+        while (opt.replies > 0 && r->nextReply <= now && r->stalledSince < 0)
+        {
+            bool room = Q_SIZE - r->tx.Size >= PACKET_SIZE;
+            bool polled = r->nextReply - r->lastGrant < UART_BUS_QUIET_MS * 1e3;
+            if (opt.blockingWrites && !room)
+            {
+                r->stalledSince = r->nextReply; // finishes once a grant makes room
+                break;
+            }
+            if (!opt.blockingWrites && !(room && polled))
+            {
+                r->dropped++; // uartTryWrite() refuses it
+            }
+            else
+            {
+                int slot = (r->replyHead + r->tx.Size / PACKET_SIZE) % (Q_SIZE / PACKET_SIZE);
+                r->replyStamps[slot] = r->nextReply;
+                Q_enqueue(&r->tx, 0);
+                Q_enqueue(&r->tx, 0);
+                Q_enqueue(&r->tx, COMMAND_CREDIT);
+            }
+            r->nextReply += 1e6 / opt.replies;
+        }
+    }
+}
+
+// Ends a stall of the robot's packet thread at time now, or at the end of the run
+static void endStall(robot_t *r, double now)
+{
+    if (r->stalledSince >= 0)
+    {
+        r->stallMax = fmax(r->stallMax, now - r->stalledSince);
+        r->stalledSince = -1;
+    }
+}
+
+// One character on the bridge's transmit line at time now, as each robot's UART1 ISR sees it
+static void deliver(unsigned char data, bool mark, double now)
+{
+    for (int i = 0; i < opt.robots; i++)
+    {
+        robot_t *r = &robots[i];
+        r->allInterrupts++;
+        if (r->asleep && !mark)
+        {
+            continue;
+        }
+        r->wakeInterrupts++;
+
+        if (mark)
+        {
+            r->grant = 0;
+            r->asleep = !uartRxAddressMark(&r->rx, data);
+        }
+        else if (uartRxPushFramed(&r->rx, data, 0))
+        {
+            r->asleep = true;
+            r->grant = UART_BUS_GRANT;
+            r->lastGrant = now;
+            uartRxQueueFrame(&r->rx, 0);
+        }
+    }
+}
+
+static double nextEvent(void)
+{
+    double next = INFINITY;
+    for (int i = 0; i < opt.robots; i++)
+    {
+        next = fmin(next, robots[i].nextUpdate);
+    }
+    return next;
+}
+
+// Round robin over the robots with a stick state waiting, starting after the last one served
+static int pickRobot(int start)
+{
+    for (int n = 0; n < opt.robots; n++)
+    {
+        int i = (start + n) % opt.robots;
+        if (robots[i].drivePending)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The addressed robot's grant: whole reply packets, or silence until the bridge gives up
+static double replyWindow(robot_t *r, double now)
+{
+    double silence = SILENCE_CHARS * charUs();
+
+    advance(now);
+    if (r->tx.Size < PACKET_SIZE)
+    {
+        return now + silence;
+    }
+    if (opt.turnaroundUs >= silence)
+    {
+        r->late++;
+        return now + silence;
+    }
+
+    double t = now + opt.turnaroundUs;
+    while (r->grant >= PACKET_SIZE && r->tx.Size >= PACKET_SIZE)
+    {
+        for (int b = 0; b < PACKET_SIZE; b++)
+        {
+            Q_dequeue(&r->tx);
+        }
+        r->grant -= PACKET_SIZE;
+        t += PACKET_SIZE * charUs();
+        lineBusyUs += PACKET_SIZE * charUs();
+        r->replies++;
+        addSample(&r->replyLatency, (t - r->replyStamps[r->replyHead]) / 1000);
+        r->replyHead = (r->replyHead + 1) % (Q_SIZE / PACKET_SIZE);
+        endStall(r, t);
+    }
+    return (r->grant < PACKET_SIZE) ? t : t + silence;
+}
+
+static void run(void)
+{
+    srand(opt.seed);
+    for (int i = 0; i < opt.robots; i++)
+    {
+        robot_t *r = &robots[i];
+        memset(r, 0, sizeof(*r));
+        uartRxSetFrames(&r->rx, &r->frames);
+        uartRxInit(&r->rx);
+        uartRxSetAddress(&r->rx, (uint8_t)(i + 1));
+        Q_init(&r->tx);
+        r->asleep = true;
+        r->lastGrant = -INFINITY;
+        r->stalledSince = -1;
+        // The controllers are not in step with each other
+        r->nextUpdate = (rand() / (double)RAND_MAX) * 1e6 / opt.rate;
+        if (i >= opt.robots - opt.unpolled)
+        {
+            r->nextUpdate = INFINITY;
+        }
+        r->nextReply = (opt.replies > 0) ? (rand() / (double)RAND_MAX) * 1e6 / opt.replies : INFINITY;
+    }
+
+    double end = opt.seconds * 1e6;
+    double t = 0;
+    int start = 0;
+    while (t < end)
+    {
+        advance(t);
+        int i = pickRobot(start);
+        if (i < 0)
+        {
+            t = fmax(t, nextEvent());
+            continue;
+        }
+        start = (i + 1) % opt.robots;
+
+        robot_t *r = &robots[i];
+        double stamp = r->driveStamp;
+        r->drivePending = false;
+
+        const unsigned char frame[1 + PACKET_SIZE] = {(unsigned char)(i + 1), 128, 128, COMMAND_DRIVE};
+        for (int b = 0; b < (int)sizeof(frame); b++)
+        {
+            t += charUs() + opt.gapUs;
+            lineBusyUs += charUs();
+            deliver(frame[b], b == 0, t);
+        }
+
+        frame_t received[FRAMEQ_SIZE];
+        int count = frameqDrainAll(&r->frames, received, FRAMEQ_SIZE);
+        r->delivered += count;
+        if (count > 0)
+        {
+            addSample(&r->latency, (t - stamp) / 1000);
+        }
+
+        t = replyWindow(r, t);
+        if (opt.pollUs > 0)
+        {
+            t = ceil(t / opt.pollUs) * opt.pollUs;
+        }
+    }
+
+    advance(end);
+    for (int i = 0; i < opt.robots; i++)
+    {
+        endStall(&robots[i], end);
+    }
+}
+
+static void report(void)
+{
+    double seconds = opt.seconds;
+    double total = 0, sum = 0, squares = 0;
+    int polled = opt.robots - opt.unpolled;
+    int resets = 0;
+
+    printf("%d robots at %.0f baud, %d-bit characters, %.0f stick states/s each, %.0f replies/s each\n\n", opt.robots,
+           opt.baud, BITS_PER_CHAR, opt.rate, opt.replies);
+    printf("%-6s %9s %9s  %-22s %-17s %9s  %-14s %7s %5s %9s\n", "robot", "frames/s", "coalesced",
+           "latency ms mean/p95/max", "rx irq/s wake/all", "replies/s", "reply ms mean/max", "dropped", "late",
+           "stall ms");
+    for (int i = 0; i < opt.robots; i++)
+    {
+        robot_t *r = &robots[i];
+        double mean, p95, max, replyMean, replyP95, replyMax;
+        summarise(&r->latency, &mean, &p95, &max);
+        summarise(&r->replyLatency, &replyMean, &replyP95, &replyMax);
+
+        double rate = r->delivered / seconds;
+        total += rate;
+        if (i < polled)
+        {
+            sum += r->delivered;
+            squares += (double)r->delivered * r->delivered;
+        }
+        resets += r->stallMax / 1000 > HEALTH_RESET_MS;
+
+        printf("%-6d %9.1f %9lu  %6.1f %6.1f %7.1f   %7.0f %8.0f  %9.1f  %6.1f %7.1f %7lu %5lu %9.1f%s\n", i + 1, rate,
+               (unsigned long)r->coalesced, mean, p95, max, r->wakeInterrupts / seconds, r->allInterrupts / seconds,
+               r->replies / seconds, replyMean, replyMax, (unsigned long)r->dropped, (unsigned long)r->late,
+               r->stallMax / 1000, (i < polled) ? "" : "  unpolled");
+    }
+
+    printf("\ntotal %.1f frames/s, line busy %.1f%%, fairness %.3f over the polled robots\n", total,
+           lineBusyUs / (seconds * 1e4), (squares > 0) ? sum * sum / (polled * squares) : 1.0);
+    if (resets > 0)
+    {
+        printf("%d robots stalled their packet thread past the health deadline and COP timeout, and would reset\n",
+               resets);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --robots N         robots on the bus, 1..%d (4)\n"
+            "  --baud N           line rate (9600)\n"
+            "  --rate N           stick states per second per controller (20)\n"
+            "  --replies N        packets per second each robot sends back (12)\n"
+            "  --gap-us N         bridge idle time after each character, for switching parity (50)\n"
+            "  --turnaround-us N  robot's delay from its packet to its first reply byte (200)\n"
+            "  --poll-us N        bridge polling period, 0 to act at once (1000)\n"
+            "  --seconds N        simulated time (60)\n"
+            "  --seed N           controller phases (1)\n"
+            "  --unpolled N       robots, from the last, with no controller connected (0)\n"
+            "  --blocking-writes  queue replies with a uartWrite() that waits for room, as before uartTryWrite()\n",
+            name, ROBOTS_MAX);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    opt = (options_t){.robots = 4,
+                      .baud = 9600,
+                      .rate = 20,
+                      .replies = 12,
+                      .gapUs = 50,
+                      .turnaroundUs = 200,
+                      .pollUs = 1000,
+                      .seconds = 60,
+                      .seed = 1};
+
+    static const struct option longOptions[] = {
+        {"robots", required_argument, NULL, 'n'},     {"baud", required_argument, NULL, 'b'},
+        {"rate", required_argument, NULL, 'r'},       {"replies", required_argument, NULL, 'a'},
+        {"gap-us", required_argument, NULL, 'g'},     {"turnaround-us", required_argument, NULL, 't'},
+        {"poll-us", required_argument, NULL, 'p'},    {"seconds", required_argument, NULL, 's'},
+        {"seed", required_argument, NULL, 'e'},       {"unpolled", required_argument, NULL, 'u'},
+        {"blocking-writes", no_argument, NULL, 'w'},  {NULL, 0, NULL, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            opt.robots = atoi(optarg);
+            break;
+        case 'b':
+            opt.baud = strtod(optarg, NULL);
+            break;
+        case 'r':
+            opt.rate = strtod(optarg, NULL);
+            break;
+        case 'a':
+            opt.replies = strtod(optarg, NULL);
+            break;
+        case 'g':
+            opt.gapUs = strtod(optarg, NULL);
+            break;
+        case 't':
+            opt.turnaroundUs = strtod(optarg, NULL);
+            break;
+        case 'p':
+            opt.pollUs = strtod(optarg, NULL);
+            break;
+        case 's':
+            opt.seconds = strtod(optarg, NULL);
+            break;
+        case 'e':
+            opt.seed = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            opt.unpolled = atoi(optarg);
+            break;
+        case 'w':
+            opt.blockingWrites = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opt.robots < 1 || opt.robots > ROBOTS_MAX || opt.baud <= 0 || opt.rate <= 0 || opt.replies < 0 ||
+        opt.gapUs < 0 || opt.turnaroundUs < 0 || opt.pollUs < 0 || opt.seconds <= 0 || opt.unpolled < 0 ||
+        opt.unpolled >= opt.robots)
+    {
+        usage(argv[0]);
+    }
+
+    run();
+    report();
+    return 0;
+}
@@ -0,0 +1,434 @@
+/**
+ * @file fuzz_receive.c
+ * @brief libFuzzer target for the UART1 receive path, doubling as its throughput benchmark.
+ *
+ * The first input byte selects what is exercised, the rest drives it:
+ *
+ *   0  deserialize() fed in chunks. Each chunk is a length byte (0-7, so
+ *      chunks longer than a packet are covered) followed by that many bytes.
+ *   1  Q_enqueue()/Q_dequeue() sequences checked against a shadow FIFO.
+ *      Bytes with the top bit set enqueue their low bits, others dequeue.
+ *   2  the byte ring receive path UART1 used before its frame queue:
+ *      uartRxPush()/uartRxIdle() as called by the ISR and receivePacket() as
+ *      called by the reading thread. Input is (control, data) pairs; control
+ *      bit 0 delivers data with a framing error, bit 1 reports an idle line
+ *      first and bit 2 runs the thread after the byte even below the threshold.
+ *   3  the framed receive path UART1 runs now: uartRxPushFramed(),
+ *      uartRxQueueFrame() and uartRxIdle() as called by the ISR, and
+ *      uartRxReadFrames() as called by receive_packet_thread, with the same
+ *      (control, data) pairs. Every packet taken, the drop and eviction
+ *      counts and uartRxSpace() are checked against a shadow of the framer
+ *      and its drop-oldest queue.
+ *
+ * Fuzzing, with clang from the repository root:
+ *
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined -Isrc -o fuzz_receive tools/fuzz_receive.c \
+ *       src/uart/uart_rx.c src/serialize/serialize.c src/cirq/cirq.c src/frameq/frameq.c
+ *   ./fuzz_receive -max_len=512 corpus/ tools/corpus/receive
+ *
+ * Benchmark, with any C99 compiler:
+ *
+ *   cc -std=c99 -O2 -DFUZZ_BENCHMARK -Isrc -o bench_receive tools/fuzz_receive.c \
+ *       src/uart/uart_rx.c src/serialize/serialize.c src/cirq/cirq.c src/frameq/frameq.c
+ *   ./bench_receive tools/corpus/receive
+ *
+ * The benchmark replays every corpus file (arguments may be files or
+ * directories) through the same entry point and
+ * prints bytes and packets per second for each selector, so a faster parser is
+ * measured on exactly the inputs it has to survive. Add interesting inputs
+ * found while fuzzing to tools/corpus/receive.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cirq/cirq.h"
+#include "frameq/frameq.h"
+#include "packet/packet.h"
+#include "serialize/serialize.h"
+#include "uart/uart_rx.h"
+
+#define CHECK(condition)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(condition))                                                                                              \
+        {                                                                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                              \
+            abort();                                                                                                   \
+        }                                                                                                              \
+    } while (0)
+
+#define TARGET_COUNT 4
+
+// packets decoded by the last input, for the benchmark
+static size_t packetsDecoded;
+
+static void fuzzDeserialize(const uint8_t *data, size_t size)
+{
+    size_t bytesIn = 0;
+    size_t i = 0;
+
+    deserializeReset();
+    while (i < size)
+    {
+        size_t len = data[i++] % 8;
+        if (len > size - i)
+        {
+            len = size - i;
+        }
+
+        packet_t packet;
+        if (deserialize((const char *)data + i, (int)len, &packet) == PACKET_OK)
+        {
+            packetsDecoded++;
+        }
+        bytesIn += len;
+        i += len;
+
+        // every packet must be made of bytes that were passed in
+        CHECK(packetsDecoded * PACKET_SIZE <= bytesIn);
+    }
+}
+
+static void fuzzQueue(const uint8_t *data, size_t size)
+{
+    Q_t q;
+    unsigned char shadow[Q_SIZE];
+    size_t head = 0, count = 0;
+
+    Q_init(&q);
+    for (size_t i = 0; i < size; i++)
+    {
+        if (data[i] & 0x80)
+        {
+            unsigned char value = data[i] & 0x7F;
+            int ok = Q_enqueue(&q, value);
+            CHECK(ok == (count < Q_SIZE));
+            if (ok)
+            {
+                shadow[(head + count) % Q_SIZE] = value;
+                count++;
+            }
+        }
+        else
+        {
+            unsigned char value = Q_dequeue(&q);
+            if (count > 0)
+            {
+                CHECK(value == shadow[head]);
+                head = (head + 1) % Q_SIZE;
+                count--;
+            }
+            else
+            {
+                CHECK(value == 0);
+            }
+        }
+        CHECK(q.Size == count);
+        CHECK(Q_isEmpty(&q) == (count == 0));
+        CHECK(Q_isFull(&q) == (count == Q_SIZE));
+        CHECK(q.Head < Q_SIZE && q.Tail < Q_SIZE);
+    }
+}
+
+static uart_rx_t rx;
+static frameq_t frames;
+
+static int readRing(char *buffer, int len, bool *resync) { return uartRxRead(&rx, buffer, len, resync); }
+
+static void runThread(void)
+{
+    packet_t packet;
+    if (receivePacket(readRing, &packet) == PACKET_OK)
+    {
+        packetsDecoded++;
+    }
+    CHECK(rx.consumed <= rx.count);
+    CHECK(rx.count - rx.consumed == rx.ring.Size);
+}
+
+static void fuzzReceivePath(const uint8_t *data, size_t size)
+{
+    uartRxSetFrames(&rx, NULL);
+    uartRxInit(&rx);
+    deserializeReset();
+
+    for (size_t i = 0; i + 1 < size; i += 2)
+    {
+        uint8_t control = data[i];
+        bool release = false;
+
+        if ((control & 0x02) && uartRxIdle(&rx))
+        {
+            release = true;
+        }
+        if (uartRxPush(&rx, data[i + 1], (control & 0x01) ? UART_RX_FRAMING : 0, (uint32_t)i))
+        {
+            release = release || rx.ring.Size >= PACKET_SIZE;
+        }
+        CHECK(rx.ring.Size <= Q_SIZE);
+
+        if (release || (control & 0x04))
+        {
+            runThread();
+        }
+    }
+    CHECK(packetsDecoded * PACKET_SIZE <= rx.consumed);
+}
+
+// What the framed receive path should hold: the packet being assembled and the queue, oldest first
+typedef struct shadow_t
+{
+    unsigned char fill[PACKET_SIZE];
+    size_t fillCount;
+    bool discarding;
+    frame_t queue[FRAMEQ_SIZE];
+    size_t head, count;
+    uint32_t completed, evicted, errors;
+} shadow_t;
+
+static shadow_t shadow;
+
+// Returns true if byte completes a packet
+static bool shadowPush(unsigned char byte, bool error, uint32_t stamp)
+{
+    if (error)
+    {
+        shadow.errors++;
+        shadow.fillCount = 0;
+        shadow.discarding = true;
+        return false;
+    }
+    if (shadow.discarding)
+    {
+        return false;
+    }
+
+    shadow.fill[shadow.fillCount++] = byte;
+    if (shadow.fillCount < PACKET_SIZE)
+    {
+        return false;
+    }
+    shadow.fillCount = 0;
+    shadow.completed++;
+    if (shadow.count == FRAMEQ_SIZE)
+    {
+        shadow.head = (shadow.head + 1) % FRAMEQ_SIZE;
+        shadow.count--;
+        shadow.evicted++;
+    }
+    frame_t *slot = &shadow.queue[(shadow.head + shadow.count++) % FRAMEQ_SIZE];
+    memcpy(&slot->packet, shadow.fill, PACKET_SIZE);
+    slot->stamp = stamp;
+    return true;
+}
+
+static void runFramedThread(void)
+{
+    frame_t taken[FRAMEQ_SIZE];
+    int count = uartRxReadFrames(&rx, taken, FRAMEQ_SIZE);
+
+    CHECK((size_t)count == shadow.count);
+    for (int k = 0; k < count; k++)
+    {
+        const frame_t *expected = &shadow.queue[(shadow.head + k) % FRAMEQ_SIZE];
+        CHECK(memcmp(&taken[k].packet, &expected->packet, PACKET_SIZE) == 0);
+        CHECK(taken[k].stamp == expected->stamp);
+    }
+    shadow.head = (shadow.head + count) % FRAMEQ_SIZE;
+    shadow.count = 0;
+    packetsDecoded += count;
+}
+
+static void fuzzFramedPath(const uint8_t *data, size_t size)
+{
+    uartRxSetFrames(&rx, &frames);
+    uartRxInit(&rx);
+    memset((void *)&rx.stats, 0, sizeof(rx.stats));
+    memset(&shadow, 0, sizeof(shadow));
+
+    for (size_t i = 0; i + 1 < size; i += 2)
+    {
+        uint8_t control = data[i];
+        bool error = control & 0x01;
+
+        if (control & 0x02)
+        {
+            // Nothing of a broken packet was queued, so the reader is never told to drop anything
+            CHECK(!uartRxIdle(&rx));
+            shadow.fillCount = 0;
+            shadow.discarding = false;
+        }
+
+        bool expected = shadowPush(data[i + 1], error, (uint32_t)i);
+        bool complete = uartRxPushFramed(&rx, data[i + 1], error ? UART_RX_FRAMING : 0);
+        CHECK(complete == expected);
+        if (complete)
+        {
+            uartRxQueueFrame(&rx, (uint32_t)i);
+        }
+
+        CHECK(rx.frameFill == shadow.fillCount && rx.discarding == shadow.discarding);
+        CHECK(uartRxPending(&rx) == shadow.count);
+        CHECK(rx.stats.evicted == shadow.evicted && rx.stats.framing == shadow.errors);
+        // Every byte is in a packet queued or taken, in the one being assembled, dropped, or was an error
+        CHECK(rx.received == shadow.completed * PACKET_SIZE + shadow.fillCount +
+                                 (rx.stats.dropped - shadow.evicted * PACKET_SIZE) + shadow.errors);
+        size_t free = (FRAMEQ_SIZE - shadow.count) * PACKET_SIZE;
+        CHECK(uartRxSpace(&rx) == (free > shadow.fillCount ? free - shadow.fillCount : 0));
+        CHECK(uartRxSpace(&rx) <= FRAMEQ_SIZE * PACKET_SIZE);
+
+        if (control & 0x04)
+        {
+            runFramedThread();
+        }
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    packetsDecoded = 0;
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    switch (data[0] % TARGET_COUNT)
+    {
+    case 0:
+        fuzzDeserialize(data + 1, size - 1);
+        break;
+    case 1:
+        fuzzQueue(data + 1, size - 1);
+        break;
+    case 2:
+        fuzzReceivePath(data + 1, size - 1);
+        break;
+    case 3:
+        fuzzFramedPath(data + 1, size - 1);
+        break;
+    }
+    return 0;
+}
+
+#ifdef FUZZ_BENCHMARK
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BENCH_SECONDS 0.5
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t *readFile(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = malloc(len > 0 ? (size_t)len : 1);
+    *size = fread(data, 1, (size_t)len, f);
+    fclose(f);
+    return data;
+}
+
+static const char *names[TARGET_COUNT] = {"deserialize", "queue", "receive path", "framed path"};
+static double bytes[TARGET_COUNT], packets[TARGET_COUNT], seconds[TARGET_COUNT];
+
+static void benchFile(const char *path)
+{
+    size_t size;
+    uint8_t *data = readFile(path, &size);
+    if (size == 0)
+    {
+        free(data);
+        return;
+    }
+    int target = data[0] % TARGET_COUNT;
+
+    // repeat each input for a fixed time so short files are timed accurately
+    unsigned long runs = 0;
+    double start = nowSeconds(), elapsed;
+    do
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            LLVMFuzzerTestOneInput(data, size);
+            packets[target] += packetsDecoded;
+        }
+        runs += 64;
+        elapsed = nowSeconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    bytes[target] += (double)size * runs;
+    seconds[target] += elapsed;
+    free(data);
+}
+
+static void benchPath(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        perror(path);
+        exit(1);
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        benchFile(path);
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        benchPath(child);
+    }
+    closedir(dir);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s corpus-file-or-directory...\n", argv[0]);
+        return 2;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        benchPath(argv[i]);
+    }
+
+    for (int t = 0; t < TARGET_COUNT; t++)
+    {
+        if (seconds[t] > 0)
+        {
+            printf("%-13s %8.1f MB/s  %12.0f packets/s\n", names[t], bytes[t] / seconds[t] / 1e6,
+                   packets[t] / seconds[t]);
+        }
+    }
+    return 0;
+}
+#endif
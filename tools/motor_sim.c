@@ -0,0 +1,318 @@
+/**
+ * @file motor_sim.c
+ * @brief Host-side simulation of one wheel under the firmware's speed control, for tuning and regression checks.
+ *
+ * The wheel is a first-order plant: left alone it settles at --full-pps pulses
+ * per second times the duty, less the speed the load costs, with time constant
+ * --tau-ms. A 20-slot encoder disc on it produces edges whose times are
+ * interpolated between simulation steps and read on a 48MHz clock, as
+ * PORTA_IRQHandler stamps them with the SysTimer.
+ *
+ * Every 1/--hz seconds the same code as the TPM1 overflow interrupt runs:
+ * speedUpdate() and piStep() from control/control.c, with the open-loop duty
+ * as feed-forward. Each scenario is run open loop (duty straight from the
+ * stick, as with "speed off") and closed loop, and the step response of the
+ * true wheel speed is reported:
+ *
+ *   rise      10% to 90% of the target
+ *   over      peak above the target, in percent
+ *   settle    time after which the speed stays within 5% of the target
+ *   error     mean offset from the target over the last 500ms
+ *
+ * Finally it times speedUpdate() and piStep() for both wheels on the host. On
+ * the KL25Z the "speed" console command prints the cycles the control step
+ * takes in the interrupt.
+ *
+ * Build from the repository root (Linux or macOS):
+ *
+ *   cc -std=c99 -O2 -Isrc -o motor_sim tools/motor_sim.c src/control/control.c -lm
+ *
+ * Examples:
+ *
+ *   ./motor_sim
+ *   ./motor_sim --kp 8192 --ki 2048 --load 0.4
+ *   ./motor_sim --csv step.csv
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "control/control.h"
+
+#define CLOCK_HZ 48000000.0 // SysTimer, the core clock
+#define SPEED_MAX 255       // MOTOR_SPEED_MAX
+#define SIM_STEP_S 20e-6
+#define RUN_S 2.5
+#define LOAD_STEP_S 1.5
+#define TAIL_S 0.5
+#define SETTLE_BAND 0.05
+#define BENCH_STEPS 10000000
+
+typedef struct options_t
+{
+    int32_t kp, ki;
+    double hz;
+    double fullPps; // unloaded pulses per second at full duty
+    double tauS;
+    double load; // share of fullPps the carpet costs
+    int speed;   // stick speed stepped to, 0..SPEED_MAX
+    const char *csvPath;
+} options_t;
+
+typedef struct wheel_t
+{
+    double pps;      // true speed
+    double position; // pulses turned
+    uint32_t edges;
+    uint32_t stamp;
+} wheel_t;
+
+typedef struct result_t
+{
+    double rise, over, settle, error;
+} result_t;
+
+static options_t opt;
+
+// Plant over one simulation step, with the edges it crossed stamped by linear interpolation
+static void plantStep(wheel_t *wheel, double t, double duty, double load)
+{
+    double drive = opt.fullPps * duty - load * opt.fullPps;
+    if (drive < 0)
+    {
+        drive = 0;
+    }
+    wheel->pps += (drive - wheel->pps) * SIM_STEP_S / opt.tauS;
+
+    double next = wheel->position + wheel->pps * SIM_STEP_S;
+    for (double edge = floor(wheel->position) + 1; edge <= next; edge++)
+    {
+        double at = t + (edge - wheel->position) / (next - wheel->position) * SIM_STEP_S;
+        wheel->edges++;
+        wheel->stamp = (uint32_t)(uint64_t)(at * CLOCK_HZ);
+    }
+    wheel->position = next;
+}
+
+// loadFrom: time the carpet starts, 0 for from the start and RUN_S for never
+static result_t run(bool closed, double loadFrom, FILE *csv)
+{
+    wheel_t wheel = {0};
+    speed_est_t est;
+    pi_t pi;
+    speedInit(&est, (uint32_t)CLOCK_HZ, (uint32_t)(CLOCK_HZ * CONTROL_STALL_MS / 1000));
+    piInit(&pi, opt.kp, opt.ki, 0, SPEED_MAX);
+
+    double target = opt.fullPps * opt.speed / SPEED_MAX;
+    int32_t setpoint = (int32_t)((int64_t)opt.speed * ((int32_t)opt.fullPps << CONTROL_SPEED_SHIFT) / SPEED_MAX);
+    double period = 1.0 / opt.hz;
+    double nextControl = 0;
+    int32_t output = 0;
+
+    result_t result = {0};
+    double t10 = -1, t90 = -1, peak = 0, lastOutside = 0, tailSum = 0;
+    long tailCount = 0;
+    // A load step is measured from the moment the load arrives
+    double from = (loadFrom > 0 && loadFrom < RUN_S) ? loadFrom : 0;
+
+    for (long i = 0; i * SIM_STEP_S < RUN_S; i++)
+    {
+        double t = i * SIM_STEP_S;
+        if (t >= nextControl)
+        {
+            nextControl += period;
+            uint32_t now = (uint32_t)(uint64_t)(t * CLOCK_HZ);
+            uint32_t measured = speedUpdate(&est, wheel.edges, wheel.stamp, now);
+            output = closed ? piStep(&pi, setpoint, (int32_t)measured, opt.speed, est.fresh) : opt.speed;
+            if (csv != NULL)
+            {
+                fprintf(csv, "%.4f,%.3f,%.3f,%d\n", t, wheel.pps, measured / (double)(1 << CONTROL_SPEED_SHIFT),
+                        output);
+            }
+        }
+        plantStep(&wheel, t, (double)output / SPEED_MAX, t >= loadFrom ? opt.load : 0);
+
+        if (t < from)
+        {
+            continue;
+        }
+        if (from == 0)
+        {
+            if (t10 < 0 && wheel.pps >= 0.1 * target)
+                t10 = t;
+            if (t90 < 0 && wheel.pps >= 0.9 * target)
+                t90 = t;
+        }
+        if (wheel.pps > peak)
+            peak = wheel.pps;
+        if (fabs(wheel.pps - target) > SETTLE_BAND * target)
+            lastOutside = t;
+        if (t >= RUN_S - TAIL_S)
+        {
+            tailSum += wheel.pps;
+            tailCount++;
+        }
+    }
+
+    // Rise time is only meaningful for a step from standstill
+    result.rise = (from > 0) ? -1 : (t10 >= 0 && t90 >= 0) ? t90 - t10 : NAN;
+    result.over = (peak > target) ? (peak - target) * 100 / target : 0;
+    result.settle = (lastOutside < RUN_S - TAIL_S) ? lastOutside - from : NAN;
+    result.error = tailSum / tailCount - target;
+    return result;
+}
+
+static void printMs(double s)
+{
+    if (s < 0)
+        printf("        -");
+    else if (isnan(s))
+        printf("    never");
+    else
+        printf(" %6.0f ms", s * 1000);
+}
+
+static void report(const char *name, double loadFrom)
+{
+    for (int closed = 0; closed <= 1; closed++)
+    {
+        result_t r = run(closed, loadFrom, NULL);
+        printf("%-22s %-6s", name, closed ? "closed" : "open");
+        printMs(r.rise);
+        printf("  %5.1f%%", r.over);
+        printMs(r.settle);
+        printf("  %+6.2f pps\n", r.error);
+    }
+}
+
+static void benchmark(void)
+{
+    speed_est_t est[2];
+    pi_t pi[2];
+    struct timespec start, end;
+    int32_t sink = 0;
+
+    for (int side = 0; side < 2; side++)
+    {
+        speedInit(&est[side], (uint32_t)CLOCK_HZ, (uint32_t)(CLOCK_HZ * CONTROL_STALL_MS / 1000));
+        piInit(&pi[side], opt.kp, opt.ki, 0, SPEED_MAX);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < BENCH_STEPS; i++)
+    {
+        // An edge every other step, so both branches of speedUpdate() are taken
+        uint32_t now = i * 480000;
+        for (int side = 0; side < 2; side++)
+        {
+            uint32_t measured = speedUpdate(&est[side], i / 2, now - 1000, now);
+            sink += piStep(&pi[side], 560, (int32_t)measured, 128, est[side].fresh);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BENCH_STEPS;
+    printf("\ncontrol step for both wheels: %.1f ns on this host (%d)\n", ns, (int)(sink & 1));
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --kp N          proportional gain, Q16.16 per Q28.4 pulse per second (%d)\n"
+            "  --ki N          integral gain per control period, same units (%d)\n"
+            "  --hz N          control rate (%d)\n"
+            "  --full-pps N    unloaded pulses per second at full duty (%d)\n"
+            "  --tau-ms N      wheel time constant (60)\n"
+            "  --load F        share of full speed lost on carpet (0.3)\n"
+            "  --speed N       stick speed to step to, 0..%d (128)\n"
+            "  --csv FILE      write the closed-loop carpet step as time,pps,measured,output\n",
+            name, CONTROL_KP, CONTROL_KI, CONTROL_HZ, CONTROL_FULL_PPS, SPEED_MAX);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    opt = (options_t){.kp = CONTROL_KP,
+                      .ki = CONTROL_KI,
+                      .hz = CONTROL_HZ,
+                      .fullPps = CONTROL_FULL_PPS,
+                      .tauS = 0.06,
+                      .load = 0.3,
+                      .speed = 128};
+
+    static const struct option longOptions[] = {
+        {"kp", required_argument, NULL, 'p'},       {"ki", required_argument, NULL, 'i'},
+        {"hz", required_argument, NULL, 'h'},       {"full-pps", required_argument, NULL, 'f'},
+        {"tau-ms", required_argument, NULL, 't'},   {"load", required_argument, NULL, 'l'},
+        {"speed", required_argument, NULL, 's'},    {"csv", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'p':
+            opt.kp = (int32_t)strtol(optarg, NULL, 0);
+            break;
+        case 'i':
+            opt.ki = (int32_t)strtol(optarg, NULL, 0);
+            break;
+        case 'h':
+            opt.hz = strtod(optarg, NULL);
+            break;
+        case 'f':
+            opt.fullPps = strtod(optarg, NULL);
+            break;
+        case 't':
+            opt.tauS = strtod(optarg, NULL) / 1000;
+            break;
+        case 'l':
+            opt.load = strtod(optarg, NULL);
+            break;
+        case 's':
+            opt.speed = atoi(optarg);
+            break;
+        case 'c':
+            opt.csvPath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opt.hz <= 0 || opt.tauS <= 0 || opt.speed <= 0 || opt.speed > SPEED_MAX)
+    {
+        usage(argv[0]);
+    }
+
+    printf("step to %d/%d (%.1f pps) at %.0f Hz, kp %d, ki %d, carpet costs %.0f%% of full speed\n\n", opt.speed,
+           SPEED_MAX, opt.fullPps * opt.speed / SPEED_MAX, opt.hz, opt.kp, opt.ki, opt.load * 100);
+    printf("%-22s %-6s %9s  %6s %9s  %10s\n", "scenario", "loop", "rise", "over", "settle", "error");
+    report("flat", RUN_S);
+    report("carpet", 0);
+    report("flat, carpet at 1.5s", LOAD_STEP_S);
+
+    if (opt.csvPath != NULL)
+    {
+        FILE *csv = fopen(opt.csvPath, "w");
+        if (csv == NULL)
+        {
+            perror(opt.csvPath);
+            return 1;
+        }
+        fprintf(csv, "time,pps,measured,output\n");
+        run(true, 0, csv);
+        fclose(csv);
+    }
+
+    benchmark();
+    return 0;
+}
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""Convert a KL25Z trace dump into Chrome about:tracing JSON.
+
+Capture the output of the "trace" console command on UART0 (e.g. with a PuTTY
+session log) and run:
+
+    python3 tools/trace2chrome.py dump.txt > trace.json
+
+then load trace.json in chrome://tracing or https://ui.perfetto.dev.
+Everything outside the TRACE BEGIN / TRACE END markers is ignored, so the log
+may contain other console output.
+"""
+
+import argparse
+import json
+import sys
+
+# Keep in sync with trace_event_t in src/trace/trace.h.
+# (name, track, phase) where phase is B/E for durations and i for instants.
+EVENTS = [
+    ("UART1_IRQHandler", "UART1 ISR", "B"),
+    ("UART1_IRQHandler", "UART1 ISR", "E"),
+    ("rx semaphore release", "UART ISR", "i"),
+    ("wake", "receive_packet_thread", "i"),
+    ("packet decoded", "receive_packet_thread", "i"),
+    ("motorMsg put", "receive_packet_thread", "i"),
+    ("motorMsg get", "motor_control_thread", "i"),
+    ("TPM write", "motor_control_thread", "i"),
+    ("step", "green lights timer", "i"),
+    ("toggle", "red light timer", "i"),
+    ("note", "music timer", "i"),
+    ("deadline miss", "health_thread", "i"),
+    ("deadline recovered", "health_thread", "i"),
+]
+
+
+def parse_dumps(lines):
+    """Yield (timer frequency, [records]) for every dump found in lines."""
+    freq = None
+    records = []
+    for line in lines:
+        line = line.strip()
+        if line.startswith("TRACE BEGIN"):
+            freq = int(line.split()[2], 16)
+            records = []
+        elif line.startswith("TRACE END"):
+            if freq is not None:
+                yield freq, records
+            freq = None
+        elif freq is not None:
+            fields = line.split()
+            if len(fields) != 4:
+                continue
+            try:
+                records.append(tuple(int(f, 16) for f in fields))
+            except ValueError:
+                continue
+
+
+def to_chrome(freq, records):
+    tracks = {}
+    events = []
+    base = None
+    last = None
+    wraps = 0
+
+    for timestamp, event, arg8, arg16 in records:
+        # The 32-bit timer wraps roughly every 90 s at 48 MHz; unwrap it
+        if last is not None and timestamp < last:
+            wraps += 1
+        last = timestamp
+        ticks = timestamp + (wraps << 32)
+        if base is None:
+            base = ticks
+
+        if event < len(EVENTS):
+            name, track, phase = EVENTS[event]
+        else:
+            name, track, phase = "event %d" % event, "unknown", "i"
+        tid = tracks.setdefault(track, len(tracks) + 1)
+
+        entry = {
+            "name": name,
+            "ph": phase,
+            "ts": (ticks - base) * 1e6 / freq,
+            "pid": 1,
+            "tid": tid,
+            "args": {"arg8": arg8, "arg16": arg16},
+        }
+        if phase == "i":
+            entry["s"] = "t"
+        events.append(entry)
+
+    for track, tid in tracks.items():
+        events.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": tid, "args": {"name": track}})
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", nargs="?", help="captured console output (default: stdin)")
+    parser.add_argument("--index", type=int, default=-1, help="which dump to convert if there are several (default: last)")
+    args = parser.parse_args()
+
+    source = open(args.dump, errors="replace") if args.dump else sys.stdin
+    dumps = list(parse_dumps(source))
+    if not dumps:
+        sys.exit("no TRACE BEGIN/TRACE END block found")
+
+    json.dump(to_chrome(*dumps[args.index]), sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,1015 @@
+/**
+ * @file uart_stress.c
+ * @brief Host-side traffic generator and stress harness for the ESP32 -> KL25Z packet link.
+ *
+ * Generates the packet stream the ESP32 sends on UART1 at a configurable rate,
+ * burst size and jitter, optionally corrupts it, and delivers it in one of
+ * three ways:
+ *
+ *   host    (default) runs the firmware's receive path in-process on a virtual
+ *           clock: uart/uart_rx.c stands in for the UART1 ISR, its frame
+ *           queue (frameq/frameq.c) and flowUpdate() from flow/flow.c for
+ *           receive_packet_thread. Reports decoded frames/s, misparse rate,
+ *           recovery time after corruption, byte-to-packet latency, receive
+ *           ring overflows and the receive queue's RAM. --queue bytes runs
+ *           the byte ring and receivePacket() from serialize/serialize.c
+ *           that UART1 used before, for comparison.
+ *   pty     creates a pseudo terminal, prints the path of its slave end and
+ *           writes the stream to it in real time.
+ *   serial  writes the stream in real time to a serial device, e.g. a USB-UART
+ *           adapter wired to PTE1 and PTE0. Decoding results are then read
+ *           from the "stats" console command on UART0.
+ *
+ * With --credits the generator behaves like the ESP32 sketch under flow
+ * control: it only sends while the receiver has advertised space with
+ * COMMAND_CREDIT packets (see flow/flow.h) and otherwise keeps just the newest
+ * frame, counting the ones it replaced as coalesced. In the real-time modes the
+ * credits are read back from the same device.
+ *
+ * Build from the repository root (Linux or macOS):
+ *
+ *   cc -std=c99 -O2 -Isrc -o uart_stress tools/uart_stress.c \
+ *       src/uart/uart_rx.c src/serialize/serialize.c src/cirq/cirq.c src/frameq/frameq.c src/flow/flow.c
+ *
+ * Examples:
+ *
+ *   ./uart_stress --rate 20 --frames 20000 --flip 0.001 --framing 0.001
+ *   ./uart_stress --rate 20 --frames 20000 --late-idle 0.01
+ *   ./uart_stress --rate 200 --burst 4 --thread-latency 2000
+ *   ./uart_stress --rate 200 --burst 4 --thread-latency 2000 --queue bytes
+ *   ./uart_stress --baud 115200 --rate 500 --burst 12 --thread-latency 3000 --credits
+ *   ./uart_stress --mode serial --device /dev/ttyUSB0 --rate 50 --drop 0.01
+ *
+ * The same seed always produces the same stream, so runs before and after a
+ * protocol or queue change can be compared directly. --out saves the stream
+ * that was sent, corruption included.
+ */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flow/flow.h"
+#include "frameq/frameq.h"
+#include "packet/packet.h"
+#include "serialize/serialize.h"
+#include "uart/uart_rx.h"
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+#define NEVER UINT64_MAX
+#define NO_FRAME -1
+
+// ESP32 sketch behaviour, see ps4_controller.ino
+#define CREDIT_SETTLE_MS 30
+#define INITIAL_CREDIT Q_SIZE // assumed free space before the first credit arrives
+#define CREDIT_TIMEOUT_MS 1000
+#define SENDER_POLL_NS NS_PER_MS // the sketch polls Serial2 once per millisecond
+#define RESYNC_GAP_MS 20         // the sketch drops a partial packet after this gap
+
+typedef enum
+{
+    MODE_HOST,
+    MODE_PTY,
+    MODE_SERIAL
+} output_mode_t;
+
+typedef enum
+{
+    QUEUE_FRAMES,
+    QUEUE_BYTES
+} queue_kind_t;
+
+typedef struct options_t
+{
+    output_mode_t mode;
+    queue_kind_t queue;       // host mode: receive queue under test
+    const char *device;
+    const char *outPath;
+    uint32_t baud;
+    double rate;              // frame slots per second
+    double jitterMs;          // uniform random delay added to each slot
+    uint32_t burst;           // frames offered back to back per slot
+    uint32_t frames;          // frames to offer
+    double dropP;             // per byte: byte never reaches the receiver
+    double flipP;             // per byte: one data bit inverted
+    double insertP;           // per byte: a random byte follows it
+    double framingP;          // per byte: received with a framing error (host mode only)
+    double lateIdleP;         // per idle line: read in the same interrupt as the next byte, which has a framing error
+    uint32_t threadLatencyUs; // host mode: semaphore release to receive_packet_thread running
+    bool credits;             // honour COMMAND_CREDIT like the ESP32 sketch
+    uint32_t seed;
+} options_t;
+
+// A frame the ESP32 wants to send
+typedef struct offer_t
+{
+    uint64_t atNs;
+    packet_t packet;
+} offer_t;
+
+// One byte on the wire, as seen by the receiver
+typedef struct wire_byte_t
+{
+    uint64_t endNs; // time its stop bit completes
+    unsigned char data;
+    uint8_t errors; // UART_RX_* flags it is received with
+    bool corrupted; // injected drop before it, flip, insertion or framing error
+    bool lateIdle;  // the ISR ran late and sees the idle line before this byte in the same S1 read
+    int frameEnd;   // index of the intact frame this byte completes, else NO_FRAME
+} wire_byte_t;
+
+typedef struct wire_t
+{
+    wire_byte_t *bytes;
+    size_t count;
+    size_t capacity;
+    uint64_t lineFreeNs; // end of the last byte put on the wire
+    uint32_t dropped, flipped, inserted, framing, lateIdle;
+    bool lateIdleNext; // the receiver has not read the idle line yet, so the next byte is a lateIdle one
+} wire_t;
+
+// The ESP32 side of the link
+typedef struct sender_t
+{
+    bool creditsSeen;
+    uint8_t creditReceived;
+    uint8_t creditSpace;
+    uint8_t sentBytes;
+    uint64_t lastSendNs;
+    uint64_t lastCreditNs;
+    bool pending;
+    uint32_t pendingFrame;
+    uint32_t sent, intact, coalesced, creditsReceived;
+} sender_t;
+
+static options_t opt;
+static offer_t *offers;
+static wire_t wire;
+static sender_t sender;
+
+static uint32_t rngState;
+
+static uint32_t rng(void)
+{
+    // xorshift32: identical streams on every host for a given seed
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static double rngUnit(void) { return (rng() >> 8) / (double)(1u << 24); }
+
+static bool chance(double p) { return p > 0 && rngUnit() < p; }
+
+static uint64_t charTimeNs(void) { return 10 * NS_PER_SEC / opt.baud; } // 8N1
+
+static packet_t makeFrame(void)
+{
+    // Mostly joystick updates, with the idle packets the ESP32 sends while the sticks are centred
+    packet_t packet = {0, 0, 0};
+    if (rng() % 10 != 0)
+    {
+        packet.x = (unsigned char)rng();
+        packet.y = (unsigned char)rng();
+        packet.command = 1;
+    }
+    return packet;
+}
+
+static void generateOffers(void)
+{
+    uint64_t periodNs = (uint64_t)(NS_PER_SEC / opt.rate);
+    uint64_t slotNs = 0;
+
+    offers = calloc(opt.frames, sizeof(offer_t));
+    for (uint32_t k = 0; k < opt.frames; k++)
+    {
+        if (k % opt.burst == 0)
+        {
+            slotNs = (k / opt.burst) * periodNs;
+            if (opt.jitterMs > 0)
+            {
+                slotNs += (uint64_t)(rngUnit() * opt.jitterMs * NS_PER_MS);
+            }
+        }
+        offers[k].atNs = slotNs;
+        offers[k].packet = makeFrame();
+    }
+}
+
+static void appendByte(wire_byte_t byte)
+{
+    if (wire.count == wire.capacity)
+    {
+        wire.capacity = wire.capacity ? wire.capacity * 2 : 4096;
+        wire.bytes = realloc(wire.bytes, wire.capacity * sizeof(wire_byte_t));
+        if (wire.bytes == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    wire.bytes[wire.count++] = byte;
+}
+
+/*
+ * Puts frame k on the wire at nowNs, or as soon as the line is free, with the
+ * configured corruption. Returns true if it arrives intact.
+ */
+static bool transmitFrame(uint32_t k, uint64_t nowNs)
+{
+    uint64_t charNs = charTimeNs();
+    char buffer[PACKET_SIZE];
+    serialize(buffer, &offers[k].packet, PACKET_SIZE);
+
+    if (wire.lineFreeNs < nowNs)
+    {
+        wire.lineFreeNs = nowNs;
+    }
+
+    bool intact = true;
+    bool corruptNext = false; // a dropped byte marks the byte after it
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        if (chance(opt.dropP))
+        {
+            wire.dropped++;
+            intact = false;
+            corruptNext = true;
+            continue;
+        }
+
+        wire_byte_t byte = {.data = (unsigned char)buffer[i], .frameEnd = NO_FRAME};
+        byte.corrupted = corruptNext;
+        corruptNext = false;
+        if (chance(opt.flipP))
+        {
+            byte.data ^= (unsigned char)(1u << (rng() % 8));
+            byte.corrupted = true;
+            wire.flipped++;
+        }
+        if (wire.lateIdleNext)
+        {
+            byte.errors = UART_RX_FRAMING;
+            byte.lateIdle = true;
+            byte.corrupted = true;
+            wire.lateIdleNext = false;
+            wire.lateIdle++;
+        }
+        if (chance(opt.framingP))
+        {
+            byte.errors = UART_RX_FRAMING;
+            byte.corrupted = true;
+            wire.framing++;
+        }
+        intact = intact && !byte.corrupted;
+        wire.lineFreeNs += charNs;
+        byte.endNs = wire.lineFreeNs;
+        if (i == PACKET_SIZE - 1 && intact)
+        {
+            byte.frameEnd = (int)k;
+        }
+        appendByte(byte);
+
+        if (chance(opt.insertP))
+        {
+            wire_byte_t extra = {.data = (unsigned char)rng(), .corrupted = true, .frameEnd = NO_FRAME};
+            wire.lineFreeNs += charNs;
+            extra.endNs = wire.lineFreeNs;
+            appendByte(extra);
+            wire.inserted++;
+            intact = intact && i == PACKET_SIZE - 1;
+        }
+    }
+    // last byte of the frame dropped: count the loss against the frame itself
+    return intact && !corruptNext;
+}
+
+/*
+ * Sender, following the ESP32 sketch: without credits every frame is sent when
+ * offered; with credits a frame is only sent while the receiver has space for
+ * it, and a newer frame replaces one still waiting.
+ */
+
+static int creditAvailable(uint64_t nowNs)
+{
+    if (sender.creditsSeen && nowNs - sender.lastCreditNs > CREDIT_TIMEOUT_MS * NS_PER_MS)
+    {
+        sender.creditsSeen = false;
+    }
+    if (!opt.credits || !sender.creditsSeen)
+    {
+        return PACKET_SIZE;
+    }
+    uint8_t inFlight = sender.sentBytes - sender.creditReceived;
+    return (int)sender.creditSpace - inFlight;
+}
+
+// Returns the index of the first new wire byte, or -1 if nothing was sent
+static long senderFlush(uint64_t nowNs)
+{
+    if (!sender.pending || creditAvailable(nowNs) < PACKET_SIZE)
+    {
+        return -1;
+    }
+    size_t first = wire.count;
+    sender.intact += transmitFrame(sender.pendingFrame, nowNs);
+    sender.sent++;
+    sender.sentBytes += PACKET_SIZE;
+    sender.lastSendNs = nowNs;
+    sender.pending = false;
+    return (long)first;
+}
+
+static void senderOffer(uint32_t k)
+{
+    if (sender.pending)
+    {
+        sender.coalesced++;
+    }
+    sender.pending = true;
+    sender.pendingFrame = k;
+}
+
+static void senderCredit(const packet_t *credit, uint64_t nowNs)
+{
+    sender.creditReceived = credit->x;
+    sender.creditSpace = credit->y;
+    sender.creditsSeen = true;
+    sender.lastCreditNs = nowNs;
+    sender.creditsReceived++;
+    if (nowNs - sender.lastSendNs > CREDIT_SETTLE_MS * NS_PER_MS)
+    {
+        sender.sentBytes = sender.creditReceived; // realign after bytes lost on the wire
+    }
+}
+
+/*
+ * Host mode: the firmware receive path on a virtual clock.
+ *
+ * The UART1 ISR is reduced to uartRxPushFramed()/uartRxQueueFrame()/uartRxIdle()
+ * on the same frame queue as on the target (or uartRxPush() on the byte ring
+ * with --queue bytes), and it releases a binary semaphore under the same
+ * conditions. An idle line is normally its own interrupt; with --late-idle it
+ * can instead be read in the same S1 as the next byte, and uartRxIdleBoundary()
+ * decides what it means, as in uartHandleIRQ(). receive_packet_thread runs threadLatencyUs after a release, or
+ * FLOW_REFRESH_MS after it last ran, takes every queued packet with
+ * uartRxReadFrames() (or receivePacket()) and asks flowUpdate() for a credit,
+ * exactly like the firmware. In the frame queue the wire index of each
+ * packet's last byte stands in for its arrival stamp. Credits reach the sender
+ * after their transfer time plus the sketch's polling interval.
+ */
+
+static uart_rx_t rx;
+static frameq_t frames;
+static flow_t flow;
+
+// Wire index of every byte in rx, in the same order, to attribute decoded packets to frames
+static long ringSource[Q_SIZE];
+static unsigned int ringSourceHead, ringSourceSize;
+static long lastConsumed;
+
+static void pushSource(long index)
+{
+    ringSource[(ringSourceHead + ringSourceSize) % Q_SIZE] = index;
+    ringSourceSize++;
+}
+
+static int readRing(char *buffer, int len, bool *resync)
+{
+    int count = uartRxRead(&rx, buffer, len, resync);
+    for (int i = 0; i < count; i++)
+    {
+        lastConsumed = ringSource[ringSourceHead];
+        ringSourceHead = (ringSourceHead + 1) % Q_SIZE;
+        ringSourceSize--;
+    }
+    return count;
+}
+
+// Credits on their way from the KL25Z to the sender, in arrival order
+typedef struct credit_event_t
+{
+    uint64_t atNs;
+    packet_t packet;
+} credit_event_t;
+
+static credit_event_t *credits;
+static size_t creditHead, creditCount, creditCapacity;
+
+static void queueCredit(uint64_t atNs, const packet_t *packet)
+{
+    if (creditHead + creditCount == creditCapacity)
+    {
+        creditCapacity = creditCapacity ? creditCapacity * 2 : 256;
+        credits = realloc(credits, creditCapacity * sizeof(credit_event_t));
+        if (credits == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    credits[creditHead + creditCount].atNs = atNs;
+    credits[creditHead + creditCount].packet = *packet;
+    creditCount++;
+}
+
+typedef struct results_t
+{
+    uint32_t decoded;
+    uint32_t correct;
+    uint32_t misparsed;
+    uint32_t recoveries;
+    uint32_t unrecovered;
+    uint64_t recoverySumNs;
+    uint64_t recoveryMaxNs;
+    uint64_t latencySumNs;
+    uint64_t latencyMaxNs;
+    uint64_t endNs;
+    double wallSeconds;
+} results_t;
+
+static results_t results;
+static uint64_t corruptAt = NEVER; // first corrupted byte since the last correct packet
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void decoded(const packet_t *packet, uint64_t t)
+{
+    results_t *r = &results;
+    r->decoded++;
+    r->endNs = t;
+
+    int frame = lastConsumed >= 0 ? wire.bytes[lastConsumed].frameEnd : NO_FRAME;
+    if (frame == NO_FRAME || memcmp(packet, &offers[frame].packet, PACKET_SIZE) != 0)
+    {
+        r->misparsed++;
+        return;
+    }
+
+    r->correct++;
+    uint64_t latency = t - wire.bytes[lastConsumed].endNs;
+    r->latencySumNs += latency;
+    r->latencyMaxNs = latency > r->latencyMaxNs ? latency : r->latencyMaxNs;
+    if (corruptAt != NEVER)
+    {
+        uint64_t recovery = t - corruptAt;
+        r->recoveries++;
+        r->recoverySumNs += recovery;
+        r->recoveryMaxNs = recovery > r->recoveryMaxNs ? recovery : r->recoveryMaxNs;
+        corruptAt = NEVER;
+    }
+}
+
+static void runThread(uint64_t t)
+{
+    if (opt.queue == QUEUE_FRAMES)
+    {
+        frame_t taken[FRAMEQ_SIZE];
+        int count = uartRxReadFrames(&rx, taken, FRAMEQ_SIZE);
+        for (int i = 0; i < count; i++)
+        {
+            lastConsumed = (long)taken[i].stamp;
+            decoded(&taken[i].packet, t);
+        }
+    }
+    else
+    {
+        packet_t packet;
+        lastConsumed = NO_FRAME;
+        while (receivePacket(readRing, &packet) == PACKET_OK)
+        {
+            decoded(&packet, t);
+        }
+    }
+
+    packet_t credit;
+    if (flowUpdate(&flow, rx.received, uartRxSpace(&rx), (uint32_t)(t / NS_PER_MS), &credit))
+    {
+        queueCredit(t + PACKET_SIZE * charTimeNs() + SENDER_POLL_NS, &credit);
+    }
+}
+
+static uint64_t min64(uint64_t a, uint64_t b) { return a < b ? a : b; }
+
+static void runHost(void)
+{
+    uint64_t charNs = charTimeNs();
+    uint64_t latencyNs = (uint64_t)opt.threadLatencyUs * 1000;
+    uint64_t refreshNs = FLOW_REFRESH_MS * NS_PER_MS;
+
+    uint64_t releaseAt = NEVER;    // semaphore released, thread runs at this time
+    uint64_t timeoutAt = refreshNs; // semaphore acquire times out
+    bool idleDone = true;           // idle line already reported since the last byte
+    size_t next = 0;                // next wire byte to arrive
+    uint32_t nextOffer = 0;
+
+    uartRxSetFrames(&rx, opt.queue == QUEUE_FRAMES ? &frames : NULL);
+    uartRxInit(&rx);
+    deserializeReset();
+    flowInit(&flow);
+
+    double wallStart = nowSeconds();
+    for (;;)
+    {
+        uint64_t offerAt = nextOffer < opt.frames ? offers[nextOffer].atNs : NEVER;
+        uint64_t creditAt = creditCount > 0 ? credits[creditHead].atNs : NEVER;
+        uint64_t byteAt = next < wire.count ? wire.bytes[next].endNs : NEVER;
+        uint64_t lastEnd = next > 0 ? wire.bytes[next - 1].endNs : 0;
+        // IDLE is flagged once the line has been high for a full character after a stop bit
+        uint64_t idleAt = NEVER;
+        if (!idleDone && (byteAt == NEVER || lastEnd + charNs <= byteAt - charNs))
+        {
+            idleAt = lastEnd + charNs;
+        }
+
+        bool senderDone = nextOffer == opt.frames && !sender.pending;
+        if (senderDone && byteAt == NEVER && idleAt == NEVER && releaseAt == NEVER)
+        {
+            break;
+        }
+        uint64_t threadAt = min64(releaseAt, timeoutAt);
+        uint64_t t = min64(min64(offerAt, creditAt), min64(min64(byteAt, idleAt), threadAt));
+
+        if (t == offerAt)
+        {
+            senderOffer(nextOffer++);
+            senderFlush(t);
+        }
+        else if (t == creditAt)
+        {
+            senderCredit(&credits[creditHead].packet, t);
+            creditHead++;
+            creditCount--;
+            senderFlush(t);
+        }
+        else if (t == threadAt)
+        {
+            releaseAt = NEVER;
+            timeoutAt = t + refreshNs;
+            runThread(t);
+        }
+        else
+        {
+            bool release = false;
+            if (t == idleAt)
+            {
+                // UART1 ISR, idle line, unless it runs late and only reads it along with the next byte
+                idleDone = true;
+                if (byteAt == NEVER && chance(opt.lateIdleP))
+                {
+                    wire.lateIdleNext = true;
+                }
+                else
+                {
+                    release = uartRxIdle(&rx);
+                }
+            }
+            else
+            {
+                // UART1 ISR, received byte
+                const wire_byte_t *byte = &wire.bytes[next];
+                idleDone = false;
+                if (byte->corrupted && corruptAt == NEVER)
+                {
+                    corruptAt = t - charNs;
+                }
+                if (opt.queue == QUEUE_FRAMES)
+                {
+                    if (uartRxPushFramed(&rx, byte->data, byte->errors))
+                    {
+                        uartRxQueueFrame(&rx, (uint32_t)next);
+                        release = true;
+                    }
+                }
+                else if (uartRxPush(&rx, byte->data, byte->errors, (uint32_t)(t / 1000)))
+                {
+                    pushSource((long)next);
+                    release = rx.ring.Size >= PACKET_SIZE;
+                }
+                uint8_t status = byte->errors | UART_RX_FULL | (byte->lateIdle ? UART_RX_IDLE : 0);
+                if (uartRxIdleBoundary(status) && uartRxIdle(&rx))
+                {
+                    release = true;
+                }
+                next++;
+            }
+            if (release && releaseAt == NEVER)
+            {
+                releaseAt = t + latencyNs;
+            }
+        }
+    }
+    results.wallSeconds = nowSeconds() - wallStart;
+    results.unrecovered = corruptAt != NEVER;
+    if (wire.count > 0 && wire.bytes[wire.count - 1].endNs > results.endNs)
+    {
+        results.endNs = wire.bytes[wire.count - 1].endNs;
+    }
+}
+
+static double percent(uint32_t part, uint32_t whole) { return whole ? 100.0 * part / whole : 0.0; }
+
+static void printSenderResults(void)
+{
+    printf("frames      offered %u  sent %u  coalesced %u  intact %u\n", opt.frames, sender.sent, sender.coalesced,
+           sender.intact);
+    printf("injected    drop %u  flip %u  insert %u  framing %u  late idle %u\n", wire.dropped, wire.flipped,
+           wire.inserted, wire.framing, wire.lateIdle);
+    if (opt.credits)
+    {
+        printf("credits     %u received\n", sender.creditsReceived);
+    }
+}
+
+static void printHostResults(void)
+{
+    const results_t *r = &results;
+    double seconds = r->endNs / (double)NS_PER_SEC;
+    uart_stats_t stats;
+    memcpy(&stats, (const void *)&rx.stats, sizeof(stats));
+
+    printSenderResults();
+    printf("decoded     %u  correct %u  misparsed %u  lost %u\n", r->decoded, r->correct, r->misparsed,
+           sender.intact > r->correct ? sender.intact - r->correct : 0);
+    printf("misparse    %.3f%% of decoded packets\n", percent(r->misparsed, r->decoded));
+    if (r->recoveries > 0)
+    {
+        printf("recovery    %u events  mean %.1f ms  max %.1f ms", r->recoveries,
+               r->recoverySumNs / 1e6 / r->recoveries, r->recoveryMaxNs / 1e6);
+    }
+    else
+    {
+        printf("recovery    0 events");
+    }
+    printf("%s\n", r->unrecovered ? "  (still misaligned at the end of the run)" : "");
+    if (r->correct > 0)
+    {
+        printf("latency     mean %.2f ms  max %.2f ms  (last byte received to packet decoded)\n",
+               r->latencySumNs / 1e6 / r->correct, r->latencyMaxNs / 1e6);
+    }
+    printf("throughput  %.1f frames/s decoded on the link, %.0f frames/s through the receive path on this host\n",
+           seconds > 0 ? r->correct / seconds : 0.0, r->wallSeconds > 0 ? r->decoded / r->wallSeconds : 0.0);
+    printf("UART        OR %u NF %u FE %u PF %u drop %u (full %u) resync %u evicted %u\n", stats.overrun, stats.noise,
+           stats.framing, stats.parity, stats.dropped, stats.overflow, stats.resync, stats.evicted);
+    if (opt.queue == QUEUE_FRAMES)
+    {
+        printf("queue       frames: %zu bytes of RAM for %d packets\n", sizeof(frameq_t), FRAMEQ_SIZE);
+    }
+    else
+    {
+        printf("queue       bytes: %zu bytes of RAM for %d packets\n", sizeof(Q_t) + sizeof(rx.stamps),
+               Q_SIZE / PACKET_SIZE);
+    }
+}
+
+/*
+ * pty and serial modes: real-time writer.
+ */
+
+static speed_t baudConstant(uint32_t baud)
+{
+    switch (baud)
+    {
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    default:
+        fprintf(stderr, "unsupported baud rate %u\n", baud);
+        exit(2);
+    }
+}
+
+static void makeRaw(int fd)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+    {
+        perror("tcgetattr");
+        exit(1);
+    }
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB);
+    tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    cfsetispeed(&tio, baudConstant(opt.baud));
+    cfsetospeed(&tio, baudConstant(opt.baud));
+    if (tcsetattr(fd, TCSANOW, &tio) != 0)
+    {
+        perror("tcsetattr");
+        exit(1);
+    }
+}
+
+static int openOutput(void)
+{
+    int fd;
+    if (opt.mode == MODE_PTY)
+    {
+        fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0)
+        {
+            perror("posix_openpt");
+            exit(1);
+        }
+        printf("pty %s\n", ptsname(fd));
+        printf("press enter to start\n");
+        getchar();
+    }
+    else
+    {
+        fd = open(opt.device, O_RDWR | O_NOCTTY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "%s: %s\n", opt.device, strerror(errno));
+            exit(1);
+        }
+    }
+    makeRaw(fd);
+    return fd;
+}
+
+static uint64_t elapsedNs(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * NS_PER_SEC + now.tv_nsec - start->tv_nsec;
+}
+
+static void writeNewBytes(int fd, long first)
+{
+    if (first < 0)
+    {
+        return;
+    }
+    unsigned char buffer[2 * PACKET_SIZE];
+    size_t len = 0;
+    for (size_t i = (size_t)first; i < wire.count; i++)
+    {
+        buffer[len++] = wire.bytes[i].data;
+    }
+    if (write(fd, buffer, len) != (ssize_t)len)
+    {
+        perror("write");
+        exit(1);
+    }
+}
+
+// Reads whatever the receiver sent back and hands complete credit packets to the sender
+static void readCredits(int fd, uint64_t nowNs)
+{
+    static unsigned char packet[PACKET_SIZE];
+    static int length;
+    static uint64_t lastByteNs;
+
+    unsigned char buffer[64];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    for (ssize_t i = 0; i < n; i++)
+    {
+        if (length > 0 && nowNs - lastByteNs > RESYNC_GAP_MS * NS_PER_MS)
+        {
+            length = 0;
+        }
+        packet[length++] = buffer[i];
+        lastByteNs = nowNs;
+        if (length == PACKET_SIZE)
+        {
+            length = 0;
+            packet_t credit;
+            memcpy(&credit, packet, PACKET_SIZE);
+            if (credit.command == COMMAND_CREDIT)
+            {
+                senderCredit(&credit, nowNs);
+            }
+        }
+    }
+}
+
+static void runRealTime(void)
+{
+    int fd = openOutput();
+
+    if (opt.framingP > 0 || opt.lateIdleP > 0)
+    {
+        fprintf(stderr, "note: framing errors can only be injected in host mode\n");
+        opt.framingP = 0;
+        opt.lateIdleP = 0;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t nextOffer = 0;
+
+    while (nextOffer < opt.frames || sender.pending)
+    {
+        uint64_t now = elapsedNs(&start);
+        if (nextOffer < opt.frames && offers[nextOffer].atNs <= now)
+        {
+            senderOffer(nextOffer++);
+            writeNewBytes(fd, senderFlush(now));
+            continue;
+        }
+
+        // Sleep until the next offer, waking early for credits
+        uint64_t wakeNs = nextOffer < opt.frames ? offers[nextOffer].atNs : now + SENDER_POLL_NS;
+        int timeoutMs = (int)((wakeNs - now + NS_PER_MS - 1) / NS_PER_MS);
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, timeoutMs > 0 ? timeoutMs : 1) > 0 && (pfd.revents & POLLIN))
+        {
+            readCredits(fd, elapsedNs(&start));
+        }
+        writeNewBytes(fd, senderFlush(elapsedNs(&start)));
+    }
+    tcdrain(fd);
+
+    double seconds = elapsedNs(&start) / (double)NS_PER_SEC;
+    printSenderResults();
+    printf("rate        %.1f frames/s over %.1f s\n", seconds > 0 ? sender.sent / seconds : 0.0, seconds);
+    close(fd);
+}
+
+static void writeStream(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    for (size_t i = 0; i < wire.count; i++)
+    {
+        fputc(wire.bytes[i].data, f);
+    }
+    fclose(f);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --mode host|pty|serial   where to send the stream (host)\n"
+            "  --queue frames|bytes     host mode: frame queue, or the byte ring UART1 used before (frames)\n"
+            "  --device PATH            serial device for --mode serial\n"
+            "  --baud N                 line rate, 8N1 (9600)\n"
+            "  --rate HZ                frame slots per second (20)\n"
+            "  --burst N                frames offered back to back per slot (1)\n"
+            "  --jitter MS              random delay of up to MS added to each slot (0)\n"
+            "  --frames N               frames to offer (10000)\n"
+            "  --drop P                 probability a byte is lost\n"
+            "  --flip P                 probability a byte has one bit inverted\n"
+            "  --insert P               probability a random byte is inserted after a byte\n"
+            "  --framing P              probability a byte has a framing error (host mode)\n"
+            "  --late-idle P            probability a frame's first byte has a framing error and is read\n"
+            "                           in the same interrupt as the idle line before it (host mode)\n"
+            "  --thread-latency US      semaphore release to receive_packet_thread running (0, host mode)\n"
+            "  --credits                send only within the receiver's credit, coalescing the rest\n"
+            "  --seed N                 random seed (1)\n"
+            "  --out FILE               also write the generated byte stream to FILE\n",
+            name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    opt = (options_t){.mode = MODE_HOST, .baud = 9600, .rate = 20, .burst = 1, .frames = 10000, .seed = 1};
+
+    static const struct option longOptions[] = {
+        {"mode", required_argument, NULL, 'm'},    {"device", required_argument, NULL, 'd'},
+        {"baud", required_argument, NULL, 'b'},    {"rate", required_argument, NULL, 'r'},
+        {"burst", required_argument, NULL, 'B'},   {"jitter", required_argument, NULL, 'j'},
+        {"frames", required_argument, NULL, 'n'},  {"drop", required_argument, NULL, 'D'},
+        {"flip", required_argument, NULL, 'f'},    {"insert", required_argument, NULL, 'i'},
+        {"framing", required_argument, NULL, 'F'}, {"thread-latency", required_argument, NULL, 'l'},
+        {"credits", no_argument, NULL, 'c'},       {"seed", required_argument, NULL, 's'},
+        {"out", required_argument, NULL, 'o'},     {"queue", required_argument, NULL, 'q'},
+        {"late-idle", required_argument, NULL, 'L'}, {NULL, 0, NULL, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'm':
+            if (strcmp(optarg, "host") == 0)
+                opt.mode = MODE_HOST;
+            else if (strcmp(optarg, "pty") == 0)
+                opt.mode = MODE_PTY;
+            else if (strcmp(optarg, "serial") == 0)
+                opt.mode = MODE_SERIAL;
+            else
+                usage(argv[0]);
+            break;
+        case 'q':
+            if (strcmp(optarg, "frames") == 0)
+                opt.queue = QUEUE_FRAMES;
+            else if (strcmp(optarg, "bytes") == 0)
+                opt.queue = QUEUE_BYTES;
+            else
+                usage(argv[0]);
+            break;
+        case 'd':
+            opt.device = optarg;
+            break;
+        case 'b':
+            opt.baud = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            opt.rate = strtod(optarg, NULL);
+            break;
+        case 'B':
+            opt.burst = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            opt.jitterMs = strtod(optarg, NULL);
+            break;
+        case 'n':
+            opt.frames = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            opt.dropP = strtod(optarg, NULL);
+            break;
+        case 'f':
+            opt.flipP = strtod(optarg, NULL);
+            break;
+        case 'i':
+            opt.insertP = strtod(optarg, NULL);
+            break;
+        case 'F':
+            opt.framingP = strtod(optarg, NULL);
+            break;
+        case 'L':
+            opt.lateIdleP = strtod(optarg, NULL);
+            break;
+        case 'l':
+            opt.threadLatencyUs = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            opt.credits = true;
+            break;
+        case 's':
+            opt.seed = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            opt.outPath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || opt.baud == 0 || opt.rate <= 0 || opt.burst == 0 ||
+        (opt.mode == MODE_SERIAL && opt.device == NULL))
+    {
+        usage(argv[0]);
+    }
+
+    rngState = opt.seed ? opt.seed : 1;
+    generateOffers();
+
+    // Start with the receive ring empty, as the sketch does
+    sender.creditsSeen = opt.credits;
+    sender.creditSpace = INITIAL_CREDIT;
+
+    if (opt.mode == MODE_HOST)
+    {
+        runHost();
+        printHostResults();
+    }
+    else
+    {
+        runRealTime();
+    }
+
+    if (opt.outPath != NULL)
+    {
+        writeStream(opt.outPath);
+    }
+    return 0;
+}